@@ -1,4 +1,6 @@
+#include <ctype.h>
 #include <errno.h>
+#include <poll.h>
 #include <fcntl.h>
 #include <limits.h>
 #include <stdarg.h>
@@ -9,60 +11,33 @@
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/queue.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "control.h"
+#include "display.h"
 #include "drm_search.h"
 #include "frame_buffer.h"
+#include "line_reader.h"
+#include "mapped_file.h"
+#include "mjpeg.h"
+#include "pan.h"
+#include "perf_counters.h"
+#include "playlist.h"
+#include "prefetch.h"
+#include "pyramid.h"
+#include "preload.h"
+#include "probes.h"
 #include "read_jpeg.h"
 #include "read_heif.h"
 #include "read_png.h"
+#include "region.h"
+#include "resize.h"
 #include "util.h"
-
-// Two for double buffering.
-struct Frame_Buffer* FB0 = 0;
-struct Frame_Buffer* FB1 = 0;
-
-void swap_frame_buffers()
-{
-    struct Frame_Buffer* x = FB0;
-    FB0 = FB1;
-    FB1 = x;
-}
-
-// Allocate and memory map the two global frame buffes
-int create_two_frame_buffers(int fd_drm, uint32_t width, uint32_t height,
-            uint32_t pixel_format)
-{
-    FB0 = frame_buffer_create(fd_drm, width, height, pixel_format);
-    if (FB0 == 0) {
-        return -1;
-    }
-
-    if (frame_buffer_map(FB0)) {
-        frame_buffer_destroy(FB0);
-        FB0 = 0;
-        return -1;
-    }
-
-    FB1 = frame_buffer_create(fd_drm, width, height, pixel_format);
-    if (FB1 == 0) {
-        frame_buffer_destroy(FB0);
-        FB0 = 0;
-        return -1;
-    }
-
-    if (frame_buffer_map(FB1)) {
-        frame_buffer_destroy(FB0);
-        frame_buffer_destroy(FB1);
-        FB0 = 0;
-        FB1 = 0;
-        return -1;
-    }
-    return 0;
-}
+#include "watch.h"
 
 // Match the beginning part of a string, and return pointer to
 // the character after.
@@ -78,6 +53,13 @@ const char* match_prefix(const char* s, const char* prefix)
     return 0;
 }
 
+// Nothing but spaces, tabs or a trailing \r.
+static bool is_blank(const char* s)
+{
+    while (isspace((unsigned char)*s)) s++;
+    return *s == 0;
+}
+
 bool match_case_suffix_list(const char* s, ...)
 {
     const char* p = strrchr(s, '/');
@@ -112,8 +94,29 @@ void print_usage(FILE* out, const char* fmt, ...)
     fprintf(out, "Options:\n");
     fprintf(out, "-l, --list            List available outputs\n");
     fprintf(out, "-v, --verbose         Print details and timing\n");
+    fprintf(out, "--perf-counters       Print cpu counters for each stage\n");
     fprintf(out, "--dev=/dev/dri/card1  Specify device (rarely needed!)\n");
     fprintf(out, "--out=N               Select output port (from --list)\n");
+    fprintf(out, "--fmt=RG16            Prefer this pixel format (four-cc)\n");
+    fprintf(out, "--ack                 Print a line as each command completes\n");
+    fprintf(out, "--daemon              Take commands from the control socket\n");
+    fprintf(out, "--client              Send commands to a running --daemon\n");
+    fprintf(out, "--sync                With --client, wait until shown\n");
+    fprintf(out, "--socket=path         Also take commands from a control socket\n");
+    fprintf(out, "--canvas=WxH          Draw at WxH, the display scales it up\n");
+    fprintf(out, "--plane-scale         Let the display hardware scale images up\n");
+    fprintf(out, "--yuv                 Show jpegs as YUV, skipping the RGB conversion\n");
+    fprintf(out, "--rotate=90           Turn the picture 0, 90, 180 or 270 degrees\n");
+    fprintf(out, "--calibrate=file.jpg  Time jpeg decodes, print a --jpeg-cost to use\n");
+    fprintf(out, "--build-pyramid in.jpg out.cjp  Make a tiled pyramid of a huge jpeg\n");
+    fprintf(out, "--jpeg-cost=a,b,c,d,e Cost model for picking a jpeg decode scale\n");
+    fprintf(out, "--resizer=auto        Image resizer: auto, stbir, or fixed\n");
+    fprintf(out, "--preload-max=N       Keep up to N preloaded images (default 2)\n");
+    fprintf(out, "--prefetch=N          Read up to N upcoming files ahead (default 0)\n");
+    fprintf(out, "--playlist=file       Show a list of images on a schedule\n");
+    fprintf(out, "--duration=5          Seconds per playlist entry, by default\n");
+    fprintf(out, "--loop                Repeat the playlist forever\n");
+    fprintf(out, "--shuffle             Play the playlist in random order\n");
     fprintf(out, "\n");
     fprintf(out, "Commands:\n");
     fprintf(out, "bgcolor:ffffff Set background/border color to hex RGB.\n");
@@ -123,7 +126,16 @@ void print_usage(FILE* out, const char* fmt, ...)
     fprintf(out, "jpeg:file.jpg  Display a jpeg on the screen.\n");
     fprintf(out, "heif:file.heic Display a heif on the screen.\n");
     fprintf(out, "png:file.png   Display a png on the screen.\n");
+    fprintf(out, "cjp:file.cjp   Display a pyramid made with --build-pyramid.\n");
     fprintf(out, "file.jpg       No prefix, determine type from extension.\n");
+    fprintf(out, "zoom:file:x,y,w,h  Show part of an image, scaled to fit.\n");
+    fprintf(out, "pan:file:secs:x,y,w,h:x,y,w,h  Move from one part of an image to another.\n");
+    fprintf(out, "preload:file   Decode an image in the background for later.\n");
+    fprintf(out, "drop:file      Free a preloaded image without showing it.\n");
+    fprintf(out, "data:jpeg:N    Display the N bytes of jpeg (or png, heif) that follow.\n");
+    fprintf(out, "mjpeg:-        Play a motion jpeg stream from stdin (or mjpeg:file).\n");
+    fprintf(out, "watch:file     Show an image, and again whenever it is rewritten.\n");
+    fprintf(out, "unwatch        Stop watching.\n");
     fprintf(out, "flip           Swap buffers without drawing for fast A/B comparison.\n");
     fprintf(out, "wait:1.23      Pause x seconds.\n");
     fprintf(out, "save:out.png   Save framebuffer as png. (for debugging)\n");
@@ -140,14 +152,861 @@ void print_usage(FILE* out, const char* fmt, ...)
     fprintf(out, "the correct /dev/dri/card. You don't need to use --dev.\n");
 }
 
+// A buffer like the one reader will draw into, for preload_start().
+// jpegs go to YUV with --yuv.
+static struct Frame_Buffer* like_buffer_for(Image_Reader* reader)
+{
+    return display_like_buffer(reader == read_jpeg);
+}
+
+// Which reader an image command needs, from its jpeg:, heif:, png:, or cjp:
+// prefix, or else the file's extension. Returns 0 for unknown file types.
+static Image_Reader* image_reader(const char* command, const char** filename)
+{
+    const char* arg;
+
+    if ((arg = match_prefix(command, "jpeg:"))) {
+        *filename = arg;
+        return read_jpeg;
+    }
+    if ((arg = match_prefix(command, "heif:"))) {
+        *filename = arg;
+        return read_heif;
+    }
+    if ((arg = match_prefix(command, "png:"))) {
+        *filename = arg;
+        return read_png;
+    }
+    if ((arg = match_prefix(command, "cjp:"))) {
+        *filename = arg;
+        return read_pyramid;
+    }
+    if (match_case_suffix_list(command, ".jpg", ".jpeg", 0)) {
+        *filename = command;
+        return read_jpeg;
+    }
+    if (match_case_suffix_list(command, ".heif", ".heic", 0)) {
+        *filename = command;
+        return read_heif;
+    }
+    if (match_case_suffix_list(command, ".png", 0)) {
+        *filename = command;
+        return read_png;
+    }
+    if (match_case_suffix_list(command, ".cjp", 0)) {
+        *filename = command;
+        return read_pyramid;
+    }
+    return 0;
+}
+
+enum Command_Result {
+    CMD_DONE,         // done, nothing new on the screen
+    CMD_SHOWN,        // done, flipped a new frame onto the screen
+    CMD_WAIT,         // wait:, pause this command source
+    CMD_BAD_COMMAND,  // unknown command or file type
+    CMD_DECODE_ERROR, // couldn't read the image
+    CMD_SAVE_ERROR,   // couldn't write the png
+    CMD_QUIT,         // exit or halt
+    CMD_FATAL         // display error, quit with status 3
+};
+
+// Extra results from run_command().
+struct Command_Status {
+    // for CMD_WAIT, so the caller can pause just that source
+    double wait_secs;
+
+    // time spent decoding and drawing, before the flip
+    double draw_secs;
+};
+
+// --ack: print a line on stdout as each command completes.
+bool Flag_Ack = false;
+
+// Where the command being run came from (stdin, a control socket client),
+// for commands followed by a data stream. 0 for the command line.
+static struct Line_Reader* Command_Input = 0;
+
+// mjpeg:- plays the rest of the input the command came from.
+static enum Command_Result play_mjpeg(const char* path)
+{
+    struct Line_Reader file_rd;
+    struct Line_Reader* in = Command_Input;
+    int fd = -1;
+
+    if (strcmp(path, "-")) {
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            fprintf(File_Error, "Error: open(%s): %s\n", path, strerror(errno));
+            return CMD_DECODE_ERROR;
+        }
+        line_reader_init(&file_rd, fd);
+        in = &file_rd;
+    }
+    else if (in == 0) {
+        // mjpeg:- on the command line
+        line_reader_init(&file_rd, STDIN_FILENO);
+        in = &file_rd;
+    }
+
+    int shown = mjpeg_play(path, in);
+
+    if (fd >= 0) close(fd);
+    if (in == Command_Input) {
+        // the stream used up the rest of the input
+        in->eof = true;
+    }
+
+    if (shown < 0) return CMD_FATAL;
+    return shown ? CMD_SHOWN : CMD_DECODE_ERROR;
+}
+
+// For data: commands, an image file already in memory.
+typedef int Image_Mem_Reader(const char* name, const void* data, size_t length,
+    struct Frame_Buffer* fb);
+
+// Reused by every data: command, grows to fit the biggest image so far.
+static uint8_t* Data_Buf = 0;
+static size_t Data_Cap = 0;
+
+// data:jpeg:<length> is followed by exactly that many bytes of image file,
+// on the same input as the command. Reads them into Data_Buf.
+static enum Command_Result read_data(const char* arg, Image_Mem_Reader** reader,
+    size_t* length)
+{
+    const char* len_str = strchr(arg, ':');
+    char* end;
+    unsigned long long len = len_str ? strtoull(len_str + 1, &end, 10) : 0;
+    if (len_str == 0 || end == len_str + 1 || *end != 0) {
+        fprintf(File_Error, "Error: Expected data:type:length, got data:%s\n",
+                arg);
+        return CMD_BAD_COMMAND;
+    }
+    if (len > (unsigned long long)MAX_INPUT_MB << 20) {
+        // can't skip that much, the rest of the input is lost
+        fprintf(File_Error, "Error: data: over %i MB\n", MAX_INPUT_MB);
+        if (Command_Input) Command_Input->eof = true;
+        return CMD_BAD_COMMAND;
+    }
+
+    if (len > Data_Cap) {
+        uint8_t* buf = realloc(Data_Buf, len);
+        if (buf == 0) {
+            fprintf(File_Error, "Error: Out of memory at line %i.\n", __LINE__);
+            if (Command_Input) Command_Input->eof = true;
+            return CMD_DECODE_ERROR;
+        }
+        Data_Buf = buf;
+        Data_Cap = len;
+    }
+
+    // what the command reader already read past the command line, then
+    // straight from the fd
+    size_t got = 0;
+    int fd = STDIN_FILENO; // data: on the command line
+    if (Command_Input) {
+        got = line_reader_take(Command_Input, Data_Buf, len);
+        fd = Command_Input->fd;
+    }
+    while (got < len && !Quit) {
+        ssize_t n = read(fd, Data_Buf + got, len - got);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        got += n;
+    }
+    if (got < len) {
+        fprintf(File_Error, "Error: data: ended after %zu of %llu bytes\n",
+                got, len);
+        if (Command_Input) Command_Input->eof = true;
+        return CMD_DECODE_ERROR;
+    }
+
+    // Consume the bytes before complaining about the type, so the next
+    // command line is still where it should be.
+    size_t type_len = len_str - arg;
+    if (type_len == 4 && !strncmp(arg, "jpeg", 4)) *reader = read_jpeg_mem;
+    else if (type_len == 4 && !strncmp(arg, "heif", 4)) *reader = read_heif_mem;
+    else if (type_len == 3 && !strncmp(arg, "png", 3)) *reader = read_png_mem;
+    else {
+        fprintf(File_Error, "Error: Unknown data type: %.*s\n",
+                (int)type_len, arg);
+        return CMD_BAD_COMMAND;
+    }
+
+    *length = len;
+    return CMD_DONE;
+}
+
+// The region reader for image, which may have a jpeg:, heif:, png:, or
+// cjp: prefix, or 0 with a message.
+static Region_Reader* region_reader(const char* image, const char** filename)
+{
+    Image_Reader* reader = image_reader(image, filename);
+    if (reader == read_jpeg) return read_jpeg_region;
+    if (reader == read_heif) return read_heif_region;
+    if (reader == read_png) return read_png_region;
+    if (reader == read_pyramid) return read_pyramid_region;
+
+    fprintf(File_Error, "Error: Unknown file type: %s\n", image);
+    return 0;
+}
+
+// zoom:file:x,y,w,h draws that rectangle of the image into the back buffer.
+static enum Command_Result draw_zoom(const char* arg)
+{
+    const char* rect_str = strrchr(arg, ':');
+    struct Image_Rect rect;
+    if (rect_str == 0 || parse_rect(rect_str + 1, &rect)) {
+        fprintf(File_Error, "Error: Expected zoom:file:x,y,w,h, got zoom:%s\n",
+                arg);
+        return CMD_BAD_COMMAND;
+    }
+
+    char* image = strndup(arg, rect_str - arg);
+    if (image == 0) {
+        fprintf(File_Error, "Error: Out of memory at line %i.\n", __LINE__);
+        return CMD_DECODE_ERROR;
+    }
+
+    const char* filename;
+    Region_Reader* reader = region_reader(image, &filename);
+
+    enum Command_Result res = CMD_DONE;
+    if (reader == 0) {
+        res = CMD_BAD_COMMAND;
+    }
+    else if (reader(filename, &rect, display_back_buffer(false))) {
+        res = CMD_DECODE_ERROR;
+    }
+
+    free(image);
+    return res;
+}
+
+// pan:file:secs:x,y,w,h:x,y,w,h moves from the first rectangle of the
+// image to the second, and leaves the second on the screen.
+static enum Command_Result play_pan(const char* arg)
+{
+    char* image = strdup(arg);
+    if (image == 0) {
+        fprintf(File_Error, "Error: Out of memory at line %i.\n", __LINE__);
+        return CMD_DECODE_ERROR;
+    }
+
+    // split off the last three fields
+    char* fields[3];
+    int i;
+    for (i = 2; i >= 0; i--) {
+        fields[i] = strrchr(image, ':');
+        if (fields[i] == 0) break;
+        *fields[i]++ = 0;
+    }
+
+    struct Image_Rect from, to;
+    char* end;
+    double secs = i < 0 ? strtod(fields[0], &end) : 0;
+    if (i >= 0 || end == fields[0] || *end != 0 || secs < 0 ||
+        parse_rect(fields[1], &from) || parse_rect(fields[2], &to)) {
+        fprintf(File_Error, "Error: Expected pan:file:secs:x,y,w,h:x,y,w,h, "
+                "got pan:%s\n", arg);
+        free(image);
+        return CMD_BAD_COMMAND;
+    }
+
+    const char* filename;
+    Region_Reader* reader = region_reader(image, &filename);
+    int shown = reader ? pan_play(reader, filename, secs, &from, &to) : 0;
+    free(image);
+
+    if (reader == 0) return CMD_BAD_COMMAND;
+    if (shown < 0) return CMD_FATAL;
+    return shown ? CMD_SHOWN : CMD_DECODE_ERROR;
+}
+
+// Run one command from the command line, stdin, or the control socket.
+enum Command_Result run_command(const char* command,
+    struct Command_Status* status)
+{
+    const char* arg;
+
+    status->wait_secs = 0;
+    status->draw_secs = 0;
+
+    // skip empty lines
+    if (is_blank(command)) {
+        return CMD_DONE;
+    }
+
+    PROBE_COMMAND(command);
+
+    // The back buffer may still be on the screen until the last flip
+    // completes.
+    if (display_wait_idle()) {
+        return CMD_FATAL;
+    }
+
+    double t0 = time_f();
+
+    if (!strcmp(command, "black")) {
+        struct Frame_Buffer* fb = display_back_buffer(false);
+        frame_buffer_view_all(fb);
+        fill_rect(fb, 0x000000, 0, 0, -1, -1);
+    }
+    else if (!strcmp(command, "white")) {
+        struct Frame_Buffer* fb = display_back_buffer(false);
+        frame_buffer_view_all(fb);
+        fill_rect(fb, 0xffffff, 0, 0, -1, -1);
+    }
+    else if (!strcmp(command, "clear")) {
+        struct Frame_Buffer* fb = display_back_buffer(false);
+        frame_buffer_view_all(fb);
+        fill_rect(fb, BG_Color, 0, 0, -1, -1);
+    }
+    else if (!strcmp(command, "flip")) {
+        // swap buffers again without drawing
+    }
+    else if ((arg = match_prefix(command, "wait:"))) {
+        // pause for x.x seconds
+        status->wait_secs = strtod(arg, 0);
+        return CMD_WAIT; // since we didn't draw anything
+    }
+    else if ((arg = match_prefix(command, "bgcolor:"))) {
+        BG_Color = strtoul(arg, 0, 16);
+        return CMD_DONE; // no drawing, don't flip the buffers
+    }
+    else if ((arg = match_prefix(command, "save:"))) {
+        // write previous framebuffer, i.e. the one currently on the screen.
+        // don't flip the buffers
+        return write_png(arg, FB1) ? CMD_SAVE_ERROR : CMD_DONE;
+    }
+    else if (!strcmp(command, "sleep")) {
+        // put display to sleep
+        // next jpeg or clear will wake it up
+        return display_sleep() ? CMD_FATAL : CMD_DONE;
+    }
+    else if (!strcmp(command, "halt")) {
+        // wait forever
+        while (!Quit) sleep(10);
+        return CMD_QUIT;
+    }
+    else if (!strcmp(command, "exit")) {
+        return CMD_QUIT;
+    }
+    else if ((arg = match_prefix(command, "preload:"))) {
+        // decode in the background, for a later command to show instantly
+        const char* filename;
+        Image_Reader* reader = image_reader(arg, &filename);
+        if (reader == 0) {
+            fprintf(File_Error, "Error: Unknown file type: %s\n", arg);
+            return CMD_BAD_COMMAND;
+        }
+        return preload_start(reader, filename, like_buffer_for(reader)) ?
+            CMD_DECODE_ERROR : CMD_DONE;
+    }
+    else if ((arg = match_prefix(command, "mjpeg:"))) {
+        // a stream of frames, shown as they come until it ends
+        return play_mjpeg(arg);
+    }
+    else if ((arg = match_prefix(command, "data:"))) {
+        // the image file itself follows the command line
+        Image_Mem_Reader* reader;
+        size_t length;
+        enum Command_Result res = read_data(arg, &reader, &length);
+        if (res != CMD_DONE) return res;
+
+        t0 = time_f(); // not counting the transfer
+        struct Frame_Buffer* fb = display_back_buffer(
+            reader == read_jpeg_mem);
+        if (reader(command, Data_Buf, length, fb)) {
+            return CMD_DECODE_ERROR;
+        }
+    }
+    else if ((arg = match_prefix(command, "zoom:"))) {
+        // part of an image, filling the screen
+        enum Command_Result res = draw_zoom(arg);
+        if (res != CMD_DONE) return res;
+    }
+    else if ((arg = match_prefix(command, "pan:"))) {
+        // moves across an image, then shows the end like zoom:
+        return play_pan(arg);
+    }
+    else if ((arg = match_prefix(command, "watch:"))) {
+        // show it now, and again whenever the file is rewritten
+        const char* filename;
+        if (image_reader(arg, &filename) == 0) {
+            fprintf(File_Error, "Error: Unknown file type: %s\n", arg);
+            return CMD_BAD_COMMAND;
+        }
+        if (watch_start(arg, filename)) {
+            return CMD_BAD_COMMAND;
+        }
+        if (access(filename, F_OK)) {
+            // not written yet
+            return CMD_DONE;
+        }
+        return run_command(arg, status);
+    }
+    else if (!strcmp(command, "unwatch")) {
+        watch_stop();
+        return CMD_DONE;
+    }
+    else if ((arg = match_prefix(command, "drop:"))) {
+        // free a preload that won't be shown after all
+        const char* filename = arg;
+        image_reader(arg, &filename);
+        preload_drop(filename);
+        return CMD_DONE;
+    }
+    else {
+        // An image file.
+        const char* filename;
+        Image_Reader* reader = image_reader(command, &filename);
+        if (reader == 0) {
+            fprintf(File_Error, "Error: Unknown file type: %s\n", command);
+            return CMD_BAD_COMMAND;
+        }
+
+        struct Frame_Buffer* back = display_back_buffer(reader == read_jpeg);
+        struct Frame_Buffer* fb = preload_take(reader, filename, back);
+        if (fb) {
+            // already decoded, it just needs flipping onto the screen
+            preload_recycle(display_replace_back_buffer(fb));
+        }
+        else if (reader(filename, back)) {
+            return CMD_DECODE_ERROR;
+        }
+    }
+
+    status->draw_secs = time_f() - t0;
+
+    if (display_present()) {
+        return CMD_FATAL;
+    }
+    return CMD_SHOWN;
+}
+
+// Commands come from stdin and from clients of the control socket. Each
+// one is a source, and sources take turns, one command at a time.
+#define MAX_SOURCES 16
+
+struct Source {
+    bool active;
+    bool is_stdin; // no replies, and EOF means quit
+    struct Line_Reader rd;
+
+    // wait: pauses just this source
+    bool waiting;
+    double resume_time;
+    char wait_command[64];
+};
+
+static struct Source Sources[MAX_SOURCES];
+
+static struct Source* add_source(int fd, bool is_stdin)
+{
+    int i;
+    for (i = 0; i < MAX_SOURCES; i++) {
+        struct Source* src = &Sources[i];
+        if (!src->active) {
+            src->active = true;
+            src->is_stdin = is_stdin;
+            src->waiting = false;
+            line_reader_init(&src->rd, fd);
+            return src;
+        }
+    }
+    return 0;
+}
+
+static void remove_source(struct Source* src)
+{
+    if (!src->is_stdin) close(src->rd.fd);
+    src->active = false;
+}
+
+// Error replies and acks say what kind of error.
+static const char* error_kind(enum Command_Result res)
+{
+    switch (res) {
+        case CMD_BAD_COMMAND:  return "command";
+        case CMD_DECODE_ERROR: return "decode";
+        case CMD_SAVE_ERROR:   return "save";
+        case CMD_FATAL:        return "display";
+        default:               return 0;
+    }
+}
+
+// Tell a control socket client how its command went, e.g.
+//   ok shown seq=123 t=4567.890123
+//   err decode photo.jpg
+static void reply(struct Source* src, enum Command_Result res,
+    const char* command)
+{
+    if (src == 0 || src->is_stdin) return;
+
+    char line[1024];
+    uint32_t seq;
+    double t;
+
+    if (res == CMD_SHOWN) {
+        display_last_flip(&seq, &t);
+        snprintf(line, sizeof(line), "ok shown seq=%u t=%.6f", seq, t);
+    }
+    else if (res == CMD_QUIT) {
+        snprintf(line, sizeof(line), "ok exit");
+    }
+    else if (error_kind(res)) {
+        snprintf(line, sizeof(line), "err %s %.900s", error_kind(res), command);
+    }
+    else {
+        snprintf(line, sizeof(line), "ok done");
+    }
+    control_reply(src->rd.fd, line);
+}
+
+// --ack, e.g.
+//   ack shown seq=123 flip=4567.890123 decode=0.412 photo.jpg
+//   ack done wait:5
+//   ack err decode bad.jpg
+static void ack(enum Command_Result res, const char* command,
+    const struct Command_Status* status)
+{
+    if (!Flag_Ack) return;
+
+    uint32_t seq;
+    double t;
+
+    if (res == CMD_SHOWN) {
+        display_last_flip(&seq, &t);
+        fprintf(stdout, "ack shown seq=%u flip=%.6f decode=%.3f %s\n",
+            seq, t, status->draw_secs, command);
+    }
+    else if (res == CMD_QUIT) {
+        fprintf(stdout, "ack exit %s\n", command);
+    }
+    else if (error_kind(res)) {
+        fprintf(stdout, "ack err %s %s\n", error_kind(res), command);
+    }
+    else {
+        fprintf(stdout, "ack done %s\n", command);
+    }
+    // producer is waiting for this line
+    fflush(stdout);
+}
+
+// Run the next command from this source, if it has a complete one.
+// Returns true if it ran a command.
+static bool run_source(struct Source* src, enum Command_Result* res)
+{
+    char* command = line_reader_next(&src->rd);
+    if (command == 0) return false;
+
+    // A blank line isn't a command: no reply, no ack.
+    if (is_blank(command)) return true;
+
+    struct Command_Status status;
+    Command_Input = &src->rd;
+    *res = run_command(command, &status);
+    Command_Input = 0;
+
+    if (*res == CMD_SHOWN) {
+        // The reply comes after the flip, so the client knows the image
+        // is on the screen.
+        if (display_wait_idle()) *res = CMD_FATAL;
+    }
+
+    if (*res == CMD_WAIT) {
+        // reply when the wait is over
+        src->waiting = true;
+        src->resume_time = time_f() + status.wait_secs;
+        snprintf(src->wait_command, sizeof(src->wait_command), "%s", command);
+    }
+    else {
+        reply(src, *res, command);
+        ack(*res, command, &status);
+    }
+    return true;
+}
+
+// Read ahead the images named by commands that are already buffered.
+static void prefetch_backlog(const struct Line_Reader* rd)
+{
+    char* filenames[MAX_PREFETCH];
+    int n = 0;
+    size_t pos = 0;
+    size_t len;
+    const char* line;
+
+    while (n < Prefetch_Max && (line = line_reader_peek(rd, &pos, &len))) {
+        // what follows these isn't commands
+        if (!strncmp(line, "data:", 5) || !strncmp(line, "mjpeg:", 6)) break;
+
+        char* command = strndup(line, len);
+        if (command == 0) break;
+
+        const char* arg = match_prefix(command, "preload:");
+        const char* filename;
+        if (image_reader(arg ? arg : command, &filename)) {
+            memmove(command, filename, strlen(filename) + 1);
+            filenames[n++] = command;
+        }
+        else {
+            free(command);
+        }
+    }
+
+    if (n > 0) prefetch_files(n, (const char* const*)filenames);
+    while (n > 0) free(filenames[--n]);
+}
+
+// Take commands from stdin and/or the control socket until exit, or until
+// the monotonic_f() time until if it isn't 0.
+enum Command_Result run_sources(int fd_listen, double until)
+{
+    enum Command_Result res = CMD_DONE;
+    bool busy = false;
+
+    while (!Quit && res != CMD_QUIT && res != CMD_FATAL &&
+           (until == 0 || monotonic_f() < until)) {
+        struct pollfd pfds[MAX_SOURCES + 2];
+        struct Source* pfd_src[MAX_SOURCES + 2];
+        int n = 0;
+        int i;
+
+        // Sources with commands already buffered don't need to wait for
+        // more input, and waiting sources aren't read.
+        double now = time_f();
+        int timeout = busy ? 0 : -1;
+        for (i = 0; i < MAX_SOURCES; i++) {
+            struct Source* src = &Sources[i];
+            if (!src->active) continue;
+            if (src->waiting) {
+                int ms = (src->resume_time - now) * 1000 + 1;
+                if (ms < 0) ms = 0;
+                if (timeout < 0 || ms < timeout) timeout = ms;
+                continue;
+            }
+            pfds[n].fd = src->rd.fd;
+            pfds[n].events = POLLIN;
+            pfd_src[n++] = src;
+        }
+        if (until) {
+            int ms = (until - monotonic_f()) * 1000 + 1;
+            if (ms < 0) ms = 0;
+            if (timeout < 0 || ms < timeout) timeout = ms;
+        }
+        int watch_ix = -1;
+        if (watch_fd() >= 0) {
+            watch_ix = n;
+            pfds[n].fd = watch_fd();
+            pfds[n].events = POLLIN;
+            pfd_src[n++] = 0;
+        }
+        if (fd_listen >= 0) {
+            pfds[n].fd = fd_listen;
+            pfds[n].events = POLLIN;
+            pfd_src[n++] = 0;
+        }
+
+        if (poll(pfds, n, timeout) < 0) {
+            if (errno == EINTR) continue;
+            fprintf(File_Error, "Error: poll(): %s\n", strerror(errno));
+            return CMD_FATAL;
+        }
+
+        // new clients
+        if (fd_listen >= 0 && (pfds[n - 1].revents & POLLIN)) {
+            int fd = accept(fd_listen, 0, 0);
+            if (fd >= 0 && add_source(fd, false) == 0) {
+                control_reply(fd, "err busy");
+                close(fd);
+            }
+        }
+
+        // read input
+        for (i = 0; i < n; i++) {
+            struct Source* src = pfd_src[i];
+            if (src == 0 || pfds[i].revents == 0) continue;
+            if (line_reader_fill(&src->rd) < 0 && errno != EINTR) {
+                src->rd.eof = true;
+            }
+            else if (Prefetch_Max > 0) {
+                prefetch_backlog(&src->rd);
+            }
+        }
+
+        // watch: file was rewritten
+        const char* watched;
+        if (watch_ix >= 0 && (pfds[watch_ix].revents & POLLIN) &&
+            (watched = watch_check())) {
+            struct Command_Status status;
+            res = run_command(watched, &status);
+            if (res == CMD_SHOWN && Flag_Ack) {
+                if (display_wait_idle()) res = CMD_FATAL;
+            }
+            ack(res, watched, &status);
+        }
+
+        // waits that are over
+        now = time_f();
+        for (i = 0; i < MAX_SOURCES; i++) {
+            struct Source* src = &Sources[i];
+            if (src->active && src->waiting && src->resume_time <= now) {
+                struct Command_Status status = { 0 };
+                src->waiting = false;
+                reply(src, CMD_DONE, src->wait_command);
+                ack(CMD_DONE, src->wait_command, &status);
+            }
+        }
+
+        // one command from each source
+        busy = false;
+        for (i = 0; i < MAX_SOURCES && res != CMD_QUIT && res != CMD_FATAL; i++) {
+            struct Source* src = &Sources[i];
+            if (!src->active || src->waiting) continue;
+
+            if (run_source(src, &res)) {
+                busy = true;
+            }
+            else if (src->rd.eof) {
+                // EOF on stdin means quit, like before
+                if (src->is_stdin) res = CMD_QUIT;
+                remove_source(src);
+            }
+        }
+    }
+    return res;
+}
+
+static void close_sources()
+{
+    int i;
+    for (i = 0; i < MAX_SOURCES; i++) {
+        if (Sources[i].active) remove_source(&Sources[i]);
+    }
+}
+
+// Sleep until the monotonic_f() time t, serving the control socket
+// meanwhile if there is one.
+static enum Command_Result serve_until(int fd_listen, double t)
+{
+    if (fd_listen < 0) {
+        sleep_until_f(t);
+        return CMD_DONE;
+    }
+    return run_sources(fd_listen, t);
+}
+
+// The files of the next Prefetch_Max playlist entries, from pos on.
+static void prefetch_playlist(struct Playlist* pl, long pos)
+{
+    const char* filenames[MAX_PREFETCH];
+    int n = 0;
+    long i;
+
+    // not past the entry that's showing now
+    for (i = pos; n < Prefetch_Max && i < pos - 1 + pl->num_entries; i++) {
+        struct Playlist_Entry* entry = playlist_at(pl, i);
+        if (entry == 0) break;
+
+        const char* filename;
+        if (image_reader(entry->command, &filename)) filenames[n++] = filename;
+    }
+    if (n > 0) prefetch_files(n, filenames);
+}
+
+// --playlist: show each entry at its deadline. Deadlines are absolute, so
+// decode time and late flips never add up to drift. The next few images
+// are preloaded, so they're ready when their turn comes. Control socket
+// clients are served in between.
+enum Command_Result run_playlist(struct Playlist* pl, int fd_listen)
+{
+    enum Command_Result res = CMD_DONE;
+    double deadline = monotonic_f();
+    long queued = 1; // entries before this one have been preloaded
+    long pos;
+
+    for (pos = 0; !Quit && res != CMD_QUIT && res != CMD_FATAL; pos++) {
+        struct Playlist_Entry* entry = playlist_at(pl, pos);
+        if (entry == 0) break; // the end, not looping
+
+        enum Command_Result served = serve_until(fd_listen, deadline);
+        if (served == CMD_QUIT || served == CMD_FATAL) {
+            res = served;
+            break;
+        }
+        if (Quit) break;
+
+        struct Command_Status status;
+        res = run_command(entry->command, &status);
+        if (res == CMD_WAIT) {
+            // the entry's duration is the wait
+            res = CMD_DONE;
+        }
+        if (res == CMD_SHOWN && (Verbose || Flag_Ack)) {
+            if (display_wait_idle()) res = CMD_FATAL;
+        }
+        if (res == CMD_SHOWN && Verbose) {
+            uint32_t seq;
+            double t;
+            display_last_flip(&seq, &t);
+            fprintf(File_Info, "  shown  %+6.1f ms from deadline\n",
+                (t - deadline) * 1e3);
+        }
+        ack(res, entry->command, &status);
+
+        // A slide that failed gives its time to the next one.
+        if (res == CMD_SHOWN || res == CMD_DONE) {
+            deadline += entry->duration;
+        }
+
+        // Read the files further ahead. First, so the preloads below find
+        // their files already on the way.
+        if (Prefetch_Max > 0) prefetch_playlist(pl, pos + 1);
+
+        // Decode ahead, as far as the preload cache allows.
+        while (queued <= pos + Preload_Max && queued < pos + pl->num_entries) {
+            struct Playlist_Entry* next = playlist_at(pl, queued++);
+            if (next == 0) break;
+
+            const char* filename;
+            Image_Reader* reader = image_reader(next->command, &filename);
+            if (reader) preload_start(reader, filename, like_buffer_for(reader));
+        }
+    }
+
+    // leave the last slide up for its time
+    if (res == CMD_SHOWN || res == CMD_DONE) {
+        enum Command_Result served = serve_until(fd_listen, deadline);
+        if (served == CMD_QUIT || served == CMD_FATAL) res = served;
+    }
+    return res;
+}
+
 int main(int argc, const char* argv[])
 {
     File_Info = stdout;
     File_Error = stderr;
 
+    // time_f() starts its clock on the first call, which mustn't be on
+    // the preload worker, racing this thread
+    time_f();
+
     const char* arg_dev_path = 0;
+    const char* arg_socket_path = control_default_path();
     bool flag_list_outputs = false;
+    bool flag_daemon = false;
+    bool flag_client = false;
+    bool flag_sync = false;
+    bool flag_socket = false;
     int chose_output = -1;
+    const char* arg_playlist = 0;
+    const char* arg_calibrate = 0;
+    const char* arg_pyramid_in = 0;
+    const char* arg_pyramid_out = 0;
+    bool flag_loop = false;
+    bool flag_shuffle = false;
+    double arg_duration = 5;
 
     const char* arg;
     int argi;
@@ -177,6 +1036,116 @@ int main(int argc, const char* argv[])
         {
             Verbose = true;
         }
+        else if (!strcmp(argv[argi], "--daemon"))
+        {
+            flag_daemon = true;
+        }
+        else if (!strcmp(argv[argi], "--client"))
+        {
+            flag_client = true;
+        }
+        else if (!strcmp(argv[argi], "--sync"))
+        {
+            flag_sync = true;
+        }
+        else if ((arg = match_prefix(argv[argi], "--socket=")))
+        {
+            arg_socket_path = arg;
+            flag_socket = true;
+        }
+        else if (!strcmp(argv[argi], "--ack"))
+        {
+            Flag_Ack = true;
+        }
+        else if ((arg = match_prefix(argv[argi], "--playlist=")))
+        {
+            arg_playlist = arg;
+        }
+        else if (!strcmp(argv[argi], "--loop"))
+        {
+            flag_loop = true;
+        }
+        else if (!strcmp(argv[argi], "--shuffle"))
+        {
+            flag_shuffle = true;
+        }
+        else if ((arg = match_prefix(argv[argi], "--duration=")))
+        {
+            arg_duration = strtod(arg, 0);
+        }
+        else if ((arg = match_prefix(argv[argi], "--preload-max=")))
+        {
+            Preload_Max = strtoul(arg, 0, 10);
+        }
+        else if ((arg = match_prefix(argv[argi], "--canvas=")))
+        {
+            if (sscanf(arg, "%ux%u", &Canvas_Width, &Canvas_Height) != 2 ||
+                Canvas_Width == 0 || Canvas_Height == 0) {
+                fprintf(File_Error, "Error: Expected --canvas=WxH, e.g. 1920x1080\n");
+                return 1;
+            }
+        }
+        else if (!strcmp(argv[argi], "--plane-scale"))
+        {
+            Plane_Scale = true;
+        }
+        else if (!strcmp(argv[argi], "--yuv"))
+        {
+            Yuv_Scanout = true;
+        }
+        else if ((arg = match_prefix(argv[argi], "--rotate=")))
+        {
+            char* end;
+            Rotate = strtol(arg, &end, 10);
+            if (*end || (Rotate != 0 && Rotate != 90 && Rotate != 180 &&
+                         Rotate != 270)) {
+                fprintf(File_Error, "Error: Expected --rotate=0, 90, 180 or 270\n");
+                return 1;
+            }
+        }
+        else if ((arg = match_prefix(argv[argi], "--calibrate=")))
+        {
+            arg_calibrate = arg;
+        }
+        else if (!strcmp(argv[argi], "--build-pyramid"))
+        {
+            if (argi + 2 >= argc) {
+                fprintf(File_Error, "Error: Expected --build-pyramid in.jpg out.cjp\n");
+                return 1;
+            }
+            arg_pyramid_in = argv[++argi];
+            arg_pyramid_out = argv[++argi];
+        }
+        else if ((arg = match_prefix(argv[argi], "--jpeg-cost=")))
+        {
+            if (sscanf(arg, "%lf,%lf,%lf,%lf,%lf", &Jpeg_Cost.base,
+                    &Jpeg_Cost.decode, &Jpeg_Cost.odd, &Jpeg_Cost.tap,
+                    &Jpeg_Cost.byte) != 5) {
+                fprintf(File_Error, "Error: Expected --jpeg-cost=base,decode,odd,tap,byte\n");
+                return 1;
+            }
+        }
+        else if ((arg = match_prefix(argv[argi], "--resizer=")))
+        {
+            if (!strcmp(arg, "auto")) Resizer = RESIZER_AUTO;
+            else if (!strcmp(arg, "stbir")) Resizer = RESIZER_STBIR;
+            else if (!strcmp(arg, "fixed")) Resizer = RESIZER_FIXED;
+            else {
+                fprintf(File_Error, "Error: Expected --resizer=auto, stbir, or fixed\n");
+                return 1;
+            }
+        }
+        else if ((arg = match_prefix(argv[argi], "--prefetch=")))
+        {
+            Prefetch_Max = strtoul(arg, 0, 10);
+            if (Prefetch_Max > MAX_PREFETCH) Prefetch_Max = MAX_PREFETCH;
+        }
+        else if (!strcmp(argv[argi], "--perf-counters"))
+        {
+            if (perf_counters_open()) {
+                fprintf(File_Error, "Error: No performance counters.\n");
+            }
+        }
         else if (!strcmp(argv[argi], "-h") ||
                  !strcmp(argv[argi], "--help"))
         {
@@ -189,6 +1158,20 @@ int main(int argc, const char* argv[])
         }
     }
 
+    if (flag_client) {
+        // Hand the commands to the daemon. Don't touch the display.
+        return control_client(arg_socket_path, argc - argi, argv + argi,
+                    flag_sync);
+    }
+
+    struct Playlist* playlist = 0;
+    if (arg_playlist) {
+        playlist = playlist_load(arg_playlist, arg_duration);
+        if (playlist == 0) return 1;
+        playlist->loop = flag_loop;
+        playlist->shuffle = flag_shuffle;
+    }
+
     populate_cards(arg_dev_path);
 
     if (flag_list_outputs) {
@@ -205,224 +1188,81 @@ int main(int argc, const char* argv[])
 
     close_other_cards_and_connectors();
 
-    drmModeModeInfo* mode_info = &My_Conn->drm_conn->modes[My_Conn->best_mode_ix];
-
-    drmModeEncoder* encoder = drmModeGetEncoder(My_Card->fd_drm,
-        My_Conn->drm_conn->encoder_id);
-    if (encoder == 0) {
-        fprintf(File_Error, "Error: No encoder.\n");
+    if (display_open()) {
         return 1;
     }
 
-    uint32_t pixel_format;
-    if (choose_pixel_format(&pixel_format)) {
-        fprintf(File_Error, "Error: No acceptable pixel format.\n");
-        return 1;
+    if (arg_calibrate) {
+        int err = jpeg_calibrate(arg_calibrate, display_back_buffer(true));
+        display_close();
+        return err ? 1 : 0;
     }
-    const struct Pixel_Format* pf = lookup_pixel_format(pixel_format);
-    uint32_t bytes_per_pixel = pf->bytes_per_pixel;
 
-    if (Verbose) {
-        fprintf(File_Info, "Picked '%s', %i bytes/pix\n",
-            four_cc_to_str(pixel_format), bytes_per_pixel);
+    if (arg_pyramid_in) {
+        // for this screen's pixel format
+        install_ctrl_c_handler();
+        int err = pyramid_build(arg_pyramid_in, arg_pyramid_out,
+            display_back_buffer(false));
+        display_close();
+        return err ? 1 : 0;
     }
 
-    uint32_t width = mode_info->hdisplay;
-    uint32_t height = mode_info->vdisplay;
-    int err = create_two_frame_buffers(My_Card->fd_drm, width, height, pixel_format);
-    if (err) {
-        return 2;
+    int fd_listen = -1;
+    if (flag_daemon || flag_socket) {
+        fd_listen = control_listen(arg_socket_path);
+        if (fd_listen < 0) {
+            display_close();
+            return 1;
+        }
     }
 
-    uint32_t crtc_id = encoder->crtc_id;
-    drmModeCrtc* saved_crtc = drmModeGetCrtc(My_Card->fd_drm, crtc_id);
-
     install_ctrl_c_handler();
 
-    // Double buffering:
-    // First buffer uses drmModeSetCrtc().
-    // Subsequent buffers use drmModePageFlip().
-    // Also need drmModeSetCrtc() to come out of display power-down.
-    bool first_flip = true;
-    char buf[1024];
-    int ret = 0;
-    while (!Quit) {
-        // Process commands, frist from the command line, then from stdin.
-        const char* command;
-        if (argi < argc) {
-            command = argv[argi++];
-        }
-        else if (fgets(buf, sizeof(buf), stdin)) {
-            // strip newline
-            char* nl = strchr(buf, '\n');
-            if (nl) *nl = 0;
-            command = buf;
-        }
-        else {
-            // EOF
-            break;
-        }
-
-        // skip empty lines
-        if (*command == 0) {
-            continue;
-        }
+    enum Command_Result res = CMD_DONE;
 
-        if (!strcmp(command, "black")) {
-            fill_rect(FB0, 0x000000, 0, 0, -1, -1);
-        }
-        else if (!strcmp(command, "white")) {
-            fill_rect(FB0, 0xffffff, 0, 0, -1, -1);
-        }
-        else if (!strcmp(command, "clear")) {
-            fill_rect(FB0, BG_Color, 0, 0, -1, -1);
-        }
-        else if (!strcmp(command, "flip")) {
-            // swap buffers again without drawing
-        }
-        else if ((arg = match_prefix(command, "wait:"))) {
-            // pause for x.x seconds
-            double t = strtod(arg, 0);
-            sleep_f(t);
-            continue; // since we didn't draw anything
-        }
-        else if ((arg = match_prefix(command, "bgcolor:"))) {
-            BG_Color = strtoul(arg, 0, 16);
-            continue; // no drawing, don't flip the buffers
-        }
-        else if ((arg = match_prefix(command, "save:"))) {
-            write_png(arg, FB1); // write previous framebuffer, i.e.
-                                 // the one currently on the screen.
-            continue; // don't flip the buffers
-        }
-        else if (!strcmp(command, "sleep")) {
-            // put display to sleep
-            // next jpeg or clear will wake it up
-            err = drmModeSetCrtc(My_Card->fd_drm, crtc_id, 0, 0, 0, 0, 0, 0);
-            if (err) {
-                fprintf(File_Error, "Error: drmModeSetCrtc(sleep): %s\n",
-                        strerror(errno));
-                ret = 3;
-                goto Cleanup;
-            }
-            first_flip = true;
-            continue;
-        }
-        else if (!strcmp(command, "halt")) {
-            // wait forever
-            while (!Quit) sleep(10);
-            break;
+    // Process commands, frist from the command line...
+    while (!Quit && argi < argc && res != CMD_QUIT && res != CMD_FATAL) {
+        const char* command = argv[argi++];
+        struct Command_Status status;
+        res = run_command(command, &status);
+        if (res == CMD_WAIT) {
+            sleep_f(status.wait_secs);
+            res = CMD_DONE;
         }
-        else if (!strcmp(command, "exit")) {
-            break;
+        if (res == CMD_SHOWN && Flag_Ack) {
+            // ack once it's on the screen
+            if (display_wait_idle()) res = CMD_FATAL;
         }
-        else {
-            // An image file.
-            enum {
-                FMT_JPEG,
-                FMT_HEIF,
-                FMT_PNG
-            } fmt;
-            const char* filename = 0;
-
-            if ((arg = match_prefix(command, "jpeg:"))) {
-                fmt = FMT_JPEG;
-                filename = arg;
-            }
-            else if ((arg = match_prefix(command, "heif:"))) {
-                fmt = FMT_HEIF;
-                filename = arg;
-            }
-            else if ((arg = match_prefix(command, "png:"))) {
-                fmt = FMT_PNG;
-                filename = arg;
-            }
-            else if (match_case_suffix_list(command, ".jpg", ".jpeg", 0)) {
-                fmt = FMT_JPEG;
-                filename = command;
-            }
-            else if (match_case_suffix_list(command, ".heif", ".heic", 0)) {
-                fmt = FMT_HEIF;
-                filename = command;
-            }
-            else if (match_case_suffix_list(command, ".png", 0)) {
-                fmt = FMT_PNG;
-                filename = command;
-            }
-            else {
-                fprintf(File_Error, "Error: Unknown file type: %s\n", command);
-                continue;
-            }
+        ack(res, command, &status);
+    }
 
-            if (fmt == FMT_JPEG) {
-                if (read_jpeg(filename, FB0)) {
-                    continue;
-                }
-            }
-            else if (fmt == FMT_HEIF) {
-                if (read_heif(filename, FB0)) {
-                    continue;
-                }
-            }
-            else if (fmt == FMT_PNG) {
-                if (read_png(filename, FB0)) {
-                    continue;
-                }
-            }
+    // ...then the playlist, or else stdin and the control socket.
+    // A daemon doesn't read stdin, so it keeps running until exit, and
+    // after its playlist ends.
+    if (playlist) {
+        if (!Quit && res != CMD_QUIT && res != CMD_FATAL) {
+            res = run_playlist(playlist, fd_listen);
         }
-
-        if (first_flip) {
-            first_flip = false;
-            err = drmModeSetCrtc(My_Card->fd_drm, crtc_id, FB0->fb_id, 0, 0,
-                         &My_Conn->drm_conn->connector_id, 1, mode_info);
-            if (err) {
-                fprintf(File_Error, "Error: drmModeSetCrtc(FB0): %s\n",
-                        strerror(errno));
-                ret = 3;
-                goto Cleanup;
-            }
+        playlist_free(playlist);
+        if (flag_daemon && !Quit && res != CMD_QUIT && res != CMD_FATAL) {
+            res = run_sources(fd_listen, 0);
         }
-        else {
-            // Schedule buffer flip.
-            // May need to wait for vblank and retry if was are generating
-            // frames faster than the refresh rate.
-            while (!Quit) {
-                err = drmModePageFlip(My_Card->fd_drm, crtc_id, FB0->fb_id, 0, 0);
-                if (err == 0) {
-                    // success
-                    break;
-                }
-                if (errno != EBUSY) {
-                    // a real error
-                    fprintf(File_Error, "Error: drmModePageFlip(FB0): %s\n",
-                            strerror(errno));
-                    ret = 3;
-                    goto Cleanup;
-                }
-
-                // EBUSY
-                // We tried to schedule a buffer flip while another flip
-                // was still pending. We are drawing frames faster than the
-                // monitor refresh.
-                //
-                // This only happens when clearing the screen or showing
-                // small jpegs. It's not worth setting up events and a select
-                // loop. We handle it here.
-                //
-                // drmWaitVBlank() was always returning EINVAL
-                // Sleeping for 5 ms and retrying works, too.
-                sleep_f(5e-3);
-            }
+    }
+    else {
+        if (!flag_daemon) {
+            add_source(STDIN_FILENO, true);
+        }
+        if (!Quit && res != CMD_QUIT && res != CMD_FATAL) {
+            res = run_sources(fd_listen, 0);
         }
-        swap_frame_buffers();
     }
+    close_sources();
 
-Cleanup:
-    if (saved_crtc) {
-        drmModeSetCrtc(My_Card->fd_drm, saved_crtc->crtc_id,
-            saved_crtc->buffer_id, saved_crtc->x, saved_crtc->y,
-            &My_Conn->drm_conn->connector_id, 1, &saved_crtc->mode);
-    }
+    control_close();
+    watch_stop();
+    preload_close();
+    prefetch_close();
+    display_close();
 
-    return ret;
+    return res == CMD_FATAL ? 3 : 0;
 }
@@ -0,0 +1,201 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "control.h"
+#include "line_reader.h"
+#include "util.h"
+
+static int Listen_Fd = -1;
+static char* Listen_Path = 0;
+
+const char* control_default_path()
+{
+    static char path[108];
+
+    const char* dir = getenv("XDG_RUNTIME_DIR");
+    if (dir == 0 || *dir == 0) dir = "/tmp";
+    snprintf(path, sizeof(path), "%s/console-jpeg.sock", dir);
+    return path;
+}
+
+static int make_address(const char* path, struct sockaddr_un* addr)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        fprintf(File_Error, "Error: Socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+int control_listen(const char* path)
+{
+    struct sockaddr_un addr;
+    if (make_address(path, &addr)) return -1;
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        fprintf(File_Error, "Error: socket(): %s\n", strerror(errno));
+        return -1;
+    }
+
+    // Don't steal the socket from a server that is still running.
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
+        fprintf(File_Error, "Error: Another console-jpeg is listening on %s\n",
+                path);
+        close(fd);
+        return -1;
+    }
+    close(fd);
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        fprintf(File_Error, "Error: socket(): %s\n", strerror(errno));
+        return -1;
+    }
+
+    // remove stale socket file
+    unlink(path);
+
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr))) {
+        fprintf(File_Error, "Error: bind(%s): %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    if (listen(fd, 8)) {
+        fprintf(File_Error, "Error: listen(%s): %s\n", path, strerror(errno));
+        close(fd);
+        unlink(path);
+        return -1;
+    }
+
+    Listen_Fd = fd;
+    Listen_Path = strdup(path);
+    return fd;
+}
+
+void control_close()
+{
+    if (Listen_Fd < 0) return;
+
+    close(Listen_Fd);
+    unlink(Listen_Path);
+    free(Listen_Path);
+    Listen_Fd = -1;
+    Listen_Path = 0;
+}
+
+static int send_line(int fd, const char* line, int flags)
+{
+    size_t n = strlen(line);
+    char buf[1024];
+    if (n >= sizeof(buf)) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    memcpy(buf, line, n);
+    buf[n++] = '\n';
+
+    size_t sent = 0;
+    while (sent < n) {
+        ssize_t r = send(fd, buf + sent, n - sent, flags | MSG_NOSIGNAL);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        sent += r;
+    }
+    return 0;
+}
+
+int control_reply(int fd, const char* line)
+{
+    // A client that never reads its replies must not block the server.
+    return send_line(fd, line, MSG_DONTWAIT);
+}
+
+// Block until the server's reply line arrives.
+static char* wait_reply(struct Line_Reader* rd)
+{
+    char* line;
+    while ((line = line_reader_next(rd)) == 0) {
+        if (rd->eof) return 0;
+        if (line_reader_fill(rd) < 0 && errno != EINTR) return 0;
+    }
+    return line;
+}
+
+static int client_command(int fd, struct Line_Reader* rd, const char* command,
+    bool sync)
+{
+    if (send_line(fd, command, 0)) {
+        fprintf(File_Error, "Error: send(): %s\n", strerror(errno));
+        return 2;
+    }
+    if (!sync) return 0;
+
+    char* reply = wait_reply(rd);
+    if (reply == 0) {
+        fprintf(File_Error, "Error: Server hung up.\n");
+        return 2;
+    }
+    if (strncmp(reply, "ok", 2)) {
+        fprintf(File_Error, "Error: %s: %s\n", command, reply);
+        return 1;
+    }
+    return 0;
+}
+
+int control_client(const char* path, int num_commands, const char* commands[],
+    bool sync)
+{
+    struct sockaddr_un addr;
+    if (make_address(path, &addr)) return 2;
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        fprintf(File_Error, "Error: socket(): %s\n", strerror(errno));
+        return 2;
+    }
+
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr))) {
+        fprintf(File_Error, "Error: connect(%s): %s\n", path, strerror(errno));
+        fprintf(File_Error, "Is console-jpeg --daemon running?\n");
+        close(fd);
+        return 2;
+    }
+
+    struct Line_Reader rd;
+    line_reader_init(&rd, fd);
+
+    int ret = 0;
+    int i;
+    for (i = 0; i < num_commands && ret < 2; i++) {
+        int r = client_command(fd, &rd, commands[i], sync);
+        if (r > ret) ret = r;
+    }
+
+    if (num_commands == 0) {
+        // no commands on the command line, forward stdin
+        char buf[1024];
+        while (ret < 2 && fgets(buf, sizeof(buf), stdin)) {
+            char* nl = strchr(buf, '\n');
+            if (nl) *nl = 0;
+            if (*buf == 0) continue;
+
+            int r = client_command(fd, &rd, buf, sync);
+            if (r > ret) ret = r;
+        }
+    }
+
+    close(fd);
+    return ret;
+}
@@ -0,0 +1,44 @@
+#ifndef CONTROL_H
+#define CONTROL_H
+
+#include <stdbool.h>
+
+// Unix domain control socket.
+//
+// A long-running console-jpeg (--daemon, or --socket=path alongside stdin)
+// owns the display and listens on the socket. Any number of clients
+// (e.g. --client) connect and send commands using the same grammar as
+// stdin, one per line. A daemon skips the card probing, plane enumeration,
+// buffer allocation and modeset that every fresh console-jpeg pays for.
+//
+// The server answers every command with one line, once the command is
+// done (for images, once the image is on the screen):
+//   ok shown seq=123 t=4567.890123   new frame number, CLOCK_MONOTONIC time
+//   ok done                          no change on the screen
+//   ok exit
+//   err command foo.txt              unknown command or file type
+//   err decode photo.jpg             couldn't read the image
+//   err save out.png
+//   err display ...                  display error, server is quitting
+//   err busy                         too many clients
+
+// $XDG_RUNTIME_DIR/console-jpeg.sock, or /tmp/console-jpeg.sock
+const char* control_default_path();
+
+// Server: create the listening socket. Replaces a stale socket file.
+// Returns the listening fd, or -1.
+int control_listen(const char* path);
+
+// Server: close the listening socket and remove the socket file.
+void control_close();
+
+// Server: send one reply line. Never raises SIGPIPE or blocks, since
+// clients that don't care about replies just hang up or never read them.
+int control_reply(int fd, const char* line);
+
+// Client: send commands to the server. With sync, wait for each command's
+// reply and report errors. Returns an exit status for main().
+int control_client(const char* path, int num_commands, const char* commands[],
+    bool sync);
+
+#endif
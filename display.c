@@ -0,0 +1,935 @@
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <drm_fourcc.h>
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+
+#include "display.h"
+#include "drm_search.h"
+#include "frame_buffer.h"
+#include "probes.h"
+#include "util.h"
+
+// Two for double buffering.
+struct Frame_Buffer* FB0 = 0;
+struct Frame_Buffer* FB1 = 0;
+
+static uint32_t Crtc_Id = 0;
+static drmModeModeInfo* Mode_Info = 0;
+static drmModeCrtc* Saved_Crtc = 0;
+
+// First buffer uses drmModeSetCrtc().
+// Subsequent buffers use drmModePageFlip().
+// Also need drmModeSetCrtc() to come out of display power-down.
+static bool First_Flip = true;
+
+// Set by drmModePageFlip(), cleared by the page flip event.
+static bool Flip_Pending = false;
+
+// Frames shown, and the time the last one went up.
+static uint32_t Flip_Seq = 0;
+static double Flip_Time = 0;
+
+bool Plane_Scale = false;
+uint32_t Canvas_Width = 0;
+uint32_t Canvas_Height = 0;
+bool Yuv_Scanout = false;
+int Rotate = 0;
+
+// The two formats. Yuv_Format is 0 without --yuv.
+static uint32_t Rgb_Format = 0;
+static uint32_t Yuv_Format = 0;
+
+// Buffers of the format FB0 and FB1 aren't, swapped in by
+// display_back_buffer(). At most two of each format exist.
+#define NUM_SPARE_FBS 2
+static struct Frame_Buffer* Spare_FBs[NUM_SPARE_FBS];
+
+// --rotate without a plane that rotates: FB0 and FB1 are drawn turned the
+// way they're seen, and display_present() copies them into these, the
+// screen's way up, to be shown. That's two more screen size buffers, and
+// a full frame copy after each flip is done and before the next. Both 0
+// otherwise.
+static struct Frame_Buffer* Scanout_FBs[2];
+static int Scanout_Ix = 0;
+
+// Atomic modesetting, when a feature needs the plane properties. Otherwise
+// the legacy calls above.
+static bool Atomic = false;
+static uint32_t Plane_Id = 0;
+static uint32_t Mode_Blob = 0;
+
+// The plane's rotation for --rotate, set on every commit, and the value
+// that puts it back. 0 if the plane isn't rotating.
+static uint64_t Rotation = 0;
+static uint64_t No_Rotation = 0;
+
+static struct {
+    uint32_t conn_crtc_id;
+    uint32_t crtc_mode_id;
+    uint32_t crtc_active;
+    uint32_t fb_id;
+    uint32_t crtc_id;
+    uint32_t src_x;
+    uint32_t src_y;
+    uint32_t src_w;
+    uint32_t src_h;
+    uint32_t crtc_x;
+    uint32_t crtc_y;
+    uint32_t crtc_w;
+    uint32_t crtc_h;
+
+    // optional, for YUV buffers
+    uint32_t color_encoding;
+    uint32_t color_range;
+
+    // optional, for --rotate
+    uint32_t rotation;
+} Prop;
+
+// Enum values for jpeg's YCbCr: BT.601, full range.
+static uint64_t Bt601_Encoding = 0;
+static uint64_t Full_Range = 0;
+
+// TEST_ONLY results, since every image of the same size asks again.
+// Readers on preload's worker thread ask too.
+struct Scale_Test {
+    uint32_t view_w;
+    uint32_t view_h;
+    uint32_t pixel_format;
+    bool ok;
+};
+
+#define NUM_SCALE_TESTS 16
+static struct Scale_Test Scale_Tests[NUM_SCALE_TESTS];
+static int Num_Scale_Tests = 0;
+static pthread_mutex_t Scale_Lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void swap_frame_buffers()
+{
+    struct Frame_Buffer* x = FB0;
+    FB0 = FB1;
+    FB1 = x;
+}
+
+// Allocate and memory map two frame buffers: FB0 and FB1, or the scanout
+// buffers.
+static int create_two_frame_buffers(struct Frame_Buffer** fb_a,
+    struct Frame_Buffer** fb_b, int fd_drm, uint32_t width, uint32_t height,
+    uint32_t pixel_format)
+{
+    *fb_a = frame_buffer_create(fd_drm, width, height, pixel_format);
+    if (*fb_a == 0) {
+        return -1;
+    }
+
+    if (frame_buffer_map(*fb_a)) {
+        frame_buffer_destroy(*fb_a);
+        *fb_a = 0;
+        return -1;
+    }
+
+    *fb_b = frame_buffer_create(fd_drm, width, height, pixel_format);
+    if (*fb_b == 0) {
+        frame_buffer_destroy(*fb_a);
+        *fb_a = 0;
+        return -1;
+    }
+
+    if (frame_buffer_map(*fb_b)) {
+        frame_buffer_destroy(*fb_a);
+        frame_buffer_destroy(*fb_b);
+        *fb_a = 0;
+        *fb_b = 0;
+        return -1;
+    }
+    return 0;
+}
+
+// Property id by name, and its current value.
+static uint32_t find_prop(uint32_t obj_id, uint32_t obj_type, const char* name,
+    uint64_t* value)
+{
+    drmModeObjectProperties* props = drmModeObjectGetProperties(
+        My_Card->fd_drm, obj_id, obj_type);
+    if (props == 0) return 0;
+
+    uint32_t prop_id = 0;
+    uint32_t i;
+    for (i = 0; i < props->count_props && prop_id == 0; i++) {
+        drmModePropertyRes* prop = drmModeGetProperty(My_Card->fd_drm,
+            props->props[i]);
+        if (prop == 0) continue;
+        if (!strcmp(prop->name, name)) {
+            prop_id = prop->prop_id;
+            if (value) *value = props->prop_values[i];
+        }
+        drmModeFreeProperty(prop);
+    }
+
+    drmModeFreeObjectProperties(props);
+    return prop_id;
+}
+
+// Value of an enum property by name.
+static bool find_enum(uint32_t prop_id, const char* name, uint64_t* value)
+{
+    drmModePropertyRes* prop = drmModeGetProperty(My_Card->fd_drm, prop_id);
+    if (prop == 0) return false;
+
+    bool found = false;
+    int i;
+    for (i = 0; i < prop->count_enums; i++) {
+        if (!strcmp(prop->enums[i].name, name)) {
+            *value = prop->enums[i].value;
+            found = true;
+            break;
+        }
+    }
+    drmModeFreeProperty(prop);
+    return found;
+}
+
+// The primary plane that can go on our crtc.
+static uint32_t find_primary_plane()
+{
+    int fd = My_Card->fd_drm;
+
+    int crtc_ix;
+    for (crtc_ix = 0; crtc_ix < My_Card->drm_res->count_crtcs; crtc_ix++) {
+        if (My_Card->drm_res->crtcs[crtc_ix] == Crtc_Id) break;
+    }
+    if (crtc_ix == My_Card->drm_res->count_crtcs) return 0;
+
+    drmModePlaneRes* planes = drmModeGetPlaneResources(fd);
+    if (planes == 0) return 0;
+
+    uint32_t plane_id = 0;
+    uint32_t i;
+    for (i = 0; i < planes->count_planes && plane_id == 0; i++) {
+        drmModePlane* plane = drmModeGetPlane(fd, planes->planes[i]);
+        if (plane == 0) continue;
+
+        uint64_t type = 0;
+        if ((plane->possible_crtcs & (1 << crtc_ix)) &&
+            find_prop(plane->plane_id, DRM_MODE_OBJECT_PLANE, "type", &type) &&
+            type == DRM_PLANE_TYPE_PRIMARY) {
+            plane_id = plane->plane_id;
+        }
+        drmModeFreePlane(plane);
+    }
+
+    drmModeFreePlaneResources(planes);
+    return plane_id;
+}
+
+static int atomic_open()
+{
+    int fd = My_Card->fd_drm;
+
+    if (drmSetClientCap(fd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1) ||
+        drmSetClientCap(fd, DRM_CLIENT_CAP_ATOMIC, 1)) {
+        fprintf(File_Error, "Error: No atomic modesetting on %s.\n",
+                My_Card->dev_path);
+        return -1;
+    }
+
+    Plane_Id = find_primary_plane();
+    if (Plane_Id == 0) {
+        fprintf(File_Error, "Error: No primary plane for crtc %u.\n", Crtc_Id);
+        return -1;
+    }
+
+    uint32_t conn_id = My_Conn->drm_conn->connector_id;
+    Prop.conn_crtc_id = find_prop(conn_id, DRM_MODE_OBJECT_CONNECTOR, "CRTC_ID", 0);
+    Prop.crtc_mode_id = find_prop(Crtc_Id, DRM_MODE_OBJECT_CRTC, "MODE_ID", 0);
+    Prop.crtc_active = find_prop(Crtc_Id, DRM_MODE_OBJECT_CRTC, "ACTIVE", 0);
+    Prop.fb_id = find_prop(Plane_Id, DRM_MODE_OBJECT_PLANE, "FB_ID", 0);
+    Prop.crtc_id = find_prop(Plane_Id, DRM_MODE_OBJECT_PLANE, "CRTC_ID", 0);
+    Prop.src_x = find_prop(Plane_Id, DRM_MODE_OBJECT_PLANE, "SRC_X", 0);
+    Prop.src_y = find_prop(Plane_Id, DRM_MODE_OBJECT_PLANE, "SRC_Y", 0);
+    Prop.src_w = find_prop(Plane_Id, DRM_MODE_OBJECT_PLANE, "SRC_W", 0);
+    Prop.src_h = find_prop(Plane_Id, DRM_MODE_OBJECT_PLANE, "SRC_H", 0);
+    Prop.crtc_x = find_prop(Plane_Id, DRM_MODE_OBJECT_PLANE, "CRTC_X", 0);
+    Prop.crtc_y = find_prop(Plane_Id, DRM_MODE_OBJECT_PLANE, "CRTC_Y", 0);
+    Prop.crtc_w = find_prop(Plane_Id, DRM_MODE_OBJECT_PLANE, "CRTC_W", 0);
+    Prop.crtc_h = find_prop(Plane_Id, DRM_MODE_OBJECT_PLANE, "CRTC_H", 0);
+
+    uint32_t* p;
+    for (p = &Prop.conn_crtc_id; p <= &Prop.crtc_h; p++) {
+        if (*p == 0) {
+            fprintf(File_Error, "Error: Missing atomic property.\n");
+            return -1;
+        }
+    }
+
+    // Without these the driver picks, usually BT.601 limited range, and
+    // jpeg colors come out a little flat.
+    Prop.color_encoding = find_prop(Plane_Id, DRM_MODE_OBJECT_PLANE, "COLOR_ENCODING", 0);
+    Prop.color_range = find_prop(Plane_Id, DRM_MODE_OBJECT_PLANE, "COLOR_RANGE", 0);
+    if (Prop.color_encoding &&
+        !find_enum(Prop.color_encoding, "ITU-R BT.601 YCbCr", &Bt601_Encoding)) {
+        Prop.color_encoding = 0;
+    }
+    if (Prop.color_range &&
+        !find_enum(Prop.color_range, "YCbCr full range", &Full_Range)) {
+        Prop.color_range = 0;
+    }
+    Prop.rotation = find_prop(Plane_Id, DRM_MODE_OBJECT_PLANE, "rotation", 0);
+
+    if (drmModeCreatePropertyBlob(fd, Mode_Info, sizeof(*Mode_Info),
+            &Mode_Blob)) {
+        fprintf(File_Error, "Error: drmModeCreatePropertyBlob(): %s\n",
+                strerror(errno));
+        return -1;
+    }
+
+    if (Verbose) fprintf(File_Info, "Atomic, primary plane %u\n", Plane_Id);
+    Atomic = true;
+    return 0;
+}
+
+// Put src of fb, or fb's view if src is 0, on the whole screen. With
+// DRM_MODE_ATOMIC_ALLOW_MODESET, also set the mode and turn the crtc on.
+static int atomic_commit(struct Frame_Buffer* fb, const struct Plane_Src* src,
+    uint32_t flags)
+{
+    struct Plane_Src view = { 0, 0, fb->view_w << 16, fb->view_h << 16 };
+    if (src == 0) src = &view;
+
+    drmModeAtomicReq* req = drmModeAtomicAlloc();
+    if (req == 0) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    if (flags & DRM_MODE_ATOMIC_ALLOW_MODESET) {
+        drmModeAtomicAddProperty(req, My_Conn->drm_conn->connector_id,
+            Prop.conn_crtc_id, Crtc_Id);
+        drmModeAtomicAddProperty(req, Crtc_Id, Prop.crtc_mode_id, Mode_Blob);
+        drmModeAtomicAddProperty(req, Crtc_Id, Prop.crtc_active, 1);
+    }
+
+    // SRC is 16.16 fixed point
+    drmModeAtomicAddProperty(req, Plane_Id, Prop.fb_id, fb->fb_id);
+    drmModeAtomicAddProperty(req, Plane_Id, Prop.crtc_id, Crtc_Id);
+    drmModeAtomicAddProperty(req, Plane_Id, Prop.src_x, src->x);
+    drmModeAtomicAddProperty(req, Plane_Id, Prop.src_y, src->y);
+    drmModeAtomicAddProperty(req, Plane_Id, Prop.src_w, src->w);
+    drmModeAtomicAddProperty(req, Plane_Id, Prop.src_h, src->h);
+    drmModeAtomicAddProperty(req, Plane_Id, Prop.crtc_x, 0);
+    drmModeAtomicAddProperty(req, Plane_Id, Prop.crtc_y, 0);
+    drmModeAtomicAddProperty(req, Plane_Id, Prop.crtc_w, Mode_Info->hdisplay);
+    drmModeAtomicAddProperty(req, Plane_Id, Prop.crtc_h, Mode_Info->vdisplay);
+    if (Rotation) {
+        drmModeAtomicAddProperty(req, Plane_Id, Prop.rotation, Rotation);
+    }
+    if (fb->num_planes > 1) {
+        if (Prop.color_encoding) {
+            drmModeAtomicAddProperty(req, Plane_Id, Prop.color_encoding,
+                Bt601_Encoding);
+        }
+        if (Prop.color_range) {
+            drmModeAtomicAddProperty(req, Plane_Id, Prop.color_range, Full_Range);
+        }
+    }
+
+    int err = drmModeAtomicCommit(My_Card->fd_drm, req, flags, fb);
+    drmModeAtomicFree(req);
+    return err;
+}
+
+// The rotation property's value for degrees counter-clockwise, or 0 if the
+// plane can't. It's a bitmask, and the enum values are bit numbers.
+static uint64_t rotation_value(int degrees)
+{
+    if (Prop.rotation == 0) return 0;
+
+    char name[16];
+    snprintf(name, sizeof(name), "rotate-%i", degrees);
+    uint64_t bit;
+    if (!find_enum(Prop.rotation, name, &bit)) return 0;
+    return 1ull << bit;
+}
+
+// --rotate when the plane can't: FB0 and FB1 stay as they are, and are
+// copied turned into two buffers the screen's way up (the canvas's, with
+// --canvas). --plane-scale and --yuv go off, since the copy would have to
+// follow every image's view, and turn chroma planes.
+static int rotate_on_cpu(uint32_t pixel_format)
+{
+    fprintf(File_Error, "Warning: Plane can't rotate %i, rotating on the CPU.\n",
+            Rotate);
+    if (Plane_Scale) {
+        fprintf(File_Error, "Warning: --plane-scale off with --rotate on the CPU.\n");
+        Plane_Scale = false;
+    }
+    if (Yuv_Scanout) {
+        fprintf(File_Error, "Warning: --yuv off with --rotate on the CPU.\n");
+        Yuv_Scanout = false;
+        Yuv_Format = 0;
+    }
+
+    bool turned = Rotate != 180;
+    return create_two_frame_buffers(&Scanout_FBs[0], &Scanout_FBs[1],
+        My_Card->fd_drm, turned ? FB0->height : FB0->width,
+        turned ? FB0->width : FB0->height, pixel_format);
+}
+
+// YUV420 if the primary plane takes it, else NV12, else 0.
+static uint32_t choose_yuv_format()
+{
+    drmModePlane* plane = drmModeGetPlane(My_Card->fd_drm, Plane_Id);
+    if (plane == 0) return 0;
+
+    bool yuv420 = false, nv12 = false;
+    uint32_t i;
+    for (i = 0; i < plane->count_formats; i++) {
+        if (plane->formats[i] == DRM_FORMAT_YUV420) yuv420 = true;
+        if (plane->formats[i] == DRM_FORMAT_NV12) nv12 = true;
+    }
+    drmModeFreePlane(plane);
+
+    if (yuv420) return DRM_FORMAT_YUV420;
+    if (nv12) return DRM_FORMAT_NV12;
+    return 0;
+}
+
+int display_open()
+{
+    Mode_Info = &My_Conn->drm_conn->modes[My_Conn->best_mode_ix];
+
+    drmModeEncoder* encoder = drmModeGetEncoder(My_Card->fd_drm,
+        My_Conn->drm_conn->encoder_id);
+    if (encoder == 0) {
+        fprintf(File_Error, "Error: No encoder.\n");
+        return -1;
+    }
+    Crtc_Id = encoder->crtc_id;
+    drmModeFreeEncoder(encoder);
+
+    uint32_t pixel_format;
+    if (choose_pixel_format(&pixel_format)) {
+        fprintf(File_Error, "Error: No acceptable pixel format.\n");
+        return -1;
+    }
+    const struct Pixel_Format* pf = lookup_pixel_format(pixel_format);
+
+    if (Verbose) {
+        fprintf(File_Info, "Picked '%s', %i bytes/pix\n",
+            four_cc_to_str(pixel_format), pf->bytes_per_pixel);
+    }
+
+    if ((Plane_Scale || Canvas_Width || Yuv_Scanout || Rotate) &&
+        atomic_open()) {
+        if (Plane_Scale) {
+            fprintf(File_Error, "Warning: --plane-scale off, resizing on the CPU.\n");
+        }
+        if (Canvas_Width) {
+            fprintf(File_Error, "Warning: --canvas off, using the screen size.\n");
+        }
+        if (Yuv_Scanout) {
+            fprintf(File_Error, "Warning: --yuv off, decoding to RGB.\n");
+        }
+        Plane_Scale = false;
+        Canvas_Width = Canvas_Height = 0;
+        Yuv_Scanout = false;
+    }
+
+    Rgb_Format = pixel_format;
+    if (Yuv_Scanout) {
+        Yuv_Format = choose_yuv_format();
+        if (Yuv_Format == 0) {
+            fprintf(File_Error, "Warning: Plane %u takes no YUV420 or NV12, "
+                    "--yuv off.\n", Plane_Id);
+            Yuv_Scanout = false;
+        }
+        else if (Verbose) {
+            fprintf(File_Info, "YUV '%s' for jpegs\n",
+                four_cc_to_str(Yuv_Format));
+        }
+    }
+
+    // Images are drawn the way the screen is seen: portrait, on a screen
+    // turned 90 degrees. The canvas is given that way too.
+    bool turned = Rotate == 90 || Rotate == 270;
+    uint32_t screen_w = turned ? Mode_Info->vdisplay : Mode_Info->hdisplay;
+    uint32_t screen_h = turned ? Mode_Info->hdisplay : Mode_Info->vdisplay;
+
+    uint32_t width = screen_w;
+    uint32_t height = screen_h;
+    if (Canvas_Width) {
+        width = Canvas_Width;
+        height = Canvas_Height;
+    }
+
+    int err = create_two_frame_buffers(&FB0, &FB1, My_Card->fd_drm, width,
+        height, pixel_format);
+    if (err) {
+        return -1;
+    }
+
+    if (Rotate) {
+        // Can the plane turn the buffer?
+        if (Atomic) Rotation = rotation_value(Rotate);
+        if (Rotation && atomic_commit(FB0, 0, DRM_MODE_ATOMIC_TEST_ONLY |
+                                              DRM_MODE_ATOMIC_ALLOW_MODESET)) {
+            Rotation = 0;
+        }
+        if (Rotation) {
+            No_Rotation = rotation_value(0);
+            if (Verbose) fprintf(File_Info, "Rotate %i by the plane\n", Rotate);
+        }
+        else if (rotate_on_cpu(pixel_format)) {
+            return -1;
+        }
+    }
+
+    if (Canvas_Width) {
+        // Can the plane scale the canvas to the screen?
+        struct Frame_Buffer* shown = Scanout_FBs[0] ? Scanout_FBs[0] : FB0;
+        if (atomic_commit(shown, 0, DRM_MODE_ATOMIC_TEST_ONLY |
+                                    DRM_MODE_ATOMIC_ALLOW_MODESET)) {
+            fprintf(File_Error, "Warning: Display can't scale %ux%u to %ux%u, "
+                    "--canvas off.\n", width, height, screen_w, screen_h);
+            frame_buffer_destroy(FB0);
+            frame_buffer_destroy(FB1);
+            Canvas_Width = Canvas_Height = 0;
+            err = create_two_frame_buffers(&FB0, &FB1, My_Card->fd_drm,
+                screen_w, screen_h, pixel_format);
+            if (err) {
+                return -1;
+            }
+            if (Scanout_FBs[0]) {
+                frame_buffer_destroy(Scanout_FBs[0]);
+                frame_buffer_destroy(Scanout_FBs[1]);
+                err = create_two_frame_buffers(&Scanout_FBs[0],
+                    &Scanout_FBs[1], My_Card->fd_drm, Mode_Info->hdisplay,
+                    Mode_Info->vdisplay, pixel_format);
+                if (err) {
+                    return -1;
+                }
+            }
+        }
+        else if (Verbose) {
+            fprintf(File_Info, "Canvas %ux%u, scaled to %ux%u\n", width, height,
+                screen_w, screen_h);
+        }
+    }
+
+    Saved_Crtc = drmModeGetCrtc(My_Card->fd_drm, Crtc_Id);
+    return 0;
+}
+
+void display_close()
+{
+    display_wait_idle();
+
+    if (Saved_Crtc) {
+        if (Rotation && No_Rotation && Saved_Crtc->buffer_id) {
+            // drmModeSetCrtc() would leave the plane turned
+            struct Frame_Buffer fb;
+            memset(&fb, 0, sizeof(fb));
+            fb.fb_id = Saved_Crtc->buffer_id;
+            fb.num_planes = 1;
+            struct Plane_Src src = {
+                Saved_Crtc->x << 16, Saved_Crtc->y << 16,
+                Saved_Crtc->mode.hdisplay << 16, Saved_Crtc->mode.vdisplay << 16
+            };
+            Rotation = No_Rotation;
+            atomic_commit(&fb, &src, DRM_MODE_ATOMIC_ALLOW_MODESET);
+        }
+        drmModeSetCrtc(My_Card->fd_drm, Saved_Crtc->crtc_id,
+            Saved_Crtc->buffer_id, Saved_Crtc->x, Saved_Crtc->y,
+            &My_Conn->drm_conn->connector_id, 1, &Saved_Crtc->mode);
+    }
+}
+
+static void page_flip_handler(int fd, unsigned int sequence,
+    unsigned int tv_sec, unsigned int tv_usec, void* user_data)
+{
+    Flip_Pending = false;
+    Flip_Seq++;
+    Flip_Time = tv_sec + tv_usec * 1e-6;
+    PROBE_FLIP_COMPLETE(((struct Frame_Buffer*)user_data)->fb_id, sequence);
+}
+
+static int read_drm_event()
+{
+    drmEventContext ev = {
+        .version = 2,
+        .page_flip_handler = page_flip_handler
+    };
+    if (drmHandleEvent(My_Card->fd_drm, &ev)) {
+        fprintf(File_Error, "Error: drmHandleEvent(): %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+int display_handle_events()
+{
+    struct pollfd pfd = { .fd = My_Card->fd_drm, .events = POLLIN };
+    while (poll(&pfd, 1, 0) > 0) {
+        if (read_drm_event()) return -1;
+    }
+    return 0;
+}
+
+int display_wait_idle()
+{
+    while (Flip_Pending && !Quit) {
+        struct pollfd pfd = { .fd = My_Card->fd_drm, .events = POLLIN };
+        int n = poll(&pfd, 1, 1000);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            fprintf(File_Error, "Error: poll(drm): %s\n", strerror(errno));
+            return -1;
+        }
+        if (n == 0) {
+            // A flip takes one frame. Don't hang forever if the event
+            // never comes.
+            fprintf(File_Error, "Error: Timed out waiting for page flip.\n");
+            Flip_Pending = false;
+            return -1;
+        }
+        if (read_drm_event()) return -1;
+    }
+    return 0;
+}
+
+int display_present()
+{
+    int err;
+
+    // FB0, or with --rotate on the CPU, FB0 turned into the scanout buffer
+    // that isn't on the screen once the last flip is done.
+    struct Frame_Buffer* shown = FB0;
+    if (Scanout_FBs[0]) {
+        if (display_wait_idle()) return -1;
+        shown = Scanout_FBs[Scanout_Ix];
+        Scanout_Ix ^= 1;
+
+        double t0 = time_f();
+        rotate_copy(shown, FB0, Rotate);
+        if (Verbose) fprintf(File_Info, "  rotate  %5.3f sec\n", time_f() - t0);
+    }
+
+    if (First_Flip) {
+        PROBE_FLIP_SUBMIT(shown->fb_id);
+        if (Atomic) {
+            err = atomic_commit(shown, 0, DRM_MODE_ATOMIC_ALLOW_MODESET);
+        }
+        else {
+            err = drmModeSetCrtc(My_Card->fd_drm, Crtc_Id, shown->fb_id, 0, 0,
+                         &My_Conn->drm_conn->connector_id, 1, Mode_Info);
+        }
+        if (err) {
+            fprintf(File_Error, "Error: %s(FB0): %s\n",
+                    Atomic ? "drmModeAtomicCommit" : "drmModeSetCrtc",
+                    strerror(errno));
+            return -1;
+        }
+        // synchronous, no event
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        Flip_Seq++;
+        Flip_Time = ts.tv_sec + ts.tv_nsec * 1e-9;
+        PROBE_FLIP_COMPLETE(shown->fb_id, 0);
+        First_Flip = false;
+    }
+    else {
+        // Only one flip can be pending at a time.
+        if (display_wait_idle()) return -1;
+
+        // Schedule buffer flip. The kernel sends an event when it's done.
+        PROBE_FLIP_SUBMIT(shown->fb_id);
+        while (!Quit) {
+            if (Atomic) {
+                err = atomic_commit(shown, 0,
+                        DRM_MODE_PAGE_FLIP_EVENT | DRM_MODE_ATOMIC_NONBLOCK);
+            }
+            else {
+                err = drmModePageFlip(My_Card->fd_drm, Crtc_Id, shown->fb_id,
+                            DRM_MODE_PAGE_FLIP_EVENT, shown);
+            }
+            if (err == 0) {
+                // success
+                Flip_Pending = true;
+                break;
+            }
+            if (errno != EBUSY) {
+                // a real error
+                fprintf(File_Error, "Error: %s(FB0): %s\n",
+                        Atomic ? "drmModeAtomicCommit" : "drmModePageFlip",
+                        strerror(errno));
+                return -1;
+            }
+
+            // EBUSY
+            // Somebody else's flip is still pending. Sleep for 5 ms and
+            // retry.
+            sleep_f(5e-3);
+        }
+    }
+    swap_frame_buffers();
+    return 0;
+}
+
+struct Frame_Buffer* display_like_buffer(bool yuv)
+{
+    uint32_t format = yuv && Yuv_Format ? Yuv_Format : Rgb_Format;
+    if (FB0->pixel_format == format) return FB0;
+
+    int i;
+    for (i = 0; i < NUM_SPARE_FBS; i++) {
+        if (Spare_FBs[i] && Spare_FBs[i]->pixel_format == format) {
+            return Spare_FBs[i];
+        }
+    }
+
+    // First one of this format. Only YUV buffers get made here, there are
+    // always two RGB ones.
+    struct Frame_Buffer* fb = 0;
+    for (i = 0; i < NUM_SPARE_FBS && Spare_FBs[i]; i++);
+    if (i < NUM_SPARE_FBS) {
+        fb = frame_buffer_create(My_Card->fd_drm, FB0->width, FB0->height,
+            format);
+    }
+    if (fb && frame_buffer_map(fb)) {
+        frame_buffer_destroy(fb);
+        fb = 0;
+    }
+    if (fb == 0) {
+        fprintf(File_Error, "Warning: No '%s' frame buffer, --yuv off.\n",
+                four_cc_to_str(format));
+        Yuv_Scanout = false;
+        Yuv_Format = 0;
+        return display_like_buffer(false);
+    }
+    Spare_FBs[i] = fb;
+    return fb;
+}
+
+struct Frame_Buffer* display_back_buffer(bool yuv)
+{
+    struct Frame_Buffer* fb = display_like_buffer(yuv);
+    if (fb == FB0) return fb;
+
+    int i;
+    for (i = 0; i < NUM_SPARE_FBS; i++) {
+        if (Spare_FBs[i] == fb) Spare_FBs[i] = FB0;
+    }
+    FB0 = fb;
+    return fb;
+}
+
+struct Frame_Buffer* display_replace_back_buffer(struct Frame_Buffer* fb)
+{
+    struct Frame_Buffer* old = FB0;
+    FB0 = fb;
+    return old;
+}
+
+bool display_plane_scale(struct Frame_Buffer* fb, int img_w, int img_h,
+    int* border_left, int* border_right, int* border_top, int* border_bottom)
+{
+    if (!Plane_Scale || img_w <= 0 || img_h <= 0) return false;
+    if (img_w > fb->width || img_h > fb->height) return false;
+
+    // Grow the image to the buffer's aspect ratio with borders, so the
+    // plane covers the whole screen and the borders are bgcolor.
+    uint32_t view_w = img_w;
+    uint32_t view_h = img_h;
+    if ((uint64_t)img_w * fb->height > (uint64_t)img_h * fb->width) {
+        view_h = ((uint64_t)img_w * fb->height + fb->width / 2) / fb->width;
+        if (view_h > fb->height) view_h = fb->height;
+    }
+    else {
+        view_w = ((uint64_t)img_h * fb->width + fb->height / 2) / fb->height;
+        if (view_w > fb->width) view_w = fb->width;
+    }
+    if (fb->num_planes > 1) {
+        // whole chroma samples
+        if (view_w & 1 && view_w < fb->width) view_w++;
+        if (view_h & 1 && view_h < fb->height) view_h++;
+    }
+
+    pthread_mutex_lock(&Scale_Lock);
+
+    int i;
+    int found = -1;
+    for (i = 0; i < Num_Scale_Tests; i++) {
+        struct Scale_Test* t = &Scale_Tests[i];
+        if (t->view_w == view_w && t->view_h == view_h &&
+            t->pixel_format == fb->pixel_format) {
+            found = i;
+            break;
+        }
+    }
+
+    bool ok;
+    if (found >= 0) {
+        ok = Scale_Tests[found].ok;
+    }
+    else {
+        // Ask the driver if the plane can scale by this much.
+        uint32_t save_w = fb->view_w;
+        uint32_t save_h = fb->view_h;
+        fb->view_w = view_w;
+        fb->view_h = view_h;
+        ok = atomic_commit(fb, 0, DRM_MODE_ATOMIC_TEST_ONLY |
+                               DRM_MODE_ATOMIC_ALLOW_MODESET) == 0;
+        fb->view_w = save_w;
+        fb->view_h = save_h;
+
+        if (Verbose) {
+            fprintf(File_Info, "  plane  %u x %u -> %u x %u %s\n",
+                view_w, view_h, Mode_Info->hdisplay, Mode_Info->vdisplay,
+                ok ? "ok" : "not supported");
+        }
+
+        // oldest result goes
+        if (Num_Scale_Tests == NUM_SCALE_TESTS) {
+            memmove(Scale_Tests, Scale_Tests + 1,
+                    (NUM_SCALE_TESTS - 1) * sizeof(struct Scale_Test));
+            Num_Scale_Tests--;
+        }
+        struct Scale_Test* t = &Scale_Tests[Num_Scale_Tests++];
+        t->view_w = view_w;
+        t->view_h = view_h;
+        t->pixel_format = fb->pixel_format;
+        t->ok = ok;
+    }
+
+    pthread_mutex_unlock(&Scale_Lock);
+
+    if (!ok) return false;
+
+    fb->view_w = view_w;
+    fb->view_h = view_h;
+    *border_left = *border_right = *border_top = *border_bottom = 0;
+    split_border(view_w - img_w, border_left, border_right);
+    split_border(view_h - img_h, border_top, border_bottom);
+    return true;
+}
+
+struct Frame_Buffer* display_create_buffer(uint32_t width, uint32_t height)
+{
+    drmModeRes* res = My_Card->drm_res;
+    if (width > res->max_width || height > res->max_height) {
+        fprintf(File_Error, "Error: %ux%u is bigger than %s takes (%ux%u).\n",
+                width, height, My_Card->dev_path, res->max_width,
+                res->max_height);
+        return 0;
+    }
+
+    struct Frame_Buffer* fb = frame_buffer_create(My_Card->fd_drm, width,
+        height, Rgb_Format);
+    if (fb && frame_buffer_map(fb)) {
+        frame_buffer_destroy(fb);
+        fb = 0;
+    }
+    if (fb == 0) {
+        fprintf(File_Error, "Error: No %ux%u frame buffer.\n", width, height);
+    }
+    return fb;
+}
+
+void display_sizes(uint32_t* screen_w, uint32_t* screen_h, uint32_t* max_w,
+    uint32_t* max_h)
+{
+    bool turned = Rotate == 90 || Rotate == 270;
+    *screen_w = turned ? Mode_Info->vdisplay : Mode_Info->hdisplay;
+    *screen_h = turned ? Mode_Info->hdisplay : Mode_Info->vdisplay;
+    *max_w = My_Card->drm_res->max_width;
+    *max_h = My_Card->drm_res->max_height;
+}
+
+int display_show_src(struct Frame_Buffer* fb, const struct Plane_Src* src,
+    bool test_only)
+{
+    if (Scanout_FBs[0]) {
+        // --rotate on the CPU: the plane would show fb sideways
+        if (!test_only) {
+            fprintf(File_Error, "Error: Moving the plane needs it to rotate.\n");
+        }
+        return -1;
+    }
+
+    if (!Atomic && atomic_open()) {
+        fprintf(File_Error, "Error: Moving the plane needs atomic modesetting.\n");
+        return -1;
+    }
+
+    if (test_only) {
+        return atomic_commit(fb, src, DRM_MODE_ATOMIC_TEST_ONLY |
+                                      DRM_MODE_ATOMIC_ALLOW_MODESET);
+    }
+
+    if (display_wait_idle()) return -1;
+
+    PROBE_FLIP_SUBMIT(fb->fb_id);
+    int err;
+    if (First_Flip) {
+        // asleep, same as display_present()
+        err = atomic_commit(fb, src, DRM_MODE_ATOMIC_ALLOW_MODESET);
+        if (err == 0) {
+            struct timespec ts;
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            Flip_Seq++;
+            Flip_Time = ts.tv_sec + ts.tv_nsec * 1e-9;
+            PROBE_FLIP_COMPLETE(fb->fb_id, 0);
+            First_Flip = false;
+        }
+    }
+    else {
+        while ((err = atomic_commit(fb, src, DRM_MODE_PAGE_FLIP_EVENT |
+                    DRM_MODE_ATOMIC_NONBLOCK)) && errno == EBUSY && !Quit) {
+            sleep_f(5e-3);
+        }
+        if (err == 0) Flip_Pending = true;
+    }
+    if (err) {
+        fprintf(File_Error, "Error: drmModeAtomicCommit(src): %s\n",
+                strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+int display_sleep()
+{
+    display_wait_idle();
+
+    int err = drmModeSetCrtc(My_Card->fd_drm, Crtc_Id, 0, 0, 0, 0, 0, 0);
+    if (err) {
+        fprintf(File_Error, "Error: drmModeSetCrtc(sleep): %s\n",
+                strerror(errno));
+        return -1;
+    }
+    First_Flip = true;
+    return 0;
+}
+
+int display_fd()
+{
+    return My_Card->fd_drm;
+}
+
+bool display_flip_pending()
+{
+    return Flip_Pending;
+}
+
+void display_last_flip(uint32_t* seq, double* t)
+{
+    *seq = Flip_Seq;
+    *t = Flip_Time;
+}
@@ -0,0 +1,128 @@
+#ifndef DISPLAY_H
+#define DISPLAY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "frame_buffer.h"
+
+// The screen: two frame buffers on My_Card / My_Conn.
+//
+// Double buffering:
+// Draw into FB0, then display_present() flips it onto the screen and swaps,
+// so FB1 is always the buffer currently on the screen.
+
+extern struct Frame_Buffer* FB0;
+extern struct Frame_Buffer* FB1;
+
+// --plane-scale: draw images smaller than the screen and let the display
+// hardware scale them up, instead of resizing on the CPU. Needs atomic
+// modesetting; display_open() turns it off if there isn't any.
+extern bool Plane_Scale;
+
+// --canvas=WxH: make the frame buffers this size instead of the screen's,
+// and let the display scale them up. 0 for the screen size. Also needs
+// atomic modesetting; display_open() falls back to the screen size.
+extern uint32_t Canvas_Width;
+extern uint32_t Canvas_Height;
+
+// --yuv: jpegs go to YUV420 or NV12 frame buffers, decoded without the
+// conversion to RGB. Other images and drawing stay RGB. Needs atomic
+// modesetting and a primary plane that takes one of them;
+// display_open() turns it off otherwise.
+extern bool Yuv_Scanout;
+
+// --rotate=0|90|180|270: turn everything this many degrees
+// counter-clockwise, for a screen mounted sideways or upside down. FB0 and
+// FB1 are the size as seen (portrait for 90 and 270), so images are
+// decoded and resized for that. The plane's rotation property turns them
+// if the driver has it; otherwise display_present() copies each one
+// turned into one of two more screen size buffers, an extra full frame
+// pass per picture.
+extern int Rotate;
+
+// Pick a pixel format, create the frame buffers (screen or canvas size),
+// and remember the crtc's current state so display_close() can put it back.
+// Call after pick_output() and close_other_cards_and_connectors().
+int display_open();
+
+// Restore whatever was on the screen before display_open().
+void display_close();
+
+// Flip FB0 onto the screen, then swap FB0 and FB1.
+// Doesn't wait for the flip to complete.
+int display_present();
+
+// FB0, in YUV if yuv and --yuv is on, RGB otherwise. A buffer of the
+// other format is swapped in when needed, so call this before drawing
+// rather than using FB0 directly. If a YUV buffer can't be made, --yuv
+// goes off and this returns RGB.
+struct Frame_Buffer* display_back_buffer(bool yuv);
+
+// A buffer with the size and format display_back_buffer() would give, for
+// decoding ahead of time (preload). Doesn't change FB0.
+struct Frame_Buffer* display_like_buffer(bool yuv);
+
+// Make fb the back buffer, e.g. a preloaded image, and return the old FB0
+// for reuse. fb must be the same size and format as FB0.
+struct Frame_Buffer* display_replace_back_buffer(struct Frame_Buffer* fb);
+
+// For --plane-scale. Pick a view of fb with the buffer's aspect ratio that
+// holds an img_w x img_h image plus borders, and check
+// (once per size) that the display can scale that to the screen. If so,
+// sets fb's view and the borders, and returns true. Returns false if the
+// image doesn't fit in fb or the scaling isn't supported: resize on the
+// CPU instead.
+bool display_plane_scale(struct Frame_Buffer* fb, int img_w, int img_h,
+    int* border_left, int* border_right, int* border_top, int* border_bottom);
+
+// pan: a piece of a frame buffer in 16.16 fixed point pixels, like the
+// plane's SRC_ properties.
+struct Plane_Src {
+    uint32_t x;
+    uint32_t y;
+    uint32_t w;
+    uint32_t h;
+};
+
+// pan: an RGB frame buffer of any size the driver takes, mapped, for
+// showing a piece at a time with display_show_src(). Prints a message and
+// returns 0 if it can't be made.
+struct Frame_Buffer* display_create_buffer(uint32_t width, uint32_t height);
+
+// The screen's size as seen with --rotate, and the biggest frame buffer
+// the driver takes.
+void display_sizes(uint32_t* screen_w, uint32_t* screen_h, uint32_t* max_w,
+    uint32_t* max_h);
+
+// pan: flip src of fb onto the whole screen, scaled by the plane. Waits
+// for the last flip first, so calling this in a loop moves src once a
+// frame. FB0 and FB1 don't change; display_present() puts FB0 back up.
+// With test_only, only asks the driver whether it would work. Turns on
+// atomic modesetting if it isn't on, and returns -1 without it.
+int display_show_src(struct Frame_Buffer* fb, const struct Plane_Src* src,
+    bool test_only);
+
+// Power down the display. The next display_present() wakes it up.
+int display_sleep();
+
+// Wait until the last flip is on the screen. Call before drawing into FB0,
+// because until then FB0 may still be the buffer being scanned out.
+int display_wait_idle();
+
+// Dispatch pending kernel events (page flip complete) without blocking.
+// For when the caller polls display_fd() itself.
+int display_handle_events();
+
+// The drm file descriptor, readable when a flip has completed.
+int display_fd();
+
+// True between display_present() and the kernel's page flip event.
+bool display_flip_pending();
+
+// The frame that is on the screen now: how many frames have been shown
+// so far, and when it went up, in CLOCK_MONOTONIC seconds (the kernel's
+// vblank timestamp when there is one).
+void display_last_flip(uint32_t* seq, double* t);
+
+#endif
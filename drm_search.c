@@ -342,7 +342,10 @@ static struct Pixel_Format My_Pixel_Formats[] = {
     { DRM_FORMAT_BGR888,   3, 1, 1 },
     { DRM_FORMAT_RGB888,   3, 2, 0 },
     { DRM_FORMAT_XBGR8888, 4, 3, 1 },
-    { DRM_FORMAT_XRGB8888, 4, 4, 0 }
+    { DRM_FORMAT_XRGB8888, 4, 4, 0 },
+    // 16 bpp, dithered, for when nothing better is there
+    { DRM_FORMAT_RGB565,   2, 5, 0 },
+    { DRM_FORMAT_BGR565,   2, 6, 1 }
 };
 
 const struct Pixel_Format* lookup_pixel_format(uint32_t drm_four_cc)
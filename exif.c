@@ -0,0 +1,79 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "exif.h"
+
+// TIFF, inside the Exif segment, is either byte order.
+static uint32_t get_16(const unsigned char* p, bool big)
+{
+    return big ? p[0] << 8 | p[1] : p[1] << 8 | p[0];
+}
+
+static uint32_t get_32(const unsigned char* p, bool big)
+{
+    return big ? get_16(p, true) << 16 | get_16(p + 2, true) :
+                 get_16(p + 2, false) << 16 | get_16(p, false);
+}
+
+// Orientation (tag 0x112) in IFD0 of a TIFF header of length bytes.
+static int tiff_orientation(const unsigned char* tiff, size_t length)
+{
+    if (length < 8) return 1;
+
+    bool big;
+    if (!memcmp(tiff, "MM\0*", 4)) big = true;
+    else if (!memcmp(tiff, "II*\0", 4)) big = false;
+    else return 1;
+
+    uint32_t ifd = get_32(tiff + 4, big);
+    if (ifd > length - 2) return 1;
+
+    uint32_t count = get_16(tiff + ifd, big);
+    uint32_t i;
+    for (i = 0; i < count; i++) {
+        size_t at = ifd + 2 + (size_t)i * 12;
+        if (at + 12 > length) return 1;
+        // tag, type (3 is SHORT), count, value
+        const unsigned char* entry = tiff + at;
+        if (get_16(entry, big) != 0x112) continue;
+        if (get_16(entry + 2, big) != 3) return 1;
+        uint32_t value = get_16(entry + 8, big);
+        return value >= 1 && value <= 8 ? (int)value : 1;
+    }
+    return 1;
+}
+
+int exif_app1_orientation(const unsigned char* seg, size_t length)
+{
+    if (length < 6 || memcmp(seg, "Exif\0\0", 6)) return 1;
+    return tiff_orientation(seg + 6, length - 6);
+}
+
+int exif_orientation(const unsigned char* data, size_t length)
+{
+    if (length < 4 || data[0] != 0xff || data[1] != 0xd8) return 1;
+
+    // Markers and their segments up to the image data. APP1 is normally
+    // first.
+    size_t pos = 2;
+    while (pos + 4 <= length && data[pos] == 0xff) {
+        unsigned char marker = data[pos + 1];
+        size_t seg_len = data[pos + 2] << 8 | data[pos + 3];
+        if (marker == 0xff) {
+            // fill byte
+            pos++;
+            continue;
+        }
+        if (marker == 0xda || marker == 0xd9 || seg_len < 2) break;
+        if (pos + 2 + seg_len > length) break;
+
+        const unsigned char* seg = data + pos + 4;
+        size_t n = seg_len - 2;
+        if (marker == 0xe1 && n >= 6 && !memcmp(seg, "Exif\0\0", 6)) {
+            return exif_app1_orientation(seg, n);
+        }
+        pos += 2 + seg_len;
+    }
+    return 1;
+}
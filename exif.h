@@ -0,0 +1,21 @@
+#ifndef EXIF_H
+#define EXIF_H
+
+#include <stddef.h>
+
+// EXIF orientation, how a camera says to turn the image to show it:
+//   1 as stored            2 mirrored left-right
+//   3 turned 180           4 mirrored top-bottom
+//   5 transposed           6 turned 90 clockwise
+//   7 transposed and 180   8 turned 90 counterclockwise
+// 5 to 8 swap the width and height.
+
+// The orientation in a jpeg's APP1 Exif segment, read straight from the
+// file in memory. 1 if there isn't one, or it doesn't make sense.
+int exif_orientation(const unsigned char* data, size_t length);
+
+// The same from the contents of an APP1 segment, e.g. one libjpeg saved
+// with jpeg_save_markers().
+int exif_app1_orientation(const unsigned char* seg, size_t length);
+
+#endif
@@ -1,5 +1,6 @@
 #include <errno.h>
 #include <fcntl.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -79,16 +80,60 @@ static void memset_rgb32(uint8_t* buf, uint32_t color, size_t n) {
     }
 }
 
+bool is_yuv_format(uint32_t pixel_format)
+{
+    return pixel_format == DRM_FORMAT_YUV420 || pixel_format == DRM_FORMAT_NV12;
+}
+
+// 16 bpp, no dither for solid colors. Named by where red is in the 16 bit
+// word, not by byte order like the setters above.
+static void memset_565_red_high(uint8_t* buf, uint32_t color, size_t n) {
+    uint16_t r = 255 & (color >> 16);
+    uint16_t g = 255 & (color >> 8);
+    uint16_t b = 255 & color;
+    uint16_t px = (r >> 3) << 11 | (g >> 2) << 5 | b >> 3;
+
+    uint16_t* p = (uint16_t*)buf;
+    size_t i;
+    for (i = 0; i < n; i++) {
+        *p++ = px;
+    }
+}
+
+static void memset_565_red_low(uint8_t* buf, uint32_t color, size_t n) {
+    uint16_t r = 255 & (color >> 16);
+    uint16_t g = 255 & (color >> 8);
+    uint16_t b = 255 & color;
+    uint16_t px = (b >> 3) << 11 | (g >> 2) << 5 | r >> 3;
+
+    uint16_t* p = (uint16_t*)buf;
+    size_t i;
+    for (i = 0; i < n; i++) {
+        *p++ = px;
+    }
+}
+
 struct Frame_Buffer* frame_buffer_create(int fd_drm, uint32_t width,
     uint32_t height, uint32_t pixel_format)
 {
-    const struct Pixel_Format* pf = lookup_pixel_format(pixel_format);
+    bool yuv = is_yuv_format(pixel_format);
+    const struct Pixel_Format* pf = yuv ? 0 : lookup_pixel_format(pixel_format);
 
     struct drm_mode_create_dumb arg = {
         .height = height,
         .width = width,
     };
-    arg.bpp = pf->bytes_per_pixel * 8;
+    if (yuv) {
+        // One byte per pixel of Y, then half as many rows of chroma at the
+        // same pitch: two half-pitch planes for YUV420, or UV pairs for
+        // NV12. Even width so the chroma rows fit.
+        arg.width = (width + 1) & ~1;
+        arg.height = height + (height + 1) / 2;
+        arg.bpp = 8;
+    }
+    else {
+        arg.bpp = pf->bytes_per_pixel * 8;
+    }
 
     struct Frame_Buffer* fb = malloc(sizeof(struct Frame_Buffer));
     if (fb == 0) {
@@ -109,6 +154,27 @@ struct Frame_Buffer* frame_buffer_create(int fd_drm, uint32_t width,
     uint32_t offsets[4] = { 0 };
     uint32_t fb_id;
 
+    int num_planes = 1;
+    uint32_t chroma_offset[2] = { 0 };
+    uint32_t chroma_stride = 0;
+    if (pixel_format == DRM_FORMAT_YUV420) {
+        num_planes = 3;
+        chroma_stride = arg.pitch / 2;
+        chroma_offset[0] = arg.pitch * height;
+        chroma_offset[1] = chroma_offset[0] + chroma_stride * ((height + 1) / 2);
+    }
+    else if (pixel_format == DRM_FORMAT_NV12) {
+        num_planes = 2;
+        chroma_stride = arg.pitch;
+        chroma_offset[0] = arg.pitch * height;
+    }
+    int i;
+    for (i = 1; i < num_planes; i++) {
+        handles[i] = arg.handle;
+        pitches[i] = chroma_stride;
+        offsets[i] = chroma_offset[i - 1];
+    }
+
     err = drmModeAddFB2(fd_drm, width, height, pixel_format,
             handles, pitches, offsets, &fb_id, 0);
     if (err) {
@@ -125,14 +191,34 @@ struct Frame_Buffer* frame_buffer_create(int fd_drm, uint32_t width,
     fb->stride = arg.pitch;
     fb->size = arg.size;
     fb->pixel_format = pixel_format;
-    fb->bytes_per_pixel = pf->bytes_per_pixel;
-    fb->red_first = pf->red_first;
-    if (pf->bytes_per_pixel == 3) {
-        fb->pixel_set = pf->red_first ? memset_rgb24 : memset_bgr24;
+    if (yuv) {
+        // fill_rect() and draw_borders() handle YUV themselves
+        fb->bytes_per_pixel = 1;
+        fb->red_first = false;
+        fb->pixel_set = 0;
     }
     else {
-        fb->pixel_set = pf->red_first ? memset_rgb32 : memset_bgr32;
+        fb->bytes_per_pixel = pf->bytes_per_pixel;
+        fb->red_first = pf->red_first;
+        if (pf->bytes_per_pixel == 2) {
+            // red_first is BGR565: red in the low bits, so in the first
+            // byte, little endian. RGB565 has it in the high bits.
+            fb->pixel_set = pf->red_first ? memset_565_red_low :
+                memset_565_red_high;
+        }
+        else if (pf->bytes_per_pixel == 3) {
+            fb->pixel_set = pf->red_first ? memset_rgb24 : memset_bgr24;
+        }
+        else {
+            fb->pixel_set = pf->red_first ? memset_rgb32 : memset_bgr32;
+        }
     }
+    fb->num_planes = num_planes;
+    fb->chroma_offset[0] = chroma_offset[0];
+    fb->chroma_offset[1] = chroma_offset[1];
+    fb->chroma_stride = chroma_stride;
+    fb->view_w = width;
+    fb->view_h = height;
     fb->handle = arg.handle;
     fb->fb_id = fb_id;
     fb->fd_dma = -1;
@@ -184,35 +270,111 @@ void frame_buffer_unmap(struct Frame_Buffer* fb)
     fb->fd_dma = -1;
 }
 
+void frame_buffer_view_all(struct Frame_Buffer* fb)
+{
+    fb->view_w = fb->width;
+    fb->view_h = fb->height;
+}
+
 uint8_t* get_pixels(struct Frame_Buffer* fb, int x, int y)
 {
     return fb->pixels + y * fb->stride + x * fb->bytes_per_pixel;
 }
 
+uint8_t* get_chroma(struct Frame_Buffer* fb, int plane, int x, int y)
+{
+    int bytes = fb->pixel_format == DRM_FORMAT_NV12 ? 2 : 1;
+    return fb->pixels + fb->chroma_offset[plane] +
+        (y >> 1) * fb->chroma_stride + (x >> 1) * bytes;
+}
+
 void fill_pixels(struct Frame_Buffer* fb, uint32_t color, int x, int y, int n)
 {
     uint8_t* pixels = get_pixels(fb, x, y);
     fb->pixel_set(pixels, color, n);
 }
 
+// Full range BT.601, like jpeg.
+static void rgb_to_yuv(uint32_t color, uint8_t* y, uint8_t* u, uint8_t* v)
+{
+    int r = 255 & (color >> 16);
+    int g = 255 & (color >> 8);
+    int b = 255 & color;
+
+    // pure blue and red round up to 256
+    int cb = (-43 * r - 85 * g + 128 * b + 32896) >> 8;
+    int cr = (128 * r - 107 * g - 21 * b + 32896) >> 8;
+
+    *y = (77 * r + 150 * g + 29 * b + 128) >> 8;
+    *u = cb > 255 ? 255 : cb;
+    *v = cr > 255 ? 255 : cr;
+}
+
+// fill_rect() for YUV buffers, rect already clipped.
+// A chroma sample covers 2x2 pixels. Samples straddling the left or top
+// edge are left alone, so an image left of or above a border keeps its
+// colors. Images start on even pixels, so nothing straddles the others.
+static void fill_rect_yuv(struct Frame_Buffer* fb, uint32_t color, int left,
+    int top, int width, int height)
+{
+    uint8_t y, u, v;
+    rgb_to_yuv(color, &y, &u, &v);
+
+    int row;
+    for (row = top; row < top + height; row++) {
+        memset(get_pixels(fb, left, row), y, width);
+    }
+
+    // chroma rect, rounded in at the start, out at the end
+    int cx0 = (left + 1) >> 1;
+    int cy0 = (top + 1) >> 1;
+    int cx1 = (left + width + 1) >> 1;
+    int cy1 = (top + height + 1) >> 1;
+    if (cx1 <= cx0) return;
+
+    for (row = cy0; row < cy1; row++) {
+        if (fb->pixel_format == DRM_FORMAT_NV12) {
+            uint8_t* uv = get_chroma(fb, 0, cx0 * 2, row * 2);
+            int x;
+            for (x = cx0; x < cx1; x++) {
+                *uv++ = u;
+                *uv++ = v;
+            }
+        }
+        else {
+            memset(get_chroma(fb, 0, cx0 * 2, row * 2), u, cx1 - cx0);
+            memset(get_chroma(fb, 1, cx0 * 2, row * 2), v, cx1 - cx0);
+        }
+    }
+}
+
 void draw_borders(struct Frame_Buffer* fb, uint32_t color,  int left, int right,
     int top, int bottom)
 {
+    if (fb->num_planes > 1) {
+        int mid = fb->view_h - top - bottom;
+        if (top) fill_rect(fb, color, 0, 0, fb->view_w, top);
+        if (left) fill_rect(fb, color, 0, top, left, mid);
+        if (right) fill_rect(fb, color, fb->view_w - right, top, right, mid);
+        if (bottom) fill_rect(fb, color, 0, fb->view_h - bottom, fb->view_w, bottom);
+        return;
+    }
+
     int y;
     for (y = 0; y < top; y++) {
-        fill_pixels(fb, color, 0, y, fb->width);
+        fill_pixels(fb, color, 0, y, fb->view_w);
     }
 
     if (left || right) {
-        int n = fb->height - bottom;
+        int n = fb->view_h - bottom;
         for (; y < n; y++) {
             if (left) fill_pixels(fb, color, 0, y, left);
-            if (right) fill_pixels(fb, color, fb->width - right, y, right);
+            if (right) fill_pixels(fb, color, fb->view_w - right, y, right);
         }
     }
 
-    for (y = fb->height - bottom; y < fb->height; y++) {
-        fill_pixels(fb, color, 0, y, fb->width);
+    for (y = fb->view_h - bottom; y < fb->view_h; y++) {
+        fill_pixels(fb, color, 0, y, fb->view_w);
     }
 }
 
@@ -225,12 +387,57 @@ void fill_rect(struct Frame_Buffer* fb, uint32_t color, int left, int top,
     if (width  < 0 || left + width  > fb->width)  width  = fb->width  - left;
     if (height < 0 || top  + height > fb->height) height = fb->height - top;
 
+    if (fb->num_planes > 1) {
+        fill_rect_yuv(fb, color, left, top, width, height);
+        return;
+    }
+
     int y;
     for (y = top; y < top + height; y++) {
         fill_pixels(fb, color, left, y, width);
     }
 }
 
+// Thresholds 0-15, spread out so neighbors differ.
+static const uint8_t Bayer_4x4[4][4] = {
+    {  0,  8,  2, 10 },
+    { 12,  4, 14,  6 },
+    {  3, 11,  1,  9 },
+    { 15,  7, 13,  5 }
+};
+
+void dither_565(struct Frame_Buffer* fb, const uint8_t* src, uint32_t src_bpp,
+    uint32_t src_w, uint32_t src_h, uint32_t src_stride, int x, int y)
+{
+    // BGR565 has red in the low bits (red_first, like BGR888)
+    int r_shift = fb->red_first ? 0 : 11;
+    int b_shift = 11 - r_shift;
+
+    uint32_t i, j;
+    for (j = 0; j < src_h; j++) {
+        const uint8_t* s = src + j * src_stride;
+        uint16_t* d = (uint16_t*)get_pixels(fb, x, y + j);
+
+        // The pattern goes with screen position, so it doesn't crawl
+        // when the same image is drawn with different borders.
+        const uint8_t* bayer = Bayer_4x4[(y + j) & 3];
+        for (i = 0; i < src_w; i++) {
+            // Add just under one step of the target depth, then truncate:
+            // 8 for 5 bits, 4 for 6 bits.
+            int t = bayer[(x + i) & 3];
+            int r = s[0] + (t >> 1);
+            int g = s[1] + (t >> 2);
+            int b = s[2] + (t >> 1);
+            if (r > 255) r = 255;
+            if (g > 255) g = 255;
+            if (b > 255) b = 255;
+
+            d[i] = (r >> 3) << r_shift | (g >> 2) << 5 | (b >> 3) << b_shift;
+            s += src_bpp;
+        }
+    }
+}
+
 // Allocate extra pixels to two borders.
 void split_border(int extra, int* left, int* right)
 {
@@ -282,3 +489,73 @@ void swizzle_copy(bool swizzle, uint32_t bytes_per_pixel,
         }
     }
 }
+
+// One row of dst, n pixels read step bytes apart from src. A constant size
+// memcpy is a single load and store.
+static void rotate_row(uint8_t* dst, const uint8_t* src, ptrdiff_t step,
+    uint32_t n, uint32_t bytes_per_pixel)
+{
+    uint32_t i;
+    if (bytes_per_pixel == 4) {
+        for (i = 0; i < n; i++, src += step) memcpy(dst + 4 * i, src, 4);
+    }
+    else if (bytes_per_pixel == 3) {
+        for (i = 0; i < n; i++, src += step) memcpy(dst + 3 * i, src, 3);
+    }
+    else {
+        for (i = 0; i < n; i++, src += step) memcpy(dst + 2 * i, src, 2);
+    }
+}
+
+// Square tiles of this many pixels. Turning 90 degrees reads src down its
+// columns: within a tile that's 32 source lines, which stay in L1 while
+// the next dst row reads the pixels beside the last ones. Without tiles
+// every dst row would miss on every pixel.
+#define ROTATE_TILE 32
+
+void rotate_copy(struct Frame_Buffer* dst, const struct Frame_Buffer* src,
+    int degrees)
+{
+    uint32_t bpp = src->bytes_per_pixel;
+    uint32_t w = src->view_w;
+    uint32_t h = src->view_h;
+    ptrdiff_t stride = src->stride;
+
+    // The source of dst's top left pixel, and the steps through src for a
+    // step right and a step down in dst.
+    const uint8_t* base = src->pixels;
+    ptrdiff_t step_x, step_y;
+    if (degrees == 90) {
+        base += (w - 1) * bpp;
+        step_x = stride;
+        step_y = -(ptrdiff_t)bpp;
+    }
+    else if (degrees == 180) {
+        base += (h - 1) * stride + (w - 1) * bpp;
+        step_x = -(ptrdiff_t)bpp;
+        step_y = -stride;
+    }
+    else {
+        base += (h - 1) * stride;
+        step_x = -stride;
+        step_y = bpp;
+    }
+
+    bool turned = degrees != 180;
+    dst->view_w = turned ? h : w;
+    dst->view_h = turned ? w : h;
+
+    uint32_t tx, ty, y;
+    for (ty = 0; ty < dst->view_h; ty += ROTATE_TILE) {
+        uint32_t th = dst->view_h - ty;
+        if (th > ROTATE_TILE) th = ROTATE_TILE;
+        for (tx = 0; tx < dst->view_w; tx += ROTATE_TILE) {
+            uint32_t tw = dst->view_w - tx;
+            if (tw > ROTATE_TILE) tw = ROTATE_TILE;
+            for (y = ty; y < ty + th; y++) {
+                rotate_row(get_pixels(dst, tx, y),
+                    base + tx * step_x + y * step_y, step_x, tw, bpp);
+            }
+        }
+    }
+}
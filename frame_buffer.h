@@ -19,6 +19,19 @@ struct Frame_Buffer {
     bool red_first;
     void (*pixel_set)(uint8_t*, uint32_t, size_t);
 
+    // YUV420 and NV12 (--yuv): pixels and stride are the Y plane, one byte
+    // per pixel. The chroma plane(s) follow in the same buffer at half
+    // resolution, U then V for YUV420, or interleaved UV for NV12.
+    // num_planes is 1 for RGB formats.
+    int num_planes;
+    uint32_t chroma_offset[2];
+    uint32_t chroma_stride;
+
+    // The part of the buffer that is shown, from the top left corner,
+    // scaled to fill the screen. All of it, unless --plane-scale drew a
+    // smaller image.
+    uint32_t view_w;
+    uint32_t view_h;
 
     // dumb buffer
     drm_handle_t handle;
@@ -39,11 +52,22 @@ void frame_buffer_destroy(struct Frame_Buffer* fb);
 int frame_buffer_map(struct Frame_Buffer* fb);
 void frame_buffer_unmap(struct Frame_Buffer* fb);
 
+// Show the whole buffer again.
+void frame_buffer_view_all(struct Frame_Buffer* fb);
+
 
 uint8_t* get_pixels(struct Frame_Buffer* fb, int x, int y);
 
+// The chroma sample for pixel (x, y) of a YUV buffer, in the U plane
+// (plane 0) or V plane (plane 1). NV12 has UV pairs in plane 0.
+uint8_t* get_chroma(struct Frame_Buffer* fb, int plane, int x, int y);
+
+// YUV420 or NV12.
+bool is_yuv_format(uint32_t pixel_format);
+
 void fill_pixels(struct Frame_Buffer* fb, uint32_t color, int x, int y, int n);
 
+// Borders around an image in the view.
 void draw_borders(struct Frame_Buffer* fb, uint32_t color,  int left, int right,
     int top, int bottom);
 
@@ -54,7 +78,19 @@ void swizzle_copy(bool swizzle, uint32_t bytes_per_pixel,
     uint8_t* src, uint32_t src_w, uint32_t src_h, uint32_t src_stride,
     uint8_t* dst, uint32_t dst_stride);
 
+// RGB565 and BGR565: copy 8 bit RGB (src_bpp 3) or RGBX (4) into fb at
+// x, y with a 4x4 ordered dither, so gradients in photos don't band.
+void dither_565(struct Frame_Buffer* fb, const uint8_t* src, uint32_t src_bpp,
+    uint32_t src_w, uint32_t src_h, uint32_t src_stride, int x, int y);
+
 // Allocate extra pixels to two borders.
 void split_border(int extra, int* left, int* right);
 
+// --rotate without a plane that rotates: copy src's view into the top left
+// of dst turned degrees (90, 180 or 270) counter-clockwise, as the plane
+// would have shown it, and make that dst's view. RGB only; dst must have
+// room for the turned view.
+void rotate_copy(struct Frame_Buffer* dst, const struct Frame_Buffer* src,
+    int degrees);
+
 #endif
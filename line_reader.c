@@ -0,0 +1,82 @@
+#include <string.h>
+#include <unistd.h>
+
+#include "line_reader.h"
+
+void line_reader_init(struct Line_Reader* rd, int fd)
+{
+    rd->fd = fd;
+    rd->eof = false;
+    rd->start = 0;
+    rd->len = 0;
+}
+
+int line_reader_fill(struct Line_Reader* rd)
+{
+    // move leftover partial line to the front
+    if (rd->start > 0) {
+        memmove(rd->buf, rd->buf + rd->start, rd->len - rd->start);
+        rd->len -= rd->start;
+        rd->start = 0;
+    }
+
+    // leave room for a terminating null
+    size_t room = sizeof(rd->buf) - 1 - rd->len;
+    ssize_t n = read(rd->fd, rd->buf + rd->len, room);
+    if (n < 0) {
+        return -1;
+    }
+    if (n == 0) {
+        rd->eof = true;
+        return 0;
+    }
+    rd->len += n;
+    return n;
+}
+
+char* line_reader_next(struct Line_Reader* rd)
+{
+    char* line = rd->buf + rd->start;
+    size_t avail = rd->len - rd->start;
+    if (avail == 0) return 0;
+
+    char* nl = memchr(line, '\n', avail);
+    if (nl) {
+        *nl = 0;
+        rd->start += nl - line + 1;
+        return line;
+    }
+
+    // No newline. Give up on lines that fill the whole buffer, like
+    // fgets() does, and hand back whatever is left at end of file.
+    if (rd->eof || (rd->start == 0 && rd->len == sizeof(rd->buf) - 1)) {
+        line[avail] = 0;
+        rd->start = rd->len;
+        return line;
+    }
+    return 0;
+}
+
+size_t line_reader_take(struct Line_Reader* rd, void* buf, size_t n)
+{
+    size_t avail = rd->len - rd->start;
+    if (n > avail) n = avail;
+    memcpy(buf, rd->buf + rd->start, n);
+    rd->start += n;
+    return n;
+}
+
+const char* line_reader_peek(const struct Line_Reader* rd, size_t* pos,
+    size_t* len)
+{
+    if (*pos < rd->start) *pos = rd->start;
+    if (*pos >= rd->len) return 0;
+
+    const char* line = rd->buf + *pos;
+    const char* nl = memchr(line, '\n', rd->len - *pos);
+    if (nl == 0) return 0;
+
+    *len = nl - line;
+    *pos += *len + 1;
+    return line;
+}
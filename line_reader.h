@@ -0,0 +1,44 @@
+#ifndef LINE_READER_H
+#define LINE_READER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Split the bytes coming in on a file descriptor (pipe, socket) into
+// command lines. Unlike fgets(), this never reads more than one read()'s
+// worth at a time, so it works with poll().
+
+struct Line_Reader {
+    int fd;
+    bool eof;
+
+    // unread bytes are buf[start] .. buf[len-1]
+    size_t start;
+    size_t len;
+    char buf[4096];
+};
+
+void line_reader_init(struct Line_Reader* rd, int fd);
+
+// One read() into the buffer.
+// Returns bytes read, 0 at end of file, or -1 on error (check errno, e.g.
+// EINTR or EAGAIN).
+int line_reader_fill(struct Line_Reader* rd);
+
+// Return the next complete line with the newline stripped, or 0 if there
+// isn't one yet. At end of file, a final unterminated line is returned too.
+// The line is valid until the next call to line_reader_fill().
+char* line_reader_next(struct Line_Reader* rd);
+
+// Take up to n bytes that were read but not returned as lines, e.g. the
+// start of binary data that follows a command. Returns the number taken.
+// After that, read the rest straight from rd->fd.
+size_t line_reader_take(struct Line_Reader* rd, void* buf, size_t n);
+
+// Look ahead at complete lines that haven't been returned yet, without
+// using them up. Start with *pos = 0. Returns the next line (not null
+// terminated, *len bytes), or 0 when there are no more.
+const char* line_reader_peek(const struct Line_Reader* rd, size_t* pos,
+    size_t* len);
+
+#endif
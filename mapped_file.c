@@ -0,0 +1,131 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mapped_file.h"
+#include "mem_stats.h"
+#include "prefetch.h"
+#include "util.h"
+
+// Set by the main thread, checked by preload's worker too.
+static char* Read_Name = 0;
+static pthread_mutex_t Read_Lock = PTHREAD_MUTEX_INITIALIZER;
+
+void mapped_file_read_instead(const char* filename)
+{
+    pthread_mutex_lock(&Read_Lock);
+    free(Read_Name);
+    Read_Name = filename ? strdup(filename) : 0;
+    pthread_mutex_unlock(&Read_Lock);
+}
+
+static bool read_instead(const char* filename)
+{
+    pthread_mutex_lock(&Read_Lock);
+    bool read = Read_Name && !strcmp(Read_Name, filename);
+    pthread_mutex_unlock(&Read_Lock);
+    return read;
+}
+
+// Read up to length bytes of fd into a new buffer. A file cut short while
+// it's read gives fewer, and the decoder reports it as truncated.
+static int read_file(struct Mapped_File* mf, int fd, size_t length)
+{
+    unsigned char* buf = mem_malloc(length);
+    if (buf == 0) {
+        fprintf(File_Error, "Error: Out of memory at line %i.\n", __LINE__);
+        return -1;
+    }
+
+    size_t n = 0;
+    while (n < length) {
+        ssize_t got = pread(fd, buf + n, length - n, n);
+        if (got < 0 && errno == EINTR) continue;
+        if (got < 0) {
+            fprintf(File_Error, "Error: pread(): %s\n", strerror(errno));
+            mem_free(buf);
+            return -1;
+        }
+        if (got == 0) break;
+        n += got;
+    }
+
+    mf->data = buf;
+    mf->length = n;
+    mf->copied = true;
+    return 0;
+}
+
+int mapped_file_open(struct Mapped_File* mf, const char* filename)
+{
+    mf->data = 0;
+    mf->length = 0;
+    mf->copied = false;
+
+    mf->prefetch = prefetch_claim(filename, &mf->data, &mf->length);
+    if (mf->prefetch) return 0;
+
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(File_Error, "Error: open(%s): %s\n", filename, strerror(errno));
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        fprintf(File_Error, "Error: fstat(): %s\n", strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    if ((st.st_size >> 20) > MAX_INPUT_MB) {
+        fprintf(File_Error, "Error: %s larger than %i MB.\n", filename,
+                MAX_INPUT_MB);
+        close(fd);
+        return -1;
+    }
+    if (st.st_size == 0) {
+        // mmap() can't do 0 bytes
+        fprintf(File_Error, "Error: %s is empty.\n", filename);
+        close(fd);
+        return -1;
+    }
+
+    if (read_instead(filename)) {
+        int err = read_file(mf, fd, st.st_size);
+        close(fd);
+        return err;
+    }
+
+    void* addr = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        fprintf(File_Error, "Error: mmap(): %s\n", strerror(errno));
+        return -1;
+    }
+
+    // The decoders go through it once, front to back.
+    madvise(addr, st.st_size, MADV_SEQUENTIAL);
+    madvise(addr, st.st_size, MADV_WILLNEED);
+
+    mf->data = addr;
+    mf->length = st.st_size;
+    return 0;
+}
+
+void mapped_file_close(struct Mapped_File* mf)
+{
+    if (mf->prefetch) prefetch_release(mf->prefetch);
+    else if (mf->copied) mem_free((void*)mf->data);
+    else if (mf->data) munmap((void*)mf->data, mf->length);
+    mf->prefetch = 0;
+    mf->copied = false;
+    mf->data = 0;
+    mf->length = 0;
+}
@@ -0,0 +1,33 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Image files are mapped, not read, so the decoders see the page cache
+// directly with no copy. Every reader goes through here, and so does the
+// size limit.
+
+// very arbitrary limit, for files and data: commands
+#define MAX_INPUT_MB 500
+
+struct Mapped_File {
+    const unsigned char* data;
+    size_t length;
+    struct Prefetch* prefetch; // the bytes came from prefetch.c instead
+    bool copied; // read into memory, not mapped
+};
+
+// Map the whole file read-only, and ask the kernel to start reading it
+// ahead. If it was prefetched, use those bytes instead.
+// Prints an error and returns -1 on failure.
+int mapped_file_open(struct Mapped_File* mf, const char* filename);
+
+void mapped_file_close(struct Mapped_File* mf);
+
+// watch: names its file here (0 to stop). It may be rewritten in place
+// while it's decoded, and a mapping of a file truncated under it raises
+// SIGBUS, so that one file is read into memory instead of mapped.
+void mapped_file_read_instead(const char* filename);
+
+#endif
@@ -0,0 +1,174 @@
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "mem_stats.h"
+#include "util.h"
+
+// Per thread, since a preload can be decoding on the worker thread while
+// the main thread decodes another image.
+
+// Tracked heap, in bytes.
+static __thread size_t Tracked_Live = 0;
+static __thread size_t Tracked_Begin = 0;
+static __thread size_t Tracked_Peak = 0;
+
+// Resident set size, in bytes.
+static __thread size_t Rss_Begin = 0;
+static __thread size_t Rss_Peak = 0;
+static __thread bool Hwm_Was_Reset = false;
+
+// VmHWM is process wide, and resetting it on one thread would spoil the
+// other's measurement, so only the main thread resets or reads it. The
+// process hwm is the largest either thread has seen.
+static size_t Process_Hwm = 0;
+
+// Each tracked block is prefixed with its size, keeping malloc alignment.
+union Mem_Header {
+    size_t size;
+    max_align_t align;
+};
+
+// Read VmRSS and VmHWM from /proc/self/status.
+static int read_rss(size_t* rss, size_t* hwm)
+{
+    FILE* f = fopen("/proc/self/status", "r");
+    if (f == 0) return -1;
+
+    char line[128];
+    unsigned long kb;
+    *rss = 0;
+    *hwm = 0;
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "VmRSS: %lu kB", &kb) == 1) *rss = (size_t)kb << 10;
+        else if (sscanf(line, "VmHWM: %lu kB", &kb) == 1) *hwm = (size_t)kb << 10;
+    }
+    fclose(f);
+    return 0;
+}
+
+// Reset VmHWM to the current RSS. Linux >= 4.0.
+static bool reset_hwm()
+{
+    int fd = open("/proc/self/clear_refs", O_WRONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    bool ok = write(fd, "5", 1) == 1;
+    close(fd);
+    return ok;
+}
+
+static bool is_main_thread()
+{
+    return syscall(SYS_gettid) == getpid();
+}
+
+static void update_process_hwm(size_t rss)
+{
+    size_t old = __atomic_load_n(&Process_Hwm, __ATOMIC_RELAXED);
+    while (rss > old && !__atomic_compare_exchange_n(&Process_Hwm, &old, rss,
+            true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+// RSS, and on the main thread VmHWM, or 0.
+static int sample_rss(size_t* rss, size_t* hwm)
+{
+    if (read_rss(rss, hwm)) return -1;
+    if (!is_main_thread()) *hwm = 0;
+    update_process_hwm(*rss);
+    update_process_hwm(*hwm);
+    return 0;
+}
+
+void mem_stats_begin()
+{
+    Tracked_Begin = Tracked_Live;
+    Tracked_Peak = Tracked_Live;
+
+    if (!Verbose) return;
+
+    size_t rss, hwm;
+    if (sample_rss(&rss, &hwm)) return;
+
+    Hwm_Was_Reset = is_main_thread() && reset_hwm();
+    Rss_Begin = rss;
+    Rss_Peak = rss;
+}
+
+void mem_stats_sample()
+{
+    if (!Verbose) return;
+
+    size_t rss, hwm;
+    if (sample_rss(&rss, &hwm)) return;
+
+    if (rss > Rss_Peak) Rss_Peak = rss;
+    if (Hwm_Was_Reset && hwm > Rss_Peak) Rss_Peak = hwm;
+}
+
+void mem_stats_report(FILE* out)
+{
+    mem_stats_sample();
+
+    // Tracked bytes already held when the image began: decoder buffers and
+    // resize tables kept from earlier images of the same size, or the file
+    // read in for this one. The image uses them, so they count in its peak
+    // even though neither the tracked count nor RSS grows for them.
+    size_t cached = Tracked_Begin;
+    size_t tracked = Tracked_Peak;
+    size_t peak = Rss_Peak > Rss_Begin ? Rss_Peak - Rss_Begin : 0;
+    peak += cached;
+    if (tracked > peak) peak = tracked;
+
+    fprintf(out, "  memory  %.1f MB peak (tracked %.1f MB, %.1f MB cached), "
+        "process hwm %.1f MB\n",
+        peak / 1048576.0, tracked / 1048576.0, cached / 1048576.0,
+        __atomic_load_n(&Process_Hwm, __ATOMIC_RELAXED) / 1048576.0);
+}
+
+void* mem_malloc(size_t size)
+{
+    union Mem_Header* h = malloc(sizeof(union Mem_Header) + size);
+    if (h == 0) return 0;
+
+    h->size = size;
+    Tracked_Live += size;
+    if (Tracked_Live > Tracked_Peak) Tracked_Peak = Tracked_Live;
+    return h + 1;
+}
+
+void* mem_calloc(size_t count, size_t size)
+{
+    if (size && count > SIZE_MAX / size) return 0;
+    void* ptr = mem_malloc(count * size);
+    if (ptr) memset(ptr, 0, count * size);
+    return ptr;
+}
+
+void* mem_realloc(void* ptr, size_t size)
+{
+    if (ptr == 0) return mem_malloc(size);
+
+    union Mem_Header* h = (union Mem_Header*)ptr - 1;
+    size_t old_size = h->size;
+    h = realloc(h, sizeof(union Mem_Header) + size);
+    if (h == 0) return 0;
+
+    h->size = size;
+    Tracked_Live += size - old_size;
+    if (Tracked_Live > Tracked_Peak) Tracked_Peak = Tracked_Live;
+    return h + 1;
+}
+
+void mem_free(void* ptr)
+{
+    if (ptr == 0) return;
+
+    union Mem_Header* h = (union Mem_Header*)ptr - 1;
+    Tracked_Live -= h->size;
+    free(h);
+}
@@ -0,0 +1,36 @@
+#ifndef MEM_STATS_H
+#define MEM_STATS_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+// Per-image memory accounting.
+//
+// Two sources of information:
+//  1) Tracked heap: allocations we make ourselves (temp pixel buffers,
+//     libspng, stb_image_resize2) go through mem_malloc() and friends,
+//     which count live bytes and remember the peak.
+//  2) RSS: libturbojpeg and libheif allocate internally, so we sample the
+//     process resident set size around their calls. If the kernel lets us
+//     reset VmHWM, the high-water mark gives the exact peak.
+//
+// RSS sampling reads /proc/self/status, so it only happens with --verbose.
+
+// Reset the per-image counters. Call at the start of each image.
+void mem_stats_begin();
+
+// Sample RSS now, e.g. right after a library decode call returns and
+// before its buffers are freed.
+void mem_stats_sample();
+
+// Print the peak attributable to the current image, including tracked
+// buffers kept from earlier images that it reused, and the process HWM.
+void mem_stats_report(FILE* out);
+
+// Tracked heap allocation. Same semantics as malloc(), etc.
+void* mem_malloc(size_t size);
+void* mem_calloc(size_t count, size_t size);
+void* mem_realloc(void* ptr, size_t size);
+void mem_free(void* ptr);
+
+#endif
@@ -0,0 +1,262 @@
+#include <errno.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "display.h"
+#include "frame_buffer.h"
+#include "mjpeg.h"
+#include "read_jpeg.h"
+#include "util.h"
+
+// Read this much at a time.
+#define READ_SIZE (256 << 10)
+
+// Give up on a frame this big, it's probably garbage.
+#define MAX_FRAME_SIZE (64 << 20)
+
+struct Stream_Buffer {
+    uint8_t* data;
+    size_t len;
+    size_t cap;
+};
+
+// Finds whole jpegs in the stream, picking up where it left off each time
+// more bytes arrive.
+enum Parser_State {
+    SEEK_SOI, // looking for the start of a jpeg, skipping anything else
+    SEGMENTS, // marker segments, with lengths
+    SCAN      // entropy coded data, ends at the next marker
+};
+
+struct Mjpeg_Parser {
+    enum Parser_State state;
+    size_t frame_start; // SOI of the current frame
+    size_t pos;         // next byte to look at
+};
+
+static void start_frame(struct Mjpeg_Parser* p, size_t i)
+{
+    p->state = SEGMENTS;
+    p->frame_start = i;
+    p->pos = i + 2;
+}
+
+// Advance through buf. Returns true when a whole jpeg is at [*start, *end).
+static bool parse_frame(struct Mjpeg_Parser* p, const uint8_t* buf, size_t len,
+    size_t* start, size_t* end)
+{
+    while (p->pos < len) {
+        size_t i = p->pos;
+
+        if (p->state == SEEK_SOI || p->state == SCAN) {
+            const uint8_t* ff = memchr(buf + i, 0xff, len - i);
+            if (ff == 0) {
+                p->pos = len;
+                return false;
+            }
+            i = ff - buf;
+        }
+        if (i + 1 >= len) {
+            // need the byte after 0xff
+            p->pos = i;
+            return false;
+        }
+        if (buf[i] != 0xff) {
+            // not a marker where one should be, corrupt frame
+            p->state = SEEK_SOI;
+            p->pos = i + 1;
+            continue;
+        }
+
+        uint8_t m = buf[i + 1];
+        if (m == 0xd8) {
+            // SOI, a new frame (maybe after a truncated one)
+            start_frame(p, i);
+            continue;
+        }
+        if (p->state == SEEK_SOI || m == 0xff) {
+            // not SOI, or fill byte
+            p->pos = i + 1;
+            continue;
+        }
+        if (m == 0xd9) {
+            // EOI
+            *start = p->frame_start;
+            *end = i + 2;
+            p->state = SEEK_SOI;
+            p->pos = i + 2;
+            return true;
+        }
+        if (m == 0x00 || (m >= 0xd0 && m <= 0xd7) || m == 0x01) {
+            // stuffed zero, restart marker, TEM: no length
+            p->pos = i + 2;
+            continue;
+        }
+
+        // A marker segment: DQT, SOF, DHT, SOS, APPn...
+        // Progressive jpegs have several scans, so SCAN comes back here.
+        if (i + 4 > len) {
+            p->state = SEGMENTS;
+            p->pos = i;
+            return false;
+        }
+        size_t seg_len = buf[i + 2] << 8 | buf[i + 3];
+        p->pos = i + 2 + seg_len;
+        p->state = m == 0xda ? SCAN : SEGMENTS;
+    }
+    return false;
+}
+
+// Bytes before this are no longer needed.
+static size_t parser_keep_from(const struct Mjpeg_Parser* p, size_t len)
+{
+    if (p->state != SEEK_SOI) return p->frame_start;
+    return p->pos < len ? p->pos : len;
+}
+
+static void buffer_consume(struct Stream_Buffer* b, struct Mjpeg_Parser* p,
+    size_t n)
+{
+    if (n == 0) return;
+    memmove(b->data, b->data + n, b->len - n);
+    b->len -= n;
+    p->pos -= n;
+    p->frame_start = p->frame_start > n ? p->frame_start - n : 0;
+}
+
+static int buffer_reserve(struct Stream_Buffer* b, size_t room)
+{
+    if (b->cap - b->len >= room) return 0;
+
+    size_t cap = b->cap ? b->cap : READ_SIZE;
+    while (cap - b->len < room) cap *= 2;
+
+    uint8_t* data = realloc(b->data, cap);
+    if (data == 0) {
+        fprintf(File_Error, "Error: Out of memory at line %i.\n", __LINE__);
+        return -1;
+    }
+    b->data = data;
+    b->cap = cap;
+    return 0;
+}
+
+// One read(). Returns bytes read, 0 at end of stream, -1 on error.
+static ssize_t read_some(int fd, struct Stream_Buffer* b)
+{
+    if (buffer_reserve(b, READ_SIZE)) return -1;
+
+    ssize_t n = read(fd, b->data + b->len, READ_SIZE);
+    if (n > 0) b->len += n;
+    return n;
+}
+
+int mjpeg_play(const char* name, struct Line_Reader* in)
+{
+    // Regular files play every frame. Anything else is live.
+    struct stat st;
+    bool live = fstat(in->fd, &st) || !S_ISREG(st.st_mode);
+
+    struct Jpeg_Decoder* dec = jpeg_decoder_create();
+    if (dec == 0) return 0;
+
+    struct Stream_Buffer buf = { 0 };
+    struct Mjpeg_Parser parser = { SEEK_SOI, 0, 0 };
+    bool eof = false;
+
+    int shown = 0;
+    int dropped = 0;
+    int bad = 0;
+    double t0 = time_f();
+
+    // what the command reader already read past the command line
+    if (buffer_reserve(&buf, sizeof(in->buf))) eof = true;
+    else buf.len = line_reader_take(in, buf.data, buf.cap);
+
+    while (!Quit) {
+        // Live streams: everything that arrived while we were busy.
+        if (live && !eof) {
+            struct pollfd pfd = { .fd = in->fd, .events = POLLIN };
+            while (buf.len < MAX_FRAME_SIZE && poll(&pfd, 1, 0) > 0) {
+                ssize_t n = read_some(in->fd, &buf);
+                if (n <= 0) {
+                    if (n < 0 && errno == EINTR) break;
+                    eof = true;
+                    break;
+                }
+            }
+        }
+
+        // Newest complete frame. Live streams drop the older ones.
+        size_t start, end;
+        bool have_frame = false;
+        size_t frame_start = 0, frame_end = 0;
+        while (parse_frame(&parser, buf.data, buf.len, &start, &end)) {
+            if (have_frame) dropped++;
+            have_frame = true;
+            frame_start = start;
+            frame_end = end;
+            if (!live) break;
+        }
+
+        if (!have_frame) {
+            buffer_consume(&buf, &parser, parser_keep_from(&parser, buf.len));
+            if (eof) break;
+
+            if (buf.len >= MAX_FRAME_SIZE) {
+                fprintf(File_Error, "Error: %s: Frame over %i MB, skipping.\n",
+                        name, MAX_FRAME_SIZE >> 20);
+                buffer_consume(&buf, &parser, buf.len);
+                parser.state = SEEK_SOI;
+                parser.pos = 0;
+                bad++;
+            }
+
+            // wait for more
+            ssize_t n = read_some(in->fd, &buf);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) eof = true;
+            continue;
+        }
+
+        // Decode the frame in place, and put it up.
+        buffer_consume(&buf, &parser, frame_start);
+        frame_end -= frame_start;
+
+        if (display_wait_idle()) {
+            shown = -1;
+            break;
+        }
+        struct Frame_Buffer* fb = display_back_buffer(true);
+        if (jpeg_decoder_decode(dec, name, buf.data, frame_end, fb)) {
+            bad++;
+        }
+        else {
+            if (display_present()) {
+                shown = -1;
+                break;
+            }
+            shown++;
+        }
+        buffer_consume(&buf, &parser, frame_end);
+    }
+
+    if (Verbose && shown >= 0) {
+        double secs = time_f() - t0;
+        fprintf(File_Info, "\nMJPEG %s\n", name);
+        fprintf(File_Info, "  frames  %i shown, %i dropped, %i bad\n",
+            shown, dropped, bad);
+        fprintf(File_Info, "  rate    %5.1f fps\n",
+            secs > 0 ? shown / secs : 0.0);
+    }
+
+    free(buf.data);
+    jpeg_decoder_destroy(dec);
+    return shown;
+}
@@ -0,0 +1,21 @@
+#ifndef MJPEG_H
+#define MJPEG_H
+
+#include "line_reader.h"
+
+// mjpeg:- and mjpeg:path
+//
+// Play a stream of jpegs, either multipart/x-mixed-replace (what IP cameras
+// serve over http) or plain concatenated jpegs. Frames are found by walking
+// the jpeg markers, so multipart headers and boundaries are simply skipped.
+//
+// From a pipe or socket, each refresh shows the newest complete frame, and
+// frames that arrived while the previous one was decoding are dropped.
+// From a regular file, every frame is shown, at most one per refresh.
+
+// Play frames from in until the end of the stream or ctrl-c. Bytes the
+// line reader has already buffered are the start of the stream.
+// Returns the number of frames shown, or -1 on a display error.
+int mjpeg_play(const char* name, struct Line_Reader* in);
+
+#endif
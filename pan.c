@@ -0,0 +1,198 @@
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "display.h"
+#include "frame_buffer.h"
+#include "util.h"
+#include "pan.h"
+
+// The pan buffer is at most this many screens of pixels. The driver would
+// take more, but the Pi's CMA memory wouldn't.
+#define MAX_SCREENS 4
+
+// A rectangle of image pixels, for the ones in between.
+struct Pan_Rect {
+    double x;
+    double y;
+    double w;
+    double h;
+};
+
+// The image pixels in box, drawn into fb at kx, ky buffer pixels per image
+// pixel.
+struct Pan_Buffer {
+    struct Image_Rect box;
+    struct Frame_Buffer* fb;
+    double kx;
+    double ky;
+};
+
+// Grow r around its center to the screen's aspect ratio, so the plane
+// doesn't stretch it.
+static struct Pan_Rect screen_aspect(const struct Image_Rect* r,
+    uint32_t screen_w, uint32_t screen_h)
+{
+    struct Pan_Rect p = { r->x, r->y, r->w, r->h };
+    if ((int64_t)r->w * screen_h > (int64_t)r->h * screen_w) {
+        p.h = (double)r->w * screen_h / screen_w;
+        p.y -= (p.h - r->h) / 2;
+    }
+    else {
+        p.w = (double)r->h * screen_w / screen_h;
+        p.x -= (p.w - r->w) / 2;
+    }
+    return p;
+}
+
+// Starts and stops gently.
+static double ease(double t)
+{
+    return t * t * (3 - 2 * t);
+}
+
+// r in buf, as the plane's 16.16 SRC rectangle.
+static struct Plane_Src plane_src(const struct Pan_Buffer* buf,
+    const struct Pan_Rect* r)
+{
+    double x = (r->x - buf->box.x) * buf->kx;
+    double y = (r->y - buf->box.y) * buf->ky;
+    double w = r->w * buf->kx;
+    double h = r->h * buf->ky;
+
+    // rounding can put it a hair outside the buffer
+    if (w > buf->fb->width) w = buf->fb->width;
+    if (h > buf->fb->height) h = buf->fb->height;
+    if (x < 0) x = 0;
+    if (y < 0) y = 0;
+    if (x + w > buf->fb->width) x = buf->fb->width - w;
+    if (y + h > buf->fb->height) y = buf->fb->height - h;
+
+    struct Plane_Src src = {
+        x * 65536, y * 65536, w * 65536, h * 65536
+    };
+    return src;
+}
+
+// Make a buffer for box at k buffer pixels per image pixel, and ask the
+// driver whether the plane can scale a and b from it to the screen. Every
+// rect in between scales by something in between.
+static int make_buffer(struct Pan_Buffer* buf, double k,
+    const struct Pan_Rect* a, const struct Pan_Rect* b)
+{
+    uint32_t w = buf->box.w * k;
+    uint32_t h = buf->box.h * k;
+    if (w < 1) w = 1;
+    if (h < 1) h = 1;
+
+    buf->fb = display_create_buffer(w, h);
+    if (buf->fb == 0) return -1;
+    buf->kx = (double)w / buf->box.w;
+    buf->ky = (double)h / buf->box.h;
+
+    struct Plane_Src src_a = plane_src(buf, a);
+    struct Plane_Src src_b = plane_src(buf, b);
+    bool ok = display_show_src(buf->fb, &src_a, true) == 0 &&
+              display_show_src(buf->fb, &src_b, true) == 0;
+
+    if (Verbose) {
+        fprintf(File_Info, "  pan    %u x %u  %s\n", w, h,
+            ok ? "ok" : "not supported");
+    }
+
+    if (!ok) {
+        frame_buffer_destroy(buf->fb);
+        buf->fb = 0;
+        return -1;
+    }
+    return 0;
+}
+
+int pan_play(Region_Reader* reader, const char* filename, double secs,
+    const struct Image_Rect* from, const struct Image_Rect* to)
+{
+    uint32_t screen_w, screen_h, max_w, max_h;
+    display_sizes(&screen_w, &screen_h, &max_w, &max_h);
+
+    struct Pan_Rect a = screen_aspect(from, screen_w, screen_h);
+    struct Pan_Rect b = screen_aspect(to, screen_w, screen_h);
+
+    // Every rect in between is inside the box around both. Parts of it
+    // outside the image are bgcolor.
+    struct Pan_Buffer buf;
+    buf.box.x = floor(fmin(a.x, b.x));
+    buf.box.y = floor(fmin(a.y, b.y));
+    buf.box.w = ceil(fmax(a.x + a.w, b.x + b.w)) - buf.box.x;
+    buf.box.h = ceil(fmax(a.y + a.h, b.y + b.h)) - buf.box.y;
+    buf.fb = 0;
+
+    // The closer rect fills the screen at full resolution, unless the
+    // image has fewer pixels than that; the plane scales them up for free.
+    double k = fmin(1.0, screen_w / fmin(a.w, b.w));
+
+    // within what the driver and memory allow
+    k = fmin(k, (double)max_w / buf.box.w);
+    k = fmin(k, (double)max_h / buf.box.h);
+    double max_pixels = (double)MAX_SCREENS * screen_w * screen_h;
+    if (k * k * buf.box.w * buf.box.h > max_pixels) {
+        k = sqrt(max_pixels / buf.box.w / buf.box.h);
+    }
+
+    // Not every plane can scale down much. Failing that, the farther rect
+    // fills the screen 1:1 and the closer one is scaled up.
+    double k_down = fmin(k, screen_w / fmax(a.w, b.w));
+    if (make_buffer(&buf, k, &a, &b) &&
+        (k_down >= k || make_buffer(&buf, k_down, &a, &b))) {
+        fprintf(File_Error, "Warning: Display can't pan %s, "
+                "showing the end.\n", filename);
+    }
+
+    // The end, drawn once, as it should look after the pan. It replaces
+    // the pan buffer on the screen when it's done.
+    struct Image_Rect end = {
+        round(b.x), round(b.y), round(b.w), round(b.h)
+    };
+    if (end.w < 1) end.w = 1;
+    if (end.h < 1) end.h = 1;
+    if (reader(filename, &end, display_back_buffer(false)) ||
+        (buf.fb && reader(filename, &buf.box, buf.fb))) {
+        if (buf.fb) frame_buffer_destroy(buf.fb);
+        return 0;
+    }
+
+    uint32_t seq0, seq1;
+    double t;
+    display_last_flip(&seq0, &t);
+
+    int ret = 1;
+    double t0 = time_f();
+    while (buf.fb && !Quit) {
+        double p = secs > 0 ? (time_f() - t0) / secs : 1;
+        if (p >= 1) break;
+
+        double e = ease(p);
+        struct Pan_Rect r = {
+            a.x + (b.x - a.x) * e, a.y + (b.y - a.y) * e,
+            a.w + (b.w - a.w) * e, a.h + (b.h - a.h) * e
+        };
+        struct Plane_Src src = plane_src(&buf, &r);
+
+        // waits for the vblank
+        if (display_show_src(buf.fb, &src, false)) {
+            ret = -1;
+            break;
+        }
+    }
+
+    if (Verbose && buf.fb) {
+        display_last_flip(&seq1, &t);
+        fprintf(File_Info, "  pan    %u frames in %.2f sec\n", seq1 - seq0,
+            time_f() - t0);
+    }
+
+    // the buffer can go once it's off the screen
+    if (ret > 0 && display_present()) ret = -1;
+    display_wait_idle();
+    if (buf.fb) frame_buffer_destroy(buf.fb);
+    return ret;
+}
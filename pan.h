@@ -0,0 +1,22 @@
+#ifndef PAN_H
+#define PAN_H
+
+#include "region.h"
+
+// pan:file:secs:x,y,w,h:x,y,w,h
+//
+// Ken Burns: move smoothly from one rectangle of an image to another. The
+// image is drawn once, into a frame buffer bigger than the screen that
+// holds both rectangles, and then the display hardware does the rest:
+// each frame is one atomic commit that moves the primary plane's SRC
+// rectangle, and the plane scales it to the screen. The CPU does nothing
+// per frame but wait for the vblank.
+
+// Pan over filename (read with reader) from rect from to rect to in secs
+// seconds, easing in and out, and leave to on the screen in FB1.
+// Returns 1 if it was shown, 0 if the image couldn't be read, or -1 on a
+// display error.
+int pan_play(Region_Reader* reader, const char* filename, double secs,
+    const struct Image_Rect* from, const struct Image_Rect* to);
+
+#endif
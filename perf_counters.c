@@ -0,0 +1,135 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <linux/perf_event.h>
+
+#include "perf_counters.h"
+#include "util.h"
+
+struct Perf_Counter {
+    const char* name;
+    uint32_t type;
+    uint64_t config;
+    int fd;
+};
+
+enum {
+    CNT_CYCLES,
+    CNT_INSTRUCTIONS,
+    CNT_CACHE_MISSES,
+    CNT_PAGE_FAULTS,
+    NUM_COUNTERS
+};
+
+static struct Perf_Counter Counters[NUM_COUNTERS] = {
+    { "cycles",       PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES,   -1 },
+    { "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, -1 },
+    { "cache-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, -1 },
+    { "page-faults",  PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS,  -1 }
+};
+
+static const char* Stage_Names[PERF_NUM_STAGES] = {
+    "decode", "resize", "border", "copy"
+};
+
+// The counters only count the thread that opened them, so stages running on
+// other threads (preloads) aren't sampled.
+static __thread bool Enabled = false;
+
+static uint64_t Stage_Start[NUM_COUNTERS];
+static uint64_t Stage_Total[PERF_NUM_STAGES][NUM_COUNTERS];
+static bool Stage_Used[PERF_NUM_STAGES];
+
+static int open_counter(struct Perf_Counter* cnt, bool exclude_kernel)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = cnt->type;
+    attr.config = cnt->config;
+    attr.exclude_kernel = exclude_kernel;
+    attr.exclude_hv = 1;
+
+    // this thread, any cpu
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+}
+
+int perf_counters_open()
+{
+    int i;
+    for (i = 0; i < NUM_COUNTERS; i++) {
+        struct Perf_Counter* cnt = &Counters[i];
+        cnt->fd = open_counter(cnt, false);
+        if (cnt->fd < 0 && (errno == EACCES || errno == EPERM)) {
+            // perf_event_paranoid >= 2 allows user space only
+            cnt->fd = open_counter(cnt, true);
+        }
+        if (cnt->fd < 0) {
+            fprintf(File_Error, "Error: perf_event_open(%s): %s\n",
+                    cnt->name, strerror(errno));
+        }
+    }
+
+    Enabled = Counters[CNT_CYCLES].fd >= 0;
+    return Enabled ? 0 : -1;
+}
+
+static uint64_t read_counter(struct Perf_Counter* cnt)
+{
+    uint64_t value = 0;
+    if (cnt->fd >= 0) {
+        if (read(cnt->fd, &value, sizeof(value)) != sizeof(value)) value = 0;
+    }
+    return value;
+}
+
+void perf_stage_begin(enum Perf_Stage stage)
+{
+    if (!Enabled) return;
+
+    int i;
+    for (i = 0; i < NUM_COUNTERS; i++) {
+        Stage_Start[i] = read_counter(&Counters[i]);
+    }
+}
+
+void perf_stage_end(enum Perf_Stage stage)
+{
+    if (!Enabled) return;
+
+    int i;
+    for (i = 0; i < NUM_COUNTERS; i++) {
+        Stage_Total[stage][i] += read_counter(&Counters[i]) - Stage_Start[i];
+    }
+    Stage_Used[stage] = true;
+}
+
+void perf_counters_report(FILE* out)
+{
+    if (!Enabled) return;
+
+    int s;
+    for (s = 0; s < PERF_NUM_STAGES; s++) {
+        if (!Stage_Used[s]) continue;
+
+        uint64_t* total = Stage_Total[s];
+        double cycles = total[CNT_CYCLES];
+        double instr = total[CNT_INSTRUCTIONS];
+        double misses = total[CNT_CACHE_MISSES];
+
+        fprintf(out, "  perf %-6s %8.1fM cyc  %8.1fM ins  %4.2f ipc"
+                "  %7.1fk miss  %5.1f miss/kins  %6llu faults\n",
+            Stage_Names[s], cycles * 1e-6, instr * 1e-6,
+            cycles > 0 ? instr / cycles : 0.0,
+            misses * 1e-3,
+            instr > 0 ? misses * 1e3 / instr : 0.0,
+            (unsigned long long)total[CNT_PAGE_FAULTS]);
+
+        memset(total, 0, sizeof(Stage_Total[s]));
+        Stage_Used[s] = false;
+    }
+}
@@ -0,0 +1,34 @@
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+#include <stdbool.h>
+#include <stdio.h>
+
+// Hardware performance counters around each stage of the image pipeline.
+// Command line flag: --perf-counters
+//
+// Tells us whether a stage is compute-bound (high IPC) or memory-bound
+// (low IPC, many cache misses), e.g. resizing into uncached frame buffer
+// memory on ARM boards.
+
+enum Perf_Stage {
+    PERF_DECODE,
+    PERF_RESIZE,
+    PERF_BORDER,
+    PERF_COPY,
+    PERF_NUM_STAGES
+};
+
+// Open the counters. Returns 0 if at least the cycle counter works.
+// Until this succeeds, the other functions do nothing.
+int perf_counters_open();
+
+// Bracket one stage. Stages don't nest. Calling the same stage more than
+// once per image adds up.
+void perf_stage_begin(enum Perf_Stage stage);
+void perf_stage_end(enum Perf_Stage stage);
+
+// Print the counts for each stage used since the last report, then reset.
+void perf_counters_report(FILE* out);
+
+#endif
@@ -0,0 +1,147 @@
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "playlist.h"
+#include "util.h"
+
+// Split "photo.jpg 10" into command and duration. Returns false for blank
+// lines and comments.
+static bool parse_line(char* line, double default_duration,
+    struct Playlist_Entry* entry)
+{
+    // trim
+    while (isspace((unsigned char)*line)) line++;
+    char* end = line + strlen(line);
+    while (end > line && isspace((unsigned char)end[-1])) end--;
+    *end = 0;
+
+    if (*line == 0 || *line == '#') return false;
+
+    entry->duration = default_duration;
+
+    // a trailing number is the duration
+    char* sp = end;
+    while (sp > line && !isspace((unsigned char)sp[-1])) sp--;
+    if (sp > line) {
+        char* num_end;
+        double secs = strtod(sp, &num_end);
+        if (num_end == end && secs >= 0) {
+            entry->duration = secs;
+            end = sp;
+            while (end > line && isspace((unsigned char)end[-1])) end--;
+            *end = 0;
+        }
+    }
+
+    entry->command = strdup(line);
+    return true;
+}
+
+struct Playlist* playlist_load(const char* path, double default_duration)
+{
+    FILE* f = fopen(path, "r");
+    if (f == 0) {
+        fprintf(File_Error, "Error: Can't open playlist %s: %s\n", path,
+                strerror(errno));
+        return 0;
+    }
+
+    struct Playlist* pl = calloc(1, sizeof(struct Playlist));
+    if (pl == 0) {
+        fprintf(File_Error, "Error: Out of memory at line %i.\n", __LINE__);
+        fclose(f);
+        return 0;
+    }
+
+    int capacity = 0;
+    char line[1024];
+    while (fgets(line, sizeof(line), f)) {
+        struct Playlist_Entry entry;
+        if (!parse_line(line, default_duration, &entry)) continue;
+
+        if (pl->num_entries == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            struct Playlist_Entry* p = realloc(pl->entries,
+                capacity * sizeof(struct Playlist_Entry));
+            if (p == 0) {
+                fprintf(File_Error, "Error: Out of memory at line %i.\n",
+                        __LINE__);
+                free(entry.command);
+                fclose(f);
+                playlist_free(pl);
+                return 0;
+            }
+            pl->entries = p;
+        }
+        pl->entries[pl->num_entries++] = entry;
+    }
+    fclose(f);
+
+    if (pl->num_entries == 0) {
+        fprintf(File_Error, "Error: Playlist %s is empty.\n", path);
+        playlist_free(pl);
+        return 0;
+    }
+
+    pl->order[0] = malloc(pl->num_entries * sizeof(int));
+    pl->order[1] = malloc(pl->num_entries * sizeof(int));
+    if (pl->order[0] == 0 || pl->order[1] == 0) {
+        fprintf(File_Error, "Error: Out of memory at line %i.\n", __LINE__);
+        playlist_free(pl);
+        return 0;
+    }
+    pl->order_pass[0] = -1;
+    pl->order_pass[1] = -1;
+
+    srandom(time(0) ^ getpid());
+    return pl;
+}
+
+void playlist_free(struct Playlist* pl)
+{
+    int i;
+    for (i = 0; i < pl->num_entries; i++) {
+        free(pl->entries[i].command);
+    }
+    free(pl->entries);
+    free(pl->order[0]);
+    free(pl->order[1]);
+    free(pl);
+}
+
+// Fill in the play order for one pass through the list.
+static void make_order(struct Playlist* pl, int* order)
+{
+    int n = pl->num_entries;
+    int i;
+    for (i = 0; i < n; i++) {
+        order[i] = i;
+    }
+    if (!pl->shuffle) return;
+
+    // Fisher-Yates
+    for (i = n - 1; i > 0; i--) {
+        int j = random() % (i + 1);
+        int x = order[i];
+        order[i] = order[j];
+        order[j] = x;
+    }
+}
+
+struct Playlist_Entry* playlist_at(struct Playlist* pl, long pos)
+{
+    long pass = pos / pl->num_entries;
+    if (pass > 0 && !pl->loop) return 0;
+
+    int k = pass % 2;
+    if (pl->order_pass[k] != pass) {
+        make_order(pl, pl->order[k]);
+        pl->order_pass[k] = pass;
+    }
+    return &pl->entries[pl->order[k][pos % pl->num_entries]];
+}
@@ -0,0 +1,49 @@
+#ifndef PLAYLIST_H
+#define PLAYLIST_H
+
+#include <stdbool.h>
+
+// --playlist=file
+//
+// One entry per line: an image (or any other command), then how many
+// seconds to show it. Entries without a duration get --duration.
+//
+//   beach.jpg 10
+//   png:chart.png 30
+//   black 2
+//   sunset.jpg
+//
+// Blank lines and lines starting with # are skipped. A number at the end
+// of a line is always the duration. Relative paths are relative to the
+// current directory, not the playlist's.
+
+struct Playlist_Entry {
+    char* command;
+    double duration;
+};
+
+struct Playlist {
+    int num_entries;
+    struct Playlist_Entry* entries;
+
+    bool loop;    // --loop, start over at the end
+    bool shuffle; // --shuffle, new random order each time through
+
+    // Play order for two passes through the list: the current one, and
+    // the next one, which the scheduler may already be decoding ahead into.
+    int* order[2];
+    long order_pass[2];
+};
+
+// Read a playlist file. Returns 0 on error, after printing it.
+struct Playlist* playlist_load(const char* path, double default_duration);
+
+void playlist_free(struct Playlist* pl);
+
+// The entry shown pos-th, counting from 0 across loops. Returns 0 when a
+// playlist that doesn't loop has run out.
+// Callers may look ahead up to num_entries - 1 entries past the one being
+// shown, since only two passes' shuffles are kept.
+struct Playlist_Entry* playlist_at(struct Playlist* pl, long pos);
+
+#endif
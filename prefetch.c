@@ -0,0 +1,551 @@
+#define _GNU_SOURCE // struct statx
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// io_uring through the raw syscalls, no liburing needed.
+#if !defined(NO_IO_URING) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#if defined(__NR_io_uring_setup) && defined(IORING_FEAT_RW_CUR_POS)
+#define HAVE_IO_URING 1
+#endif
+#endif
+#endif
+
+#include "mapped_file.h"
+#include "prefetch.h"
+#include "util.h"
+
+int Prefetch_Max = 0;
+
+enum Prefetch_State {
+    PF_EMPTY,
+    PF_OPENING, // open and statx in flight
+    PF_READING, // read in flight, the kernel owns buf
+    PF_READY,
+    PF_FAILED
+};
+
+// What the file looked like when it was read.
+struct File_Key {
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime_sec;
+    uint32_t mtime_nsec;
+};
+
+struct Prefetch {
+    enum Prefetch_State state;
+    char* filename;
+    struct File_Key key;
+    int fd;
+    int pending;  // open and statx completions still to come
+    bool failed;  // one of them failed
+    uint8_t* buf; // kept for the next file when the entry is reused
+    size_t cap;
+    size_t length;
+    int users;    // prefetch_claim() without prefetch_release()
+    long wanted;  // Tick of the last prefetch_files() that asked for it
+#ifdef HAVE_IO_URING
+    struct statx stx;
+#endif
+};
+
+// Also taken by preload's worker thread, through mapped_file_open().
+static pthread_mutex_t Lock = PTHREAD_MUTEX_INITIALIZER;
+static struct Prefetch Table[MAX_PREFETCH];
+static long Tick = 0;
+
+static struct Prefetch* find(const char* filename)
+{
+    int i;
+    for (i = 0; i < MAX_PREFETCH; i++) {
+        struct Prefetch* pf = &Table[i];
+        if (pf->state != PF_EMPTY && !strcmp(pf->filename, filename)) {
+            return pf;
+        }
+    }
+    return 0;
+}
+
+// An entry for a new file: an empty one, or else the least recently wanted
+// one that isn't in use. 0 if everything is busy or wanted right now.
+static struct Prefetch* make_room(int max)
+{
+    struct Prefetch* oldest = 0;
+    int i;
+    for (i = 0; i < max; i++) {
+        struct Prefetch* pf = &Table[i];
+        if (pf->state == PF_EMPTY) return pf;
+        if (pf->state != PF_READY && pf->state != PF_FAILED) continue;
+        if (pf->users > 0 || pf->wanted == Tick) continue;
+        if (oldest == 0 || pf->wanted < oldest->wanted) oldest = pf;
+    }
+    if (oldest) {
+        free(oldest->filename);
+        oldest->filename = 0;
+        oldest->state = PF_EMPTY;
+    }
+    return oldest;
+}
+
+// Check the size, and grow the entry's buffer to fit.
+static bool reserve(struct Prefetch* pf, uint64_t size)
+{
+    if (size == 0 || (size >> 20) > MAX_INPUT_MB) return false;
+
+    if (size > pf->cap) {
+        uint8_t* buf = realloc(pf->buf, size);
+        if (buf == 0) return false;
+        pf->buf = buf;
+        pf->cap = size;
+    }
+    pf->length = size;
+    return true;
+}
+
+static void fail(struct Prefetch* pf)
+{
+    if (pf->fd >= 0) close(pf->fd);
+    pf->fd = -1;
+    pf->state = PF_FAILED;
+}
+
+// Without io_uring, one file at a time.
+static void load_pread(struct Prefetch* pf)
+{
+    pf->fd = open(pf->filename, O_RDONLY | O_CLOEXEC);
+    if (pf->fd < 0) {
+        fail(pf);
+        return;
+    }
+
+    struct stat st;
+    if (fstat(pf->fd, &st) || !reserve(pf, st.st_size)) {
+        fail(pf);
+        return;
+    }
+    pf->key.ino = st.st_ino;
+    pf->key.size = st.st_size;
+    pf->key.mtime_sec = st.st_mtim.tv_sec;
+    pf->key.mtime_nsec = st.st_mtim.tv_nsec;
+
+    size_t got = 0;
+    while (got < pf->length) {
+        ssize_t n = pread(pf->fd, pf->buf + got, pf->length - got, got);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        got += n;
+    }
+    if (got < pf->length) {
+        fail(pf);
+        return;
+    }
+
+    close(pf->fd);
+    pf->fd = -1;
+    pf->state = PF_READY;
+}
+
+#ifdef HAVE_IO_URING
+
+// Room for an open and a statx per entry.
+#define RING_ENTRIES (2 * MAX_PREFETCH)
+
+// low bits of user_data, the rest is the Table index
+enum { OP_OPEN, OP_STATX, OP_READ };
+
+struct Ring {
+    int fd;
+    unsigned sq_entries;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    struct io_uring_sqe* sqes;
+    unsigned sqe_tail;  // filled in but not yet published to the kernel
+    unsigned to_submit;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_cqe* cqes;
+
+    void* sq_map;
+    size_t sq_map_size;
+    void* cq_map;
+    size_t cq_map_size;
+    size_t sqes_size;
+};
+
+static struct Ring Ring = { .fd = -1 };
+static bool Ring_Tried = false;
+
+static void ring_close()
+{
+    if (Ring.fd < 0) return;
+
+    if (Ring.sqes) munmap(Ring.sqes, Ring.sqes_size);
+    if (Ring.cq_map && Ring.cq_map != Ring.sq_map) {
+        munmap(Ring.cq_map, Ring.cq_map_size);
+    }
+    if (Ring.sq_map) munmap(Ring.sq_map, Ring.sq_map_size);
+    close(Ring.fd);
+    memset(&Ring, 0, sizeof(Ring));
+    Ring.fd = -1;
+}
+
+static int ring_open()
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+
+    int fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &p);
+    if (fd < 0) return -1;
+    Ring.fd = fd;
+
+    // OPENAT, STATX, and READ arrived in 5.6, along with this flag.
+    if (!(p.features & IORING_FEAT_RW_CUR_POS)) {
+        ring_close();
+        return -1;
+    }
+
+    Ring.sq_map_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    Ring.cq_map_size = p.cq_off.cqes +
+        p.cq_entries * sizeof(struct io_uring_cqe);
+    bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single) {
+        if (Ring.cq_map_size > Ring.sq_map_size) {
+            Ring.sq_map_size = Ring.cq_map_size;
+        }
+        Ring.cq_map_size = Ring.sq_map_size;
+    }
+
+    void* sq = mmap(0, Ring.sq_map_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED) {
+        ring_close();
+        return -1;
+    }
+    Ring.sq_map = sq;
+
+    void* cq = sq;
+    if (!single) {
+        cq = mmap(0, Ring.cq_map_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED) {
+            ring_close();
+            return -1;
+        }
+    }
+    Ring.cq_map = cq;
+
+    Ring.sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    void* sqes = mmap(0, Ring.sqes_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        Ring.sqes = 0;
+        ring_close();
+        return -1;
+    }
+    Ring.sqes = sqes;
+
+    Ring.sq_entries = p.sq_entries;
+    Ring.sq_head = (unsigned*)((char*)sq + p.sq_off.head);
+    Ring.sq_tail = (unsigned*)((char*)sq + p.sq_off.tail);
+    Ring.sq_mask = (unsigned*)((char*)sq + p.sq_off.ring_mask);
+    Ring.sq_array = (unsigned*)((char*)sq + p.sq_off.array);
+    Ring.sqe_tail = *Ring.sq_tail;
+    Ring.cq_head = (unsigned*)((char*)cq + p.cq_off.head);
+    Ring.cq_tail = (unsigned*)((char*)cq + p.cq_off.tail);
+    Ring.cq_mask = (unsigned*)((char*)cq + p.cq_off.ring_mask);
+    Ring.cqes = (struct io_uring_cqe*)((char*)cq + p.cq_off.cqes);
+    return 0;
+}
+
+static unsigned ring_space()
+{
+    unsigned head = __atomic_load_n(Ring.sq_head, __ATOMIC_ACQUIRE);
+    return Ring.sq_entries - (Ring.sqe_tail - head);
+}
+
+static struct io_uring_sqe* ring_get_sqe(int index, int op)
+{
+    unsigned i = Ring.sqe_tail & *Ring.sq_mask;
+    struct io_uring_sqe* sqe = &Ring.sqes[i];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = (uint64_t)index << 2 | op;
+    Ring.sq_array[i] = i;
+    Ring.sqe_tail++;
+    Ring.to_submit++;
+    return sqe;
+}
+
+// Submit what's queued, and wait for at least min_complete completions.
+// Returns -1 on error, 0 if interrupted (try again).
+static int ring_enter(unsigned min_complete)
+{
+    __atomic_store_n(Ring.sq_tail, Ring.sqe_tail, __ATOMIC_RELEASE);
+
+    unsigned flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+    int ret = syscall(__NR_io_uring_enter, Ring.fd, Ring.to_submit,
+        min_complete, flags, 0, 0);
+    if (ret < 0) {
+        if (errno == EINTR || errno == EAGAIN || errno == EBUSY) return 0;
+        fprintf(File_Error, "Error: io_uring_enter(): %s\n", strerror(errno));
+        return -1;
+    }
+    Ring.to_submit -= ret;
+    return 0;
+}
+
+static void complete(uint64_t user_data, int res)
+{
+    struct Prefetch* pf = &Table[user_data >> 2];
+
+    switch (user_data & 3) {
+    case OP_OPEN:
+        if (res >= 0) pf->fd = res;
+        else pf->failed = true;
+        pf->pending--;
+        break;
+    case OP_STATX:
+        if (res < 0) pf->failed = true;
+        pf->pending--;
+        break;
+    case OP_READ:
+        close(pf->fd);
+        pf->fd = -1;
+        pf->state = res == (int)pf->length ? PF_READY : PF_FAILED;
+        break;
+    }
+}
+
+static void ring_reap()
+{
+    unsigned head = *Ring.cq_head;
+    unsigned tail = __atomic_load_n(Ring.cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+        struct io_uring_cqe* cqe = &Ring.cqes[head & *Ring.cq_mask];
+        complete(cqe->user_data, cqe->res);
+        head++;
+    }
+    __atomic_store_n(Ring.cq_head, head, __ATOMIC_RELEASE);
+}
+
+static bool queue_open(struct Prefetch* pf)
+{
+    if (ring_space() < 2) return false;
+    int index = pf - Table;
+
+    struct io_uring_sqe* sqe = ring_get_sqe(index, OP_OPEN);
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uintptr_t)pf->filename;
+    sqe->open_flags = O_RDONLY | O_CLOEXEC;
+
+    sqe = ring_get_sqe(index, OP_STATX);
+    sqe->opcode = IORING_OP_STATX;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uintptr_t)pf->filename;
+    sqe->len = STATX_INO | STATX_SIZE | STATX_MTIME;
+    sqe->off = (uintptr_t)&pf->stx;
+
+    pf->state = PF_OPENING;
+    pf->pending = 2;
+    return true;
+}
+
+static void queue_read(struct Prefetch* pf)
+{
+    if (pf->failed || !reserve(pf, pf->stx.stx_size) || ring_space() < 1) {
+        fail(pf);
+        return;
+    }
+    pf->key.ino = pf->stx.stx_ino;
+    pf->key.size = pf->stx.stx_size;
+    pf->key.mtime_sec = pf->stx.stx_mtime.tv_sec;
+    pf->key.mtime_nsec = pf->stx.stx_mtime.tv_nsec;
+
+    struct io_uring_sqe* sqe = ring_get_sqe(pf - Table, OP_READ);
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = pf->fd;
+    sqe->addr = (uintptr_t)pf->buf;
+    sqe->len = pf->length;
+    sqe->off = 0;
+
+    pf->state = PF_READING;
+}
+
+static bool any_in_state(enum Prefetch_State state)
+{
+    int i;
+    for (i = 0; i < MAX_PREFETCH; i++) {
+        if (Table[i].state == state) return true;
+    }
+    return false;
+}
+
+// All the opens and stats go in as one batch. Once they're back, so do
+// all the reads, which finish in the background.
+static void ring_run_batch()
+{
+    int i;
+    while (1) {
+        bool waiting = false;
+        for (i = 0; i < MAX_PREFETCH; i++) {
+            if (Table[i].state == PF_OPENING && Table[i].pending > 0) {
+                waiting = true;
+            }
+        }
+        if (!waiting) break;
+
+        if (ring_enter(1) < 0) break;
+        ring_reap();
+    }
+
+    for (i = 0; i < MAX_PREFETCH; i++) {
+        struct Prefetch* pf = &Table[i];
+        if (pf->state != PF_OPENING) continue;
+
+        if (pf->pending > 0) fail(pf); // ring_enter() failed
+        else queue_read(pf);
+    }
+    ring_enter(0);
+}
+
+#endif // HAVE_IO_URING
+
+void prefetch_files(int num_files, const char* const filenames[])
+{
+    int max = Prefetch_Max < MAX_PREFETCH ? Prefetch_Max : MAX_PREFETCH;
+    if (max <= 0) return;
+    if (num_files > max) num_files = max;
+
+    pthread_mutex_lock(&Lock);
+
+#ifdef HAVE_IO_URING
+    if (!Ring_Tried) {
+        Ring_Tried = true;
+        if (ring_open() && Verbose) {
+            fprintf(File_Info, "Prefetch: no io_uring, using pread().\n");
+        }
+    }
+    bool queued = false;
+#endif
+
+    Tick++;
+    int i;
+    for (i = 0; i < num_files; i++) {
+        struct Prefetch* pf = find(filenames[i]);
+        if (pf && (pf->state != PF_FAILED || pf->users > 0)) {
+            pf->wanted = Tick;
+            continue;
+        }
+        if (pf == 0) {
+            pf = make_room(max);
+            if (pf == 0) break;
+            pf->filename = strdup(filenames[i]);
+            if (pf->filename == 0) break;
+        }
+        pf->wanted = Tick;
+        pf->fd = -1;
+        pf->failed = false;
+
+#ifdef HAVE_IO_URING
+        if (Ring.fd >= 0 && queue_open(pf)) {
+            queued = true;
+            continue;
+        }
+#endif
+        load_pread(pf);
+    }
+
+#ifdef HAVE_IO_URING
+    if (queued) ring_run_batch();
+#endif
+
+    pthread_mutex_unlock(&Lock);
+}
+
+struct Prefetch* prefetch_claim(const char* filename,
+    const unsigned char** data, size_t* length)
+{
+    if (Prefetch_Max <= 0) return 0;
+
+    pthread_mutex_lock(&Lock);
+
+    struct Prefetch* pf = find(filename);
+
+#ifdef HAVE_IO_URING
+    while (pf && pf->state == PF_READING) {
+        if (ring_enter(1) < 0) break;
+        ring_reap();
+    }
+#endif
+
+    if (pf && pf->state == PF_READY) {
+        // still the same file?
+        struct stat st;
+        if (stat(filename, &st) ||
+            st.st_ino != pf->key.ino ||
+            st.st_size != pf->key.size ||
+            st.st_mtim.tv_sec != pf->key.mtime_sec ||
+            st.st_mtim.tv_nsec != pf->key.mtime_nsec) {
+            pf->state = PF_FAILED; // read it again next time it's wanted
+        }
+    }
+
+    if (pf && pf->state == PF_READY) {
+        pf->users++;
+        *data = pf->buf;
+        *length = pf->length;
+    }
+    else {
+        pf = 0;
+    }
+
+    pthread_mutex_unlock(&Lock);
+    return pf;
+}
+
+void prefetch_release(struct Prefetch* pf)
+{
+    pthread_mutex_lock(&Lock);
+    pf->users--;
+    pthread_mutex_unlock(&Lock);
+}
+
+void prefetch_close()
+{
+    pthread_mutex_lock(&Lock);
+
+#ifdef HAVE_IO_URING
+    // the kernel is still writing into these buffers
+    while (Ring.fd >= 0 && any_in_state(PF_READING)) {
+        if (ring_enter(1) < 0) break;
+        ring_reap();
+    }
+    ring_close();
+#endif
+
+    int i;
+    for (i = 0; i < MAX_PREFETCH; i++) {
+        struct Prefetch* pf = &Table[i];
+        if (pf->fd >= 0 && pf->state != PF_EMPTY) close(pf->fd);
+        free(pf->filename);
+        free(pf->buf);
+        memset(pf, 0, sizeof(*pf));
+    }
+
+    pthread_mutex_unlock(&Lock);
+}
@@ -0,0 +1,46 @@
+#ifndef PREFETCH_H
+#define PREFETCH_H
+
+#include <stddef.h>
+
+// Read upcoming image files into memory ahead of time.
+//
+// Given the next few files of a playlist or of the commands waiting on
+// stdin, the opens, stats, and reads for all of them go to the kernel as
+// one io_uring batch, so a slow SD card or USB disk sees a full queue
+// instead of one read at a time. The bytes land in buffers that are kept
+// and reused, and mapped_file_open() hands them to the decoders in place
+// of mapping the file.
+//
+// Without io_uring (old kernel, seccomp, or built with -DNO_IO_URING) the
+// files are read with plain pread() instead.
+//
+// A prefetched file is only used if its inode, size, and mtime are still
+// the same when it is opened for decoding.
+
+// --prefetch=N, how many files to keep in memory. 0 is off.
+extern int Prefetch_Max;
+
+// Upper limit for --prefetch.
+#define MAX_PREFETCH 64
+
+// Start loading these files, in this order of need. Files already loaded
+// or in flight are kept. Others are dropped to make room, least recently
+// wanted first. Waits for the opens and stats, not for the reads.
+void prefetch_files(int num_files, const char* const filenames[]);
+
+struct Prefetch;
+
+// The prefetched bytes of filename, if it is loaded and hasn't changed.
+// Waits for the read if it is still in flight. Returns 0 otherwise, and
+// the caller should read the file itself.
+struct Prefetch* prefetch_claim(const char* filename,
+    const unsigned char** data, size_t* length);
+
+// Done with the bytes from prefetch_claim().
+void prefetch_release(struct Prefetch* pf);
+
+// Wait for reads in flight, and free everything.
+void prefetch_close();
+
+#endif
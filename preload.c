@@ -0,0 +1,352 @@
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/queue.h>
+#include <sys/stat.h>
+
+#include "preload.h"
+#include "probes.h"
+#include "util.h"
+
+enum Preload_State {
+    PRELOAD_QUEUED,
+    PRELOAD_DECODING,
+    PRELOAD_READY,
+    PRELOAD_FAILED
+};
+
+struct Preload {
+    STAILQ_ENTRY(Preload) pointers;
+
+    Image_Reader* reader;
+    char* filename;
+
+    // The rest of the cache key. fb's size and format is the display's.
+    struct stat st;
+    uint32_t bg_color;
+
+    struct Frame_Buffer* fb;
+
+    // Both protected by Lock.
+    enum Preload_State state;
+    bool dropped; // free it as soon as the worker is done with it
+};
+
+// Oldest first. Only the main thread adds and removes entries.
+STAILQ_HEAD(Preload_List, Preload);
+static struct Preload_List Preloads = STAILQ_HEAD_INITIALIZER(Preloads);
+
+int Preload_Max = 2;
+
+// One frame buffer kept around for the next preload. Main thread only.
+static struct Frame_Buffer* Spare_FB = 0;
+
+static pthread_t Worker;
+static bool Worker_Running = false;
+static bool Worker_Stop = false;
+
+static pthread_mutex_t Lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t Work_Cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t Done_Cond = PTHREAD_COND_INITIALIZER;
+
+static void* worker_main(void* arg)
+{
+    pthread_mutex_lock(&Lock);
+    while (!Worker_Stop) {
+        struct Preload* p;
+        STAILQ_FOREACH(p, &Preloads, pointers) {
+            if (p->state == PRELOAD_QUEUED) break;
+        }
+        if (p == 0) {
+            pthread_cond_wait(&Work_Cond, &Lock);
+            continue;
+        }
+
+        // The main thread leaves decoding entries alone.
+        p->state = PRELOAD_DECODING;
+        pthread_mutex_unlock(&Lock);
+
+        // BG_Color is per thread. Draw the borders in the color that was
+        // current when the preload was queued.
+        BG_Color = p->bg_color;
+        int err = p->reader(p->filename, p->fb);
+        PROBE_CACHE_STORE(p->filename, err);
+
+        pthread_mutex_lock(&Lock);
+        p->state = err ? PRELOAD_FAILED : PRELOAD_READY;
+        pthread_cond_broadcast(&Done_Cond);
+    }
+    pthread_mutex_unlock(&Lock);
+    return 0;
+}
+
+static int start_worker()
+{
+    if (Worker_Running) return 0;
+
+    // ctrl-c should interrupt the main thread, not the worker.
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    int err = pthread_create(&Worker, 0, worker_main, 0);
+    pthread_sigmask(SIG_SETMASK, &old, 0);
+
+    if (err) {
+        fprintf(File_Error, "Error: pthread_create(): %s\n", strerror(err));
+        return -1;
+    }
+    Worker_Running = true;
+    return 0;
+}
+
+static bool same_file(const struct stat* a, const struct stat* b)
+{
+    return a->st_dev == b->st_dev && a->st_ino == b->st_ino &&
+        a->st_size == b->st_size &&
+        a->st_mtim.tv_sec == b->st_mtim.tv_sec &&
+        a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+static bool same_format(const struct Frame_Buffer* a,
+    const struct Frame_Buffer* b)
+{
+    return a->width == b->width && a->height == b->height &&
+        a->pixel_format == b->pixel_format;
+}
+
+static struct Frame_Buffer* get_frame_buffer(const struct Frame_Buffer* like_fb)
+{
+    struct Frame_Buffer* fb = Spare_FB;
+    Spare_FB = 0;
+    if (fb && same_format(fb, like_fb)) return fb;
+    if (fb) frame_buffer_destroy(fb);
+
+    fb = frame_buffer_create(like_fb->fd_drm, like_fb->width, like_fb->height,
+            like_fb->pixel_format);
+    if (fb == 0) return 0;
+
+    if (frame_buffer_map(fb)) {
+        frame_buffer_destroy(fb);
+        return 0;
+    }
+    return fb;
+}
+
+// Remove from the list. Lock held, and not decoding.
+static void free_preload(struct Preload* p)
+{
+    STAILQ_REMOVE(&Preloads, p, Preload, pointers);
+    if (p->fb) frame_buffer_destroy(p->fb);
+    free(p->filename);
+    free(p);
+}
+
+// Free now, or mark it for freeing once the worker is done with it.
+static void drop_preload(struct Preload* p)
+{
+    PROBE_CACHE_DROP(p->filename);
+    if (p->state == PRELOAD_DECODING) {
+        p->dropped = true;
+    }
+    else {
+        free_preload(p);
+    }
+}
+
+// Free dropped entries the worker has finished with.
+static void reap_dropped()
+{
+    struct Preload* p = STAILQ_FIRST(&Preloads);
+    while (p) {
+        struct Preload* next = STAILQ_NEXT(p, pointers);
+        if (p->dropped && p->state != PRELOAD_DECODING) free_preload(p);
+        p = next;
+    }
+}
+
+static struct Preload* find_preload(const char* filename)
+{
+    struct Preload* p;
+    STAILQ_FOREACH(p, &Preloads, pointers) {
+        if (!p->dropped && !strcmp(p->filename, filename)) return p;
+    }
+    return 0;
+}
+
+// Make room for one more. Returns -1 if everything is busy decoding.
+static int make_room()
+{
+    while (1) {
+        int n = 0;
+        struct Preload* oldest_idle = 0;
+        struct Preload* p;
+        STAILQ_FOREACH(p, &Preloads, pointers) {
+            n++;
+            if (oldest_idle == 0 && !p->dropped &&
+                p->state != PRELOAD_DECODING) {
+                oldest_idle = p;
+            }
+        }
+        if (n < Preload_Max) return 0;
+        if (oldest_idle == 0) return -1;
+        drop_preload(oldest_idle);
+    }
+}
+
+int preload_start(Image_Reader* reader, const char* filename,
+    const struct Frame_Buffer* like_fb)
+{
+    struct stat st;
+    if (stat(filename, &st)) {
+        fprintf(File_Error, "Error: stat(%s): %s\n", filename, strerror(errno));
+        return -1;
+    }
+
+    if (start_worker()) return -1;
+
+    pthread_mutex_lock(&Lock);
+    reap_dropped();
+
+    int err = 0;
+    struct Preload* p = find_preload(filename);
+    if (p) {
+        if (p->reader == reader && p->bg_color == BG_Color &&
+            p->state != PRELOAD_FAILED &&
+            same_file(&p->st, &st) && same_format(p->fb, like_fb)) {
+            // already preloaded
+            goto done;
+        }
+        drop_preload(p);
+    }
+
+    if (make_room()) {
+        fprintf(File_Error, "Error: Too many preloads (--preload-max=%i): %s\n",
+                Preload_Max, filename);
+        err = -1;
+        goto done;
+    }
+
+    p = calloc(1, sizeof(struct Preload));
+    if (p == 0) {
+        fprintf(File_Error, "Error: Out of memory at line %i.\n", __LINE__);
+        err = -1;
+        goto done;
+    }
+    p->reader = reader;
+    p->filename = strdup(filename);
+    p->st = st;
+    p->bg_color = BG_Color;
+    p->fb = get_frame_buffer(like_fb);
+    p->state = PRELOAD_QUEUED;
+    if (p->filename == 0 || p->fb == 0) {
+        if (p->fb) frame_buffer_destroy(p->fb);
+        free(p->filename);
+        free(p);
+        err = -1;
+        goto done;
+    }
+
+    STAILQ_INSERT_TAIL(&Preloads, p, pointers);
+    pthread_cond_signal(&Work_Cond);
+
+done:
+    pthread_mutex_unlock(&Lock);
+    return err;
+}
+
+struct Frame_Buffer* preload_take(Image_Reader* reader, const char* filename,
+    const struct Frame_Buffer* like_fb)
+{
+    struct Frame_Buffer* fb = 0;
+
+    pthread_mutex_lock(&Lock);
+    reap_dropped();
+
+    struct Preload* p = find_preload(filename);
+    if (p) {
+        // Finish it, since the worker has a head start. One that hasn't
+        // started yet is no quicker than decoding it here.
+        if (p->state == PRELOAD_QUEUED) p->state = PRELOAD_FAILED;
+        while (p->state == PRELOAD_DECODING) {
+            pthread_cond_wait(&Done_Cond, &Lock);
+        }
+
+        struct stat st;
+        if (p->state == PRELOAD_READY && p->reader == reader &&
+            p->bg_color == BG_Color && same_format(p->fb, like_fb) &&
+            stat(filename, &st) == 0 && same_file(&p->st, &st)) {
+            fb = p->fb;
+            p->fb = 0;
+        }
+        else if (Spare_FB == 0) {
+            Spare_FB = p->fb;
+            p->fb = 0;
+        }
+        free_preload(p);
+    }
+    pthread_mutex_unlock(&Lock);
+
+    if (fb) {
+        PROBE_CACHE_HIT(filename);
+        if (Verbose) fprintf(File_Info, "\nPreloaded %s\n", filename);
+    }
+    else {
+        PROBE_CACHE_MISS(filename);
+    }
+    return fb;
+}
+
+void preload_recycle(struct Frame_Buffer* fb)
+{
+    if (Spare_FB == 0) {
+        Spare_FB = fb;
+    }
+    else {
+        frame_buffer_destroy(fb);
+    }
+}
+
+int preload_drop(const char* filename)
+{
+    pthread_mutex_lock(&Lock);
+    reap_dropped();
+
+    struct Preload* p = find_preload(filename);
+    bool found = p != 0;
+    if (found) drop_preload(p);
+    pthread_mutex_unlock(&Lock);
+
+    // memory is tight, don't keep a spare either
+    if (Spare_FB) {
+        frame_buffer_destroy(Spare_FB);
+        Spare_FB = 0;
+    }
+    return found ? 0 : -1;
+}
+
+void preload_close()
+{
+    if (Worker_Running) {
+        // Lets the current decode finish.
+        pthread_mutex_lock(&Lock);
+        Worker_Stop = true;
+        pthread_cond_signal(&Work_Cond);
+        pthread_mutex_unlock(&Lock);
+
+        pthread_join(Worker, 0);
+        Worker_Running = false;
+    }
+
+    struct Preload* p;
+    while ((p = STAILQ_FIRST(&Preloads))) {
+        free_preload(p);
+    }
+    if (Spare_FB) {
+        frame_buffer_destroy(Spare_FB);
+        Spare_FB = 0;
+    }
+}
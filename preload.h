@@ -0,0 +1,48 @@
+#ifndef PRELOAD_H
+#define PRELOAD_H
+
+#include "frame_buffer.h"
+
+// Decode images ahead of time.
+//
+// preload:file.jpg starts decoding on a worker thread into a spare frame
+// buffer the same size and format as the screen's. When a later file.jpg
+// command comes along, that buffer simply becomes the back buffer and is
+// flipped onto the screen, no decoding needed.
+//
+// An entry is only used if the file, the display's frame buffer format,
+// and bgcolor are all unchanged since the preload. Otherwise the command
+// decodes the file normally.
+
+// read_jpeg(), read_png(), read_heif()
+typedef int Image_Reader(const char* filename, struct Frame_Buffer* fb);
+
+// --preload-max=N, how many preloaded images to keep at once.
+// Each one costs a full screen frame buffer.
+extern int Preload_Max;
+
+// Queue filename for decoding into a spare buffer the same size and format
+// as like_fb.
+// If the cache is full, the oldest idle entry is dropped.
+// Returns 0 if queued (or already preloaded).
+int preload_start(Image_Reader* reader, const char* filename,
+    const struct Frame_Buffer* like_fb);
+
+// If filename was preloaded and still matches like_fb, remove it from the
+// cache and return its frame buffer. Waits if it is still being decoded.
+// Returns 0 if the caller should decode the file itself.
+struct Frame_Buffer* preload_take(Image_Reader* reader, const char* filename,
+    const struct Frame_Buffer* like_fb);
+
+// Hand back a frame buffer to reuse for the next preload, e.g. the back
+// buffer that preload_take()'s buffer replaced.
+void preload_recycle(struct Frame_Buffer* fb);
+
+// Forget a preloaded file and free its frame buffer.
+// Returns -1 if filename wasn't preloaded.
+int preload_drop(const char* filename);
+
+// Stop the worker thread and free all buffers. Call before display_close().
+void preload_close();
+
+#endif
@@ -0,0 +1,75 @@
+#ifndef PROBES_H
+#define PROBES_H
+
+// USDT static tracepoints, for bpftrace/perf/systemtap on a running frame.
+// Each probe is a single nop when nobody is tracing.
+//
+//   sudo bpftrace -l 'usdt:./console-jpeg:*'
+//   sudo bpftrace -e 'usdt:./console-jpeg:console_jpeg:decode_end
+//       { printf("%s %dx%d\n", str(arg1), arg2, arg3); }'
+//
+// Needs <sys/sdt.h> from systemtap-sdt-dev. Without it, or with -DNO_USDT,
+// the probes compile to nothing.
+
+#if !defined(NO_USDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define HAVE_USDT 1
+#endif
+#endif
+
+#ifdef HAVE_USDT
+
+#include <sys/sdt.h>
+
+// A command was received, from argv, stdin, etc.
+#define PROBE_COMMAND(cmd) \
+    DTRACE_PROBE1(console_jpeg, command, cmd)
+
+// Image decode. fmt is "jpeg", "png", or "heif". ret is 0 on success.
+#define PROBE_DECODE_START(fmt, filename) \
+    DTRACE_PROBE2(console_jpeg, decode_start, fmt, filename)
+#define PROBE_DECODE_END(fmt, filename, width, height, ret) \
+    DTRACE_PROBE5(console_jpeg, decode_end, fmt, filename, width, height, ret)
+
+// Resize from src to dst dimensions.
+#define PROBE_RESIZE_START(src_w, src_h, dst_w, dst_h) \
+    DTRACE_PROBE4(console_jpeg, resize_start, src_w, src_h, dst_w, dst_h)
+#define PROBE_RESIZE_END(src_w, src_h, dst_w, dst_h) \
+    DTRACE_PROBE4(console_jpeg, resize_end, src_w, src_h, dst_w, dst_h)
+
+// Frame buffer flip. Complete fires from the kernel's page flip event,
+// i.e. when the new image is actually on the screen.
+#define PROBE_FLIP_SUBMIT(fb_id) \
+    DTRACE_PROBE1(console_jpeg, flip_submit, fb_id)
+#define PROBE_FLIP_COMPLETE(fb_id, sequence) \
+    DTRACE_PROBE2(console_jpeg, flip_complete, fb_id, sequence)
+
+// Preload cache. Store fires when the worker thread has decoded a
+// preload: (ret is 0 on success). Hit and miss fire for each image
+// command, drop for drop: and for entries pushed out of a full cache.
+#define PROBE_CACHE_STORE(filename, ret) \
+    DTRACE_PROBE2(console_jpeg, cache_store, filename, ret)
+#define PROBE_CACHE_HIT(filename) \
+    DTRACE_PROBE1(console_jpeg, cache_hit, filename)
+#define PROBE_CACHE_MISS(filename) \
+    DTRACE_PROBE1(console_jpeg, cache_miss, filename)
+#define PROBE_CACHE_DROP(filename) \
+    DTRACE_PROBE1(console_jpeg, cache_drop, filename)
+
+#else
+
+#define PROBE_COMMAND(cmd)
+#define PROBE_DECODE_START(fmt, filename)
+#define PROBE_DECODE_END(fmt, filename, width, height, ret)
+#define PROBE_RESIZE_START(src_w, src_h, dst_w, dst_h)
+#define PROBE_RESIZE_END(src_w, src_h, dst_w, dst_h)
+#define PROBE_FLIP_SUBMIT(fb_id)
+#define PROBE_FLIP_COMPLETE(fb_id, sequence)
+#define PROBE_CACHE_STORE(filename, ret)
+#define PROBE_CACHE_HIT(filename)
+#define PROBE_CACHE_MISS(filename)
+#define PROBE_CACHE_DROP(filename)
+
+#endif // HAVE_USDT
+
+#endif
@@ -0,0 +1,561 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <setjmp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <jpeglib.h>
+
+#include "drm_search.h"
+#include "exif.h"
+#include "frame_buffer.h"
+#include "mem_stats.h"
+#include "probes.h"
+#include "region.h"
+#include "resize.h"
+#include "util.h"
+#include "pyramid.h"
+
+#define PYRAMID_MAGIC "CJP2"
+#define TILE_SIZE 256
+#define MAX_LEVELS 24
+
+// Levels start 4 KB aligned, and tiles are whole multiples of it. That's
+// a page on most systems, but arm64 kernels can have 16 or 64 KB pages,
+// so the viewer doesn't rely on it when mapping a tile.
+#define TILE_ALIGN 4096
+
+// The file starts with this, in native byte order. The pixels are for
+// one screen anyway.
+struct Pyramid_Level {
+    uint32_t width;
+    uint32_t height;
+    uint64_t offset; // of the first tile, row major after that
+};
+
+struct Pyramid_Header {
+    char magic[4];
+    uint32_t pixel_format; // of the screen it was built for, for messages
+    uint32_t channels;     // 3 or 4 bytes per pixel
+    uint32_t red_first;    // R G B byte order, else B G R
+    uint32_t tile_size;
+    uint32_t num_levels;
+    uint32_t orientation;  // the jpeg's EXIF one; tiles are as stored
+    struct Pyramid_Level levels[MAX_LEVELS];
+};
+
+// How a pyramid for fb stores pixels: like fb does, or 3 channel RGB for
+// 16 bpp screens, which draw_region() dithers.
+static void stored_layout(const struct Frame_Buffer* fb, uint32_t* channels,
+    uint32_t* red_first)
+{
+    if (fb->bytes_per_pixel == 2) {
+        *channels = 3;
+        *red_first = 1;
+    }
+    else {
+        *channels = fb->bytes_per_pixel;
+        *red_first = fb->red_first;
+    }
+}
+
+static uint64_t level_bytes(const struct Pyramid_Header* h,
+    const struct Pyramid_Level* level)
+{
+    uint64_t tiles_x = (level->width + h->tile_size - 1) / h->tile_size;
+    uint64_t tiles_y = (level->height + h->tile_size - 1) / h->tile_size;
+    return tiles_x * tiles_y * h->tile_size * h->tile_size * h->channels;
+}
+
+// Building
+
+// A level being written: a band of one tile row at a time, and the row
+// waiting to be averaged with the next one into the level after.
+struct Level_Band {
+    struct Pyramid_Level* level;
+    uint32_t tiles_x;
+    uint8_t* rows;
+    uint32_t num_rows; // in rows
+    uint32_t rows_in;  // of the level so far
+    uint32_t band;     // tile row rows goes to
+    uint8_t* pending;
+    bool have_pending;
+    uint8_t* half;     // a row of the next level
+};
+
+struct Builder {
+    int fd;
+    const char* out_name;
+    struct Pyramid_Header header;
+    struct Level_Band bands[MAX_LEVELS];
+    uint8_t* tile;
+};
+
+// Write the tiles of a full band, or the last one of the level.
+static int flush_band(struct Builder* b, struct Level_Band* lb)
+{
+    uint32_t tile_size = b->header.tile_size;
+    uint32_t channels = b->header.channels;
+    size_t tile_stride = (size_t)tile_size * channels;
+    size_t tile_bytes = tile_stride * tile_size;
+    size_t row_len = (size_t)lb->level->width * channels;
+
+    uint32_t tx;
+    for (tx = 0; tx < lb->tiles_x; tx++) {
+        uint32_t x = tx * tile_size;
+        size_t n = (size_t)(lb->level->width - x < tile_size ?
+            lb->level->width - x : tile_size) * channels;
+
+        // edge tiles are padded with black
+        memset(b->tile, 0, tile_bytes);
+        uint32_t y;
+        for (y = 0; y < lb->num_rows; y++) {
+            memcpy(b->tile + y * tile_stride,
+                lb->rows + y * row_len + (size_t)x * channels, n);
+        }
+
+        off_t offset = lb->level->offset +
+            ((uint64_t)lb->band * lb->tiles_x + tx) * tile_bytes;
+        if (pwrite(b->fd, b->tile, tile_bytes, offset) != (ssize_t)tile_bytes) {
+            fprintf(File_Error, "Error: write(%s): %s\n", b->out_name,
+                    strerror(errno));
+            return -1;
+        }
+    }
+
+    lb->band++;
+    lb->num_rows = 0;
+    return 0;
+}
+
+// Add the next row of level l, and every second row, averaged 2x2 with
+// the one before, to level l + 1.
+static int push_row(struct Builder* b, uint32_t l, const uint8_t* row)
+{
+    struct Level_Band* lb = &b->bands[l];
+    uint32_t channels = b->header.channels;
+    uint32_t width = lb->level->width;
+    size_t row_len = (size_t)width * channels;
+
+    memcpy(lb->rows + lb->num_rows * row_len, row, row_len);
+    lb->num_rows++;
+    lb->rows_in++;
+    bool last = lb->rows_in == lb->level->height;
+    if (lb->num_rows == b->header.tile_size || last) {
+        if (flush_band(b, lb)) return -1;
+    }
+
+    if (l + 1 == b->header.num_levels) return 0;
+
+    const uint8_t* above = lb->pending;
+    if (!lb->have_pending) {
+        memcpy(lb->pending, row, row_len);
+        if (!last) {
+            lb->have_pending = true;
+            return 0;
+        }
+        // an odd last row goes with itself
+    }
+    lb->have_pending = false;
+
+    // an odd last column goes with itself too
+    uint32_t half_w = b->bands[l + 1].level->width;
+    uint32_t x;
+    for (x = 0; x < half_w; x++) {
+        const uint8_t* a0 = above + 2 * x * channels;
+        const uint8_t* b0 = row + 2 * x * channels;
+        size_t next = 2 * x + 1 < width ? channels : 0;
+        uint8_t* out = lb->half + x * channels;
+        uint32_t c;
+        for (c = 0; c < channels; c++) {
+            out[c] = (a0[c] + a0[c + next] + b0[c] + b0[c + next] + 2) >> 2;
+        }
+    }
+    return push_row(b, l + 1, lb->half);
+}
+
+struct Jpeg_Error {
+    struct jpeg_error_mgr mgr;
+    jmp_buf jump;
+};
+
+static void jpeg_error_exit(j_common_ptr cinfo)
+{
+    struct Jpeg_Error* jerr = (struct Jpeg_Error*)cinfo->err;
+    char msg[JMSG_LENGTH_MAX];
+    cinfo->err->format_message(cinfo, msg);
+    fprintf(File_Error, "Error: libjpeg: %s\n", msg);
+    longjmp(jerr->jump, 1);
+}
+
+// The part of pyramid_build() that libjpeg may jump out of. Buffers come
+// from libjpeg's pool, freed by jpeg_destroy_decompress().
+static int build_levels(struct jpeg_decompress_struct* cinfo,
+    struct Builder* b, struct Frame_Buffer* fb)
+{
+    struct Pyramid_Header* h = &b->header;
+    memcpy(h->magic, PYRAMID_MAGIC, 4);
+    h->pixel_format = fb->pixel_format;
+    stored_layout(fb, &h->channels, &h->red_first);
+    h->tile_size = TILE_SIZE;
+
+    jpeg_save_markers(cinfo, JPEG_APP0 + 1, 0xffff);
+    jpeg_read_header(cinfo, TRUE);
+
+    // Kept to turn the whole image when it's shown, like the jpeg. Tiles
+    // can't be written turned a band at a time.
+    h->orientation = 1;
+    jpeg_saved_marker_ptr m;
+    for (m = cinfo->marker_list; m && h->orientation == 1; m = m->next) {
+        if (m->marker == JPEG_APP0 + 1) {
+            h->orientation = exif_app1_orientation(m->data, m->data_length);
+        }
+    }
+
+    if (h->channels == 4) {
+        cinfo->out_color_space = h->red_first ? JCS_EXT_RGBX : JCS_EXT_BGRX;
+    }
+    else {
+        cinfo->out_color_space = h->red_first ? JCS_EXT_RGB : JCS_EXT_BGR;
+    }
+    jpeg_start_decompress(cinfo);
+
+    // halve until it fits in a tile
+    uint32_t w = cinfo->output_width;
+    uint32_t ht = cinfo->output_height;
+    uint64_t offset = TILE_ALIGN;
+    h->num_levels = 0;
+    while (h->num_levels < MAX_LEVELS) {
+        struct Pyramid_Level* level = &h->levels[h->num_levels++];
+        level->width = w;
+        level->height = ht;
+        level->offset = offset;
+        offset += level_bytes(h, level);
+        if (w <= TILE_SIZE && ht <= TILE_SIZE) break;
+        w = (w + 1) / 2;
+        ht = (ht + 1) / 2;
+    }
+
+    if (ftruncate(b->fd, offset)) {
+        fprintf(File_Error, "Error: ftruncate(%s, %llu MB): %s\n", b->out_name,
+                (unsigned long long)(offset >> 20), strerror(errno));
+        return -1;
+    }
+
+    size_t tile_bytes = (size_t)TILE_SIZE * TILE_SIZE * h->channels;
+    b->tile = (*cinfo->mem->alloc_large)((j_common_ptr)cinfo, JPOOL_IMAGE,
+        tile_bytes);
+    uint32_t l;
+    for (l = 0; l < h->num_levels; l++) {
+        struct Level_Band* lb = &b->bands[l];
+        lb->level = &h->levels[l];
+        lb->tiles_x = (lb->level->width + TILE_SIZE - 1) / TILE_SIZE;
+        size_t row_len = (size_t)lb->level->width * h->channels;
+        lb->rows = (*cinfo->mem->alloc_large)((j_common_ptr)cinfo,
+            JPOOL_IMAGE, row_len * TILE_SIZE);
+        lb->pending = (*cinfo->mem->alloc_large)((j_common_ptr)cinfo,
+            JPOOL_IMAGE, row_len);
+        lb->half = (*cinfo->mem->alloc_large)((j_common_ptr)cinfo,
+            JPOOL_IMAGE, row_len);
+    }
+
+    uint8_t* row = (*cinfo->mem->alloc_large)((j_common_ptr)cinfo,
+        JPOOL_IMAGE, (size_t)h->levels[0].width * h->channels);
+    while (cinfo->output_scanline < cinfo->output_height && !Quit) {
+        jpeg_read_scanlines(cinfo, &row, 1);
+        if (push_row(b, 0, row)) return -1;
+    }
+    if (Quit) return -1;
+    jpeg_finish_decompress(cinfo);
+
+    // last, so an unfinished file isn't a pyramid
+    if (pwrite(b->fd, h, sizeof(*h), 0) != sizeof(*h)) {
+        fprintf(File_Error, "Error: write(%s): %s\n", b->out_name,
+                strerror(errno));
+        return -1;
+    }
+
+    fprintf(File_Info, "%s: %u x %u, %u levels, %llu MB\n", b->out_name,
+        h->levels[0].width, h->levels[0].height, h->num_levels,
+        (unsigned long long)(offset >> 20));
+    return 0;
+}
+
+int pyramid_build(const char* jpeg_name, const char* out_name,
+    struct Frame_Buffer* fb)
+{
+    FILE* in = fopen(jpeg_name, "rb");
+    if (in == 0) {
+        fprintf(File_Error, "Error: open(%s): %s\n", jpeg_name, strerror(errno));
+        return -1;
+    }
+
+    struct Builder b;
+    memset(&b, 0, sizeof(b));
+    b.out_name = out_name;
+    b.fd = open(out_name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (b.fd < 0) {
+        fprintf(File_Error, "Error: open(%s): %s\n", out_name, strerror(errno));
+        fclose(in);
+        return -1;
+    }
+
+    struct jpeg_decompress_struct cinfo;
+    struct Jpeg_Error jerr;
+    cinfo.err = jpeg_std_error(&jerr.mgr);
+    jerr.mgr.error_exit = jpeg_error_exit;
+
+    int ret = -1;
+    if (setjmp(jerr.jump) == 0) {
+        jpeg_create_decompress(&cinfo);
+        jpeg_stdio_src(&cinfo, in);
+        ret = build_levels(&cinfo, &b, fb);
+    }
+    jpeg_destroy_decompress(&cinfo);
+    fclose(in);
+
+    if (close(b.fd) && ret == 0) {
+        fprintf(File_Error, "Error: close(%s): %s\n", out_name, strerror(errno));
+        ret = -1;
+    }
+    if (ret) unlink(out_name);
+    return ret;
+}
+
+// Viewing
+
+// Open a pyramid and check its header. Returns the fd, or -1 with a
+// message.
+static int open_pyramid(const char* filename, struct Pyramid_Header* h)
+{
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(File_Error, "Error: open(%s): %s\n", filename, strerror(errno));
+        return -1;
+    }
+
+    struct stat st;
+    bool ok = fstat(fd, &st) == 0 &&
+        pread(fd, h, sizeof(*h), 0) == sizeof(*h) &&
+        memcmp(h->magic, PYRAMID_MAGIC, 4) == 0 &&
+        (h->channels == 3 || h->channels == 4) &&
+        h->tile_size > 0 && h->tile_size <= 65536 &&
+        h->num_levels > 0 && h->num_levels <= MAX_LEVELS &&
+        h->orientation >= 1 && h->orientation <= 8;
+
+    uint32_t l;
+    for (l = 0; ok && l < h->num_levels; l++) {
+        struct Pyramid_Level* level = &h->levels[l];
+        ok = level->width > 0 && level->height > 0 &&
+             level->offset + level_bytes(h, level) <= (uint64_t)st.st_size;
+    }
+
+    if (!ok) {
+        fprintf(File_Error, "Error: %s isn't a console-jpeg pyramid.\n",
+                filename);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Copy part (in level pixels) of level out of its tiles into pixels,
+// mapping one tile at a time.
+static int copy_tiles(int fd, const char* filename,
+    const struct Pyramid_Header* h, const struct Pyramid_Level* level,
+    const struct Image_Rect* part, uint8_t* pixels, size_t stride)
+{
+    uint32_t ts = h->tile_size;
+    size_t tile_stride = (size_t)ts * h->channels;
+    size_t tile_bytes = tile_stride * ts;
+    uint32_t tiles_x = (level->width + ts - 1) / ts;
+
+    // mmap() offsets are whole pages, whatever the tiles are aligned to
+    uint64_t page_size = sysconf(_SC_PAGESIZE);
+
+    uint32_t tx0 = part->x / ts;
+    uint32_t ty0 = part->y / ts;
+    uint32_t tx1 = (part->x + part->w - 1) / ts;
+    uint32_t ty1 = (part->y + part->h - 1) / ts;
+
+    uint32_t tx, ty;
+    for (ty = ty0; ty <= ty1; ty++) {
+        for (tx = tx0; tx <= tx1; tx++) {
+            uint64_t offset = level->offset +
+                ((uint64_t)ty * tiles_x + tx) * tile_bytes;
+            size_t skip = offset % page_size;
+            uint8_t* map = mmap(0, skip + tile_bytes, PROT_READ, MAP_SHARED,
+                fd, offset - skip);
+            if (map == MAP_FAILED) {
+                fprintf(File_Error, "Error: mmap(%s): %s\n", filename,
+                        strerror(errno));
+                return -1;
+            }
+            const uint8_t* tile = map + skip;
+
+            // the piece of part in this tile
+            int x0 = tx * ts > (uint32_t)part->x ? (int)(tx * ts) : part->x;
+            int y0 = ty * ts > (uint32_t)part->y ? (int)(ty * ts) : part->y;
+            int x1 = (tx + 1) * ts < (uint32_t)(part->x + part->w) ?
+                (int)((tx + 1) * ts) : part->x + part->w;
+            int y1 = (ty + 1) * ts < (uint32_t)(part->y + part->h) ?
+                (int)((ty + 1) * ts) : part->y + part->h;
+
+            int y;
+            for (y = y0; y < y1; y++) {
+                memcpy(pixels + (size_t)(y - part->y) * stride +
+                        (size_t)(x0 - part->x) * h->channels,
+                    tile + (size_t)(y - ty * ts) * tile_stride +
+                        (size_t)(x0 - tx * ts) * h->channels,
+                    (size_t)(x1 - x0) * h->channels);
+            }
+            munmap(map, skip + tile_bytes);
+        }
+    }
+    return 0;
+}
+
+// Turn w x h pixels to orientation, into a new buffer, or 0 with a
+// message.
+static uint8_t* turn_pixels(const uint8_t* pixels, int w, int h,
+    size_t stride, int channels, int orientation)
+{
+    bool turned = orientation >= 5;
+    int out_w = turned ? h : w;
+    int out_h = turned ? w : h;
+    size_t size = (size_t)out_w * out_h * channels;
+    uint8_t* out = mem_malloc(size);
+    if (out == 0) {
+        fprintf(File_Error, "Error: malloc(%i MB) failed.\n", (int)(size >> 20));
+        return 0;
+    }
+
+    struct Resize_Cache* cache = 0;
+    int err = resize_fixed_cached(&cache, pixels, w, h, stride, orientation,
+        out, out_w, out_h, out_w * channels, channels, false);
+    resize_cache_free(cache);
+    if (err) {
+        fprintf(File_Error, "Error: Out of memory turning the image.\n");
+        mem_free(out);
+        return 0;
+    }
+    return out;
+}
+
+// rect (in level 0 pixels, as stored) scaled to fit fb. orientation turns
+// it as it's shown, for the whole image only, so rect is all of it.
+static int draw_pyramid(int fd, const char* filename,
+    const struct Pyramid_Header* h, const struct Image_Rect* rect,
+    int orientation, struct Frame_Buffer* fb)
+{
+    uint32_t channels, red_first;
+    stored_layout(fb, &channels, &red_first);
+    if (channels != h->channels) {
+        fprintf(File_Error, "Error: %s was built for '%s', not '%s'. "
+                "Build it again.\n", filename, four_cc_to_str(h->pixel_format),
+                four_cc_to_str(fb->pixel_format));
+        return -1;
+    }
+
+    // The smallest level with at least as many pixels as the screen shows.
+    bool turned = orientation >= 5;
+    double k = fmin((double)fb->width / (turned ? rect->h : rect->w),
+        (double)fb->height / (turned ? rect->w : rect->h));
+    uint32_t l = 0;
+    while (l + 1 < h->num_levels && ldexp(k, l + 1) <= 1) l++;
+    const struct Pyramid_Level* level = &h->levels[l];
+
+    // rect on that level, rounded out to whole pixels. That moves it less
+    // than a screen pixel.
+    struct Image_Rect lrect;
+    lrect.x = floor(ldexp(rect->x, -l));
+    lrect.y = floor(ldexp(rect->y, -l));
+    lrect.w = ceil(ldexp(rect->x + rect->w, -l)) - lrect.x;
+    lrect.h = ceil(ldexp(rect->y + rect->h, -l)) - lrect.y;
+    struct Image_Rect part = lrect;
+    if (clip_rect(&part, level->width, level->height, filename)) return -1;
+
+    if (Verbose) {
+        fprintf(File_Info, "  source %5u x %5u  %u levels\n",
+            h->levels[0].width, h->levels[0].height, h->num_levels);
+        fprintf(File_Info, "  level  %5u x %5u  level %u\n", level->width,
+            level->height, l);
+        fprintf(File_Info, "  region %5i x %5i  at %i,%i\n", part.w, part.h,
+            part.x, part.y);
+    }
+
+    size_t stride = (size_t)part.w * channels;
+    uint8_t* pixels = mem_malloc(stride * part.h);
+    if (pixels == 0) {
+        fprintf(File_Error, "Error: malloc(%i MB) failed.\n",
+                (int)((stride * part.h) >> 20));
+        return -1;
+    }
+
+    int ret = copy_tiles(fd, filename, h, level, &part, pixels, stride);
+    if (ret == 0 && orientation != 1) {
+        // the whole level, so lrect is part
+        uint8_t* turned_pixels = turn_pixels(pixels, part.w, part.h, stride,
+            channels, orientation);
+        mem_free(pixels);
+        pixels = turned_pixels;
+        if (pixels == 0) return -1;
+        if (turned) {
+            int t = part.w;
+            part.w = part.h;
+            part.h = t;
+        }
+        lrect = part;
+        stride = (size_t)part.w * channels;
+    }
+    if (ret == 0) {
+        ret = draw_region(fb, &lrect, &part, pixels, part.w, part.h, stride,
+            channels, red_first != h->red_first);
+    }
+
+    mem_free(pixels);
+    return ret;
+}
+
+int read_pyramid_region(const char* filename, const struct Image_Rect* rect,
+    struct Frame_Buffer* fb)
+{
+    double t0 = time_f();
+
+    if (Verbose) fprintf(File_Info, "\nPYRAMID %s\n", filename);
+
+    struct Pyramid_Header h;
+    int fd = open_pyramid(filename, &h);
+    if (fd < 0) return -1;
+
+    PROBE_DECODE_START("cjp", filename);
+
+    mem_stats_begin();
+
+    // Like a jpeg: the whole image is turned to its EXIF orientation, and
+    // zoom: rectangles are in the image as stored.
+    int orientation = rect ? 1 : h.orientation;
+    struct Image_Rect all = { 0, 0, h.levels[0].width, h.levels[0].height };
+    if (rect == 0) rect = &all;
+    int ret = draw_pyramid(fd, filename, &h, rect, orientation, fb);
+    close(fd);
+
+    PROBE_DECODE_END("cjp", filename, rect->w, rect->h, ret);
+
+    if (Verbose) {
+        mem_stats_report(File_Info);
+        fprintf(File_Info, "  total   %5.3f sec\n", time_f() - t0);
+    }
+    return ret;
+}
+
+int read_pyramid(const char* filename, struct Frame_Buffer* fb)
+{
+    return read_pyramid_region(filename, 0, fb);
+}
@@ -0,0 +1,31 @@
+#ifndef PYRAMID_H
+#define PYRAMID_H
+
+// .cjp files: an image as a pyramid of tiles, for gigapixel images that
+// take seconds to decode as jpegs.
+//
+// Level 0 is the full image, and each level after it is half the size of
+// the one before, down to one that fits in a tile. Levels are cut into
+// 256x256 tiles, 4 KB aligned, of pixels already in the frame buffer's
+// byte order (3 channel RGB for 16 bpp screens, dithered as they're
+// drawn). Showing any part of the image maps just the tiles under it, of
+// the smallest level with at least as many pixels as the screen shows,
+// and copies them out, no decoding. The jpeg's EXIF orientation is kept
+// in the header, and the whole image is turned to it as it's shown, like
+// read_jpeg(); zoom: rectangles are in the image as stored.
+
+// --build-pyramid in.jpg out.cjp: decode jpeg_name a row at a time and
+// write the pyramid for fb's pixel format to out_name. Memory is a band of
+// tile rows per level, not the whole image.
+int pyramid_build(const char* jpeg_name, const char* out_name,
+    struct Frame_Buffer* fb);
+
+// file.cjp: the whole image, scaled to fit.
+int read_pyramid(const char* filename, struct Frame_Buffer* fb);
+
+// zoom:file.cjp:x,y,w,h, or all of it if rect is 0.
+struct Image_Rect;
+int read_pyramid_region(const char* filename, const struct Image_Rect* rect,
+    struct Frame_Buffer* fb);
+
+#endif
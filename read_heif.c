@@ -1,3 +1,4 @@
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -7,8 +8,15 @@
 
 #include "stb_image_resize2.h"
 
+#include "display.h"
 #include "drm_search.h"
 #include "frame_buffer.h"
+#include "mapped_file.h"
+#include "mem_stats.h"
+#include "perf_counters.h"
+#include "probes.h"
+#include "region.h"
+#include "resize.h"
 #include "util.h"
 #include "read_heif.h"
 
@@ -18,11 +26,35 @@ int read_heif(const char* filename, struct Frame_Buffer* fb)
     fprintf(File_Error, "Error: console-jpeg was built without HEIF support.\n");
     return -1;
 }
+
+int read_heif_mem(const char* name, const void* data, size_t length,
+    struct Frame_Buffer* fb)
+{
+    return read_heif(name, fb);
+}
+
+int read_heif_region(const char* filename, const struct Image_Rect* rect,
+    struct Frame_Buffer* fb)
+{
+    return read_heif(filename, fb);
+}
 #else
 
 #include <libheif/heif.h>
 
-int read_heif(const char* filename, struct Frame_Buffer* fb)
+// heif_init() once, even with a preload decoding on the worker thread.
+static pthread_once_t Heif_Once = PTHREAD_ONCE_INIT;
+static __thread bool Heif_Did_Init = false;
+
+static void init_heif()
+{
+    heif_init(0);
+    Heif_Did_Init = true;
+}
+
+// libheif doesn't copy data, it must stay put until this returns.
+int read_heif_mem(const char* filename, const void* data, size_t length,
+    struct Frame_Buffer* fb)
 {
     double t0 = 0;
     double t1 = 0;
@@ -33,10 +65,13 @@ int read_heif(const char* filename, struct Frame_Buffer* fb)
         fprintf(File_Info, "\nHEIF %s\n", filename);
     }
 
-    static bool already = false;
-    if (!already) {
-        heif_init(0);
-        already = true;
+    mem_stats_begin();
+
+    PROBE_DECODE_START("heif", filename);
+
+    pthread_once(&Heif_Once, init_heif);
+    if (Heif_Did_Init) {
+        Heif_Did_Init = false;
 
         if (Verbose) {
             t1 = time_f();
@@ -76,6 +111,14 @@ int read_heif(const char* filename, struct Frame_Buffer* fb)
                 rsz_fmt_out = STBIR_BGRA_PM;
                 break;
 
+        case DRM_FORMAT_RGB565:
+        case DRM_FORMAT_BGR565:
+                // decoded as RGB, then dither_565()
+                dec_fmt = heif_chroma_interleaved_RGB;
+                rsz_fmt_in = STBIR_RGB;
+                rsz_fmt_out = STBIR_RGB;
+                break;
+
         default:
                 fprintf(File_Error, "Error: Unknown pixel format '%s'\n",
                     four_cc_to_str(fb->pixel_format));
@@ -102,7 +145,13 @@ int read_heif(const char* filename, struct Frame_Buffer* fb)
 
     const uint8_t* img_pixels = 0;
 
-    err = heif_context_read_from_file(ctx, filename, 0);
+    // 16 bpp frame buffers get RGB, dithered down
+    bool dither = fb->bytes_per_pixel == 2;
+    uint8_t* out_pixels = 0;
+
+    perf_stage_begin(PERF_DECODE);
+
+    err = heif_context_read_from_memory_without_copy(ctx, data, length, 0);
     if (err.code != heif_error_Ok) goto HeifError;
 
     // get a handle to the primary image
@@ -113,6 +162,10 @@ int read_heif(const char* filename, struct Frame_Buffer* fb)
     err = heif_decode_image(handle, &img, heif_colorspace_RGB, dec_fmt, 0);
     if (err.code != heif_error_Ok) goto HeifError;
 
+    perf_stage_end(PERF_DECODE);
+
+    mem_stats_sample();
+
     img_w = heif_image_get_width(img, heif_channel_interleaved);
     img_h = heif_image_get_height(img, heif_channel_interleaved);
     if (img_w < 0 || img_h < 0) {
@@ -126,57 +179,335 @@ int read_heif(const char* filename, struct Frame_Buffer* fb)
         goto Cleanup;
     }
 
-    // always resize, since heifs are pretty much never exactly screen size
-    int resize_width;
-    int resize_height;
+    frame_buffer_view_all(fb);
+
+    // --plane-scale: smaller images go on the screen as they are, and the
+    // display scales them up
+    if (img_w < dst_w && img_h < dst_h &&
+        display_plane_scale(fb, img_w, img_h,
+            &border_left, &border_right, &border_top, &border_bottom)) {
+        if (Verbose) {
+            fprintf(File_Info, "  source %5i x %5i\n", img_w, img_h);
+            fprintf(File_Info, "  dest   %5i x %5i\n", fb->width, fb->height);
+            fprintf(File_Info, "  view   %5i x %5i\n", fb->view_w, fb->view_h);
+            fprintf(File_Info, "  border  %i %i %i %i\n", border_left, border_right,
+                                                      border_top, border_bottom);
+            t1 = time_f();
+        }
 
-    // set borders to preserve aspect ratio
-    if (img_w * dst_h > img_h * dst_w) {
-        // borders on top / bottom
-        resize_width = dst_w;
-        resize_height = img_h * dst_w / img_w;
-        split_border(abs(resize_height - dst_h),
-            &border_top, &border_bottom);
+        perf_stage_begin(PERF_COPY);
+        if (dither) {
+            dither_565(fb, img_pixels, 3, img_w, img_h, img_stride,
+                border_left, border_top);
+        }
+        else {
+            swizzle_copy(rsz_fmt_in != rsz_fmt_out, fb->bytes_per_pixel,
+                (uint8_t*)img_pixels, img_w, img_h, img_stride,
+                get_pixels(fb, border_left, border_top), fb->stride);
+        }
+        perf_stage_end(PERF_COPY);
     }
     else {
-        // borders on left / right
-        resize_width = img_w * dst_h / img_h;
-        resize_height = dst_h;
-        split_border(abs(resize_width - dst_w),
-            &border_left, &border_right);
+        // always resize, since heifs are pretty much never exactly screen size
+        int resize_width;
+        int resize_height;
+
+        // set borders to preserve aspect ratio
+        if (img_w * dst_h > img_h * dst_w) {
+            // borders on top / bottom
+            resize_width = dst_w;
+            resize_height = img_h * dst_w / img_w;
+            split_border(abs(resize_height - dst_h),
+                &border_top, &border_bottom);
+        }
+        else {
+            // borders on left / right
+            resize_width = img_w * dst_h / img_h;
+            resize_height = dst_h;
+            split_border(abs(resize_width - dst_w),
+                &border_left, &border_right);
+        }
+
+        if (Verbose) {
+            fprintf(File_Info, "  source %5i x %5i\n", img_w, img_h);
+            fprintf(File_Info, "  resize %5i x %5i\n", resize_width, resize_height);
+            fprintf(File_Info, "  dest   %5i x %5i\n", fb->width, fb->height);
+            fprintf(File_Info, "  border  %i %i %i %i\n", border_left, border_right,
+                                                      border_top, border_bottom);
+            t1 = time_f();
+        }
+
+
+        uint8_t* pixels = get_pixels(fb, border_left, border_top);
+        int stride = fb->stride;
+        if (dither) {
+            stride = resize_width * 3;
+            out_pixels = mem_malloc((size_t)stride * resize_height);
+            if (out_pixels == 0) {
+                fprintf(File_Error, "Error: malloc(%i MB) failed.\n",
+                        (int)(((size_t)stride * resize_height) >> 20));
+                goto Cleanup;
+            }
+            pixels = out_pixels;
+        }
+
+        PROBE_RESIZE_START(img_w, img_h, resize_width, resize_height);
+        perf_stage_begin(PERF_RESIZE);
+        if (resize_use_fixed(img_w, img_h, resize_width, resize_height)) {
+            int channels = (dec_fmt == heif_chroma_interleaved_RGBA ? 4 : 3);
+            if (resize_fixed(img_pixels, img_w, img_h, img_stride,
+                    pixels, resize_width, resize_height, stride, channels,
+                    rsz_fmt_in != rsz_fmt_out)) {
+                goto Cleanup;
+            }
+        }
+        else {
+            STBIR_RESIZE rsz;
+            stbir_resize_init(&rsz, img_pixels, img_w, img_h, img_stride,
+                pixels, resize_width, resize_height, stride,
+                rsz_fmt_in, STBIR_TYPE_UINT8);
+
+            // swap channels
+            stbir_set_pixel_layouts(&rsz, rsz_fmt_in, rsz_fmt_out);
+
+            int ok = stbir_resize_extended(&rsz);
+            if (ok == 0) {
+                fprintf(File_Error, "Error: stbir_resize_extended() failed.\n");
+                goto Cleanup;
+            }
+        }
+        perf_stage_end(PERF_RESIZE);
+        PROBE_RESIZE_END(img_w, img_h, resize_width, resize_height);
+
+        if (dither) {
+            perf_stage_begin(PERF_COPY);
+            dither_565(fb, out_pixels, 3, resize_width, resize_height, stride,
+                border_left, border_top);
+            perf_stage_end(PERF_COPY);
+        }
     }
 
+    perf_stage_begin(PERF_BORDER);
+    draw_borders(fb, BG_Color, border_left, border_right, border_top, border_bottom);
+    perf_stage_end(PERF_BORDER);
+
     if (Verbose) {
-        fprintf(File_Info, "  source %5i x %5i\n", img_w, img_h);
-        fprintf(File_Info, "  resize %5i x %5i\n", resize_width, resize_height);
-        fprintf(File_Info, "  dest   %5i x %5i\n", fb->width, fb->height);
-        fprintf(File_Info, "  border  %i %i %i %i\n", border_left, border_right,
-                                                  border_top, border_bottom);
-        t1 = time_f();
+        t2 = time_f();
+        fprintf(File_Info, "  heif   %6.3f sec\n", t1 - t0);
+        fprintf(File_Info, "  %s %6.3f sec\n",
+                fb->view_w < fb->width || fb->view_h < fb->height ?
+                "copy  " : "resize", t2 - t1);
+    }
+
+    ret = 0;
+
+HeifError:
+    if (err.code != heif_error_Ok) {
+        fprintf(File_Error, "Error: libheif: %s\n", err.message);
+    }
+
+Cleanup:
+    if (out_pixels) mem_free(out_pixels);
+    if (img) heif_image_release(img);
+    if (handle) heif_image_handle_release(handle);
+    heif_context_free(ctx);
+
+    perf_counters_report(File_Info);
+
+    PROBE_DECODE_END("heif", filename, img_w, img_h, ret);
+
+    if (Verbose) {
+        mem_stats_report(File_Info);
+        fprintf(File_Info, "  total  %6.3f sec\n", time_f() - t0);
+    }
+
+    return ret;
+}
+
+int read_heif(const char* filename, struct Frame_Buffer* fb)
+{
+    struct Mapped_File mf;
+    if (mapped_file_open(&mf, filename)) return -1;
+
+    int ret = read_heif_mem(filename, mf.data, mf.length, fb);
+
+    mapped_file_close(&mf);
+    return ret;
+}
+
+// Copy the part of a decoded image (or tile) at img_x, img_y that is
+// inside r into region, which is r.w x r.h.
+static void copy_overlap(const struct heif_image* img, int img_x, int img_y,
+    const struct Image_Rect* r, uint8_t* region, int channels)
+{
+    int stride;
+    const uint8_t* pixels = heif_image_get_plane_readonly(img,
+        heif_channel_interleaved, &stride);
+    int w = heif_image_get_width(img, heif_channel_interleaved);
+    int h = heif_image_get_height(img, heif_channel_interleaved);
+    if (pixels == 0 || w < 0 || h < 0) return;
+
+    int x0 = img_x > r->x ? img_x : r->x;
+    int y0 = img_y > r->y ? img_y : r->y;
+    int x1 = img_x + w < r->x + r->w ? img_x + w : r->x + r->w;
+    int y1 = img_y + h < r->y + r->h ? img_y + h : r->y + r->h;
+
+    int y;
+    for (y = y0; y < y1; y++) {
+        memcpy(region + ((size_t)(y - r->y) * r->w + (x0 - r->x)) * channels,
+            pixels + (size_t)(y - img_y) * stride + (x0 - img_x) * channels,
+            (size_t)(x1 - x0) * channels);
     }
+}
+
+// zoom: a tiled heif (a grid image, like iPhone photos) decodes just the
+// tiles under rect. Other heifs, or libheif before 1.19, decode it all
+// and keep rect.
+int read_heif_region(const char* filename, const struct Image_Rect* rect,
+    struct Frame_Buffer* fb)
+{
+    double t0 = 0;
+    double t1 = 0;
+
+    if (Verbose) {
+        t0 = time_f();
+        fprintf(File_Info, "\nHEIF %s\n", filename);
+    }
+
+    struct Mapped_File mf;
+    if (mapped_file_open(&mf, filename)) return -1;
+
+    mem_stats_begin();
+
+    PROBE_DECODE_START("heif", filename);
+
+    pthread_once(&Heif_Once, init_heif);
+    Heif_Did_Init = false;
+
+    struct heif_context* ctx = heif_context_alloc();
+    struct heif_image_handle* handle = 0;
+    struct heif_image* img = 0;
+    struct heif_error err = { heif_error_Ok };
+    uint8_t* region = 0;
+    int ret = -1;
+
+    struct Image_Rect r = *rect;
+
+    enum heif_chroma dec_fmt;
+    int channels;
+    bool swizzle;
+    switch (fb->pixel_format) {
+        case DRM_FORMAT_BGR888:
+        case DRM_FORMAT_RGB565:
+        case DRM_FORMAT_BGR565:
+                dec_fmt = heif_chroma_interleaved_RGB;
+                channels = 3;
+                swizzle = false;
+                break;
+
+        case DRM_FORMAT_RGB888:
+                dec_fmt = heif_chroma_interleaved_RGB;
+                channels = 3;
+                swizzle = true;
+                break;
+
+        case DRM_FORMAT_XBGR8888:
+        case DRM_FORMAT_ABGR8888:
+                dec_fmt = heif_chroma_interleaved_RGBA;
+                channels = 4;
+                swizzle = false;
+                break;
+
+        case DRM_FORMAT_XRGB8888:
+        case DRM_FORMAT_ARGB8888:
+                dec_fmt = heif_chroma_interleaved_RGBA;
+                channels = 4;
+                swizzle = true;
+                break;
 
+        default:
+                fprintf(File_Error, "Error: Unknown pixel format '%s'\n",
+                    four_cc_to_str(fb->pixel_format));
+                goto Cleanup;
+    }
 
-    uint8_t* pixels = get_pixels(fb, border_left, border_top);
-    STBIR_RESIZE rsz;
-    stbir_resize_init(&rsz, img_pixels, img_w, img_h, img_stride,
-        pixels, resize_width, resize_height, fb->stride,
-        rsz_fmt_in, STBIR_TYPE_UINT8);
+    err = heif_context_read_from_memory_without_copy(ctx, mf.data, mf.length, 0);
+    if (err.code != heif_error_Ok) goto HeifError;
 
-    // swap channels
-    stbir_set_pixel_layouts(&rsz, rsz_fmt_in, rsz_fmt_out);
+    err = heif_context_get_primary_image_handle(ctx, &handle);
+    if (err.code != heif_error_Ok) goto HeifError;
 
-    int ok = stbir_resize_extended(&rsz);
-    if (ok == 0) {
-        fprintf(File_Error, "Error: stbir_resize_extended() failed.\n");
+    int img_w = heif_image_handle_get_width(handle);
+    int img_h = heif_image_handle_get_height(handle);
+    if (clip_rect(&r, img_w, img_h, filename)) goto Cleanup;
+
+    if (Verbose) {
+        fprintf(File_Info, "  source %5i x %5i\n", img_w, img_h);
+        fprintf(File_Info, "  region %5i x %5i  at %i,%i\n", r.w, r.h, r.x, r.y);
+    }
+
+    region = mem_malloc((size_t)r.w * r.h * channels);
+    if (region == 0) {
+        fprintf(File_Error, "Error: malloc(%i MB) failed.\n",
+                (int)(((size_t)r.w * r.h * channels) >> 20));
         goto Cleanup;
     }
 
-    draw_borders(fb, BG_Color, border_left, border_right, border_top, border_bottom);
+    perf_stage_begin(PERF_DECODE);
+
+    bool tiled = false;
+#if LIBHEIF_HAVE_VERSION(1, 19, 0)
+    struct heif_image_tiling tiling;
+    err = heif_image_handle_get_image_tiling(handle, 1, &tiling);
+    tiled = err.code == heif_error_Ok &&
+        tiling.num_columns * tiling.num_rows > 1;
+    err.code = heif_error_Ok;
+
+    if (tiled) {
+        uint32_t tw = tiling.tile_width;
+        uint32_t th = tiling.tile_height;
+        uint32_t tx;
+        uint32_t ty;
+
+        if (Verbose) {
+            fprintf(File_Info, "  tiles  %5u x %5u  of %u x %u\n",
+                tiling.num_columns, tiling.num_rows, tw, th);
+        }
+
+        for (ty = r.y / th; ty <= (r.y + r.h - 1) / th; ty++) {
+            for (tx = r.x / tw; tx <= (r.x + r.w - 1) / tw; tx++) {
+                err = heif_image_handle_decode_image_tile(handle, &img,
+                    heif_colorspace_RGB, dec_fmt, 0, tx, ty);
+                if (err.code != heif_error_Ok) goto HeifError;
+
+                copy_overlap(img, tx * tw, ty * th, &r, region, channels);
+                heif_image_release(img);
+                img = 0;
+            }
+        }
+    }
+#endif
+    if (!tiled) {
+        err = heif_decode_image(handle, &img, heif_colorspace_RGB, dec_fmt, 0);
+        if (err.code != heif_error_Ok) goto HeifError;
+
+        copy_overlap(img, 0, 0, &r, region, channels);
+    }
+
+    perf_stage_end(PERF_DECODE);
+
+    mem_stats_sample();
+
+    if (Verbose) t1 = time_f();
+
+    if (draw_region(fb, rect, &r, region, r.w, r.h, r.w * channels, channels,
+            swizzle)) {
+        goto Cleanup;
+    }
 
     if (Verbose) {
-        t2 = time_f();
         fprintf(File_Info, "  heif   %6.3f sec\n", t1 - t0);
-        fprintf(File_Info, "  resize %6.3f sec\n", t2 - t1);
+        fprintf(File_Info, "  resize %6.3f sec\n", time_f() - t1);
     }
 
     ret = 0;
@@ -187,11 +518,20 @@ HeifError:
     }
 
 Cleanup:
+    if (region) mem_free(region);
     if (img) heif_image_release(img);
     if (handle) heif_image_handle_release(handle);
     heif_context_free(ctx);
+    mapped_file_close(&mf);
 
-    if (Verbose) fprintf(File_Info, "  total  %6.3f sec\n", time_f() - t0);
+    perf_counters_report(File_Info);
+
+    PROBE_DECODE_END("heif", filename, r.w, r.h, ret);
+
+    if (Verbose) {
+        mem_stats_report(File_Info);
+        fprintf(File_Info, "  total  %6.3f sec\n", time_f() - t0);
+    }
 
     return ret;
 }
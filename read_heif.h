@@ -1,6 +1,17 @@
 #ifndef READ_HEIF_H
 #define READ_HEIF_H
 
+#include <stddef.h>
+
 int read_heif(const char* filename, struct Frame_Buffer* fb);
 
+// A heif file that's already in memory. name is for messages.
+int read_heif_mem(const char* name, const void* data, size_t length,
+    struct Frame_Buffer* fb);
+
+// zoom: decode just rect of the heif into fb, scaled to fit.
+struct Image_Rect;
+int read_heif_region(const char* filename, const struct Image_Rect* rect,
+    struct Frame_Buffer* fb);
+
 #endif
@@ -1,97 +1,51 @@
-#include <errno.h>
-#include <fcntl.h>
+#include <math.h>
+#include <setjmp.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/mman.h>
-#include <sys/stat.h>
 #include <sys/types.h>
 #include <time.h>
-#include <unistd.h>
 
 #include <drm_fourcc.h>
 
+#include <jpeglib.h>
 #include <turbojpeg.h>
 
 #include "stb_image_resize2.h"
 
+#include "display.h"
 #include "drm_search.h"
+#include "exif.h"
 #include "frame_buffer.h"
+#include "mapped_file.h"
+#include "mem_stats.h"
+#include "perf_counters.h"
+#include "probes.h"
+#include "region.h"
+#include "resize.h"
 #include "util.h"
 #include "read_jpeg.h"
 
-// Memory-mapped jpeg file.
-struct Mapped_Jpeg {
-    unsigned char* data;
-    size_t length;
-};
-
-static struct Mapped_Jpeg* jpeg_create(const char* filename)
-{
-    int fd = open(filename, O_RDONLY);
-    if (fd < 0) {
-        fprintf(File_Error, "Error: open(): %s\n", strerror(errno));
-        return 0;
-    }
-
-    struct stat st;
-    int err = fstat(fd, &st);
-    if (err < 0) {
-        fprintf(File_Error, "Error: fstat(): %s\n", strerror(errno));
-        close(fd);
-        return 0;
-    }
-
-    // very arbitrary limit
-    const int max_mb = 500;
-    if ((st.st_size >> 20) > max_mb) {
-        fprintf(File_Error, "Error: Input jpeg larger than %i MB.\n", max_mb);
-        close(fd);
-        return 0;
-    }
-
-    void* addr = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-    if (addr == MAP_FAILED) {
-        fprintf(File_Error, "Error: mmap(): %s\n", strerror(errno));
-        close(fd);
-        return 0;
-    }
-
-    close(fd);
-
-    struct Mapped_Jpeg* jpeg = malloc(sizeof(struct Mapped_Jpeg));
-    if (jpeg == 0) {
-        free(jpeg);
-        munmap(addr, st.st_size);
-        fprintf(File_Error, "Error: Out of memory at line %i.\n", __LINE__);
-        return 0;
-    }
-    jpeg->data = (unsigned char*)addr;
-    jpeg->length = st.st_size;
-    return jpeg;
-}
-
-static void jpeg_destroy(struct Mapped_Jpeg* jpeg)
-{
-    munmap(jpeg->data, jpeg->length);
-    free(jpeg);
-}
-
 // How to get an arbitrary size jpeg onto a fixed size screen.
 // We have 2 scaling methods:
-//  1) jpeg scaled decode: 1x, 1/2, 1/4, 1/8
+//  1) jpeg scaled decode: 2x down to 1/8 in steps of 1/8
 //  2) stbir_resize() general-purpose image resizer
-// If possible, we try to decode the jpeg directly to the framebuffer and avoid
-// doing an unnecessary resize.
+// Every decode scale is a candidate plan, either decoding directly to the
+// framebuffer or decoding bigger and resizing down, and the cost model
+// (Jpeg_Cost) picks the cheapest.
 struct resize_strategy {
-    // jpeg native size
+    // jpeg native size, turned to its EXIF orientation, like the decode
+    // and resize sizes below. The jpeg decodes as stored, and the resize
+    // turns it.
     int src_width;
     int src_height;
+    int orientation;
 
-    // screen / framebuffer size
+    // screen / framebuffer size and pixel format
     int dst_width;
     int dst_height;
+    uint32_t dst_format;
 
     // jpeg decode size
     // src scaled by 1x, 1/2, 1/4, 1/8
@@ -108,9 +62,23 @@ struct resize_strategy {
     int border_right;
     int border_top;
     int border_bottom;
+
+    // part of the framebuffer that's shown, the whole thing unless the
+    // display scales it (--plane-scale)
+    int view_width;
+    int view_height;
+
+    // decode scale, and the seconds the cost model expects it all to take
+    tjscalingfactor scale;
+    double cost;
 };
 
-static void make_resize_strategy(struct resize_strategy* strat,
+// Rough numbers for a Pi 4. --calibrate measures the real ones.
+struct Jpeg_Cost Jpeg_Cost = { 4.0, 6.0, 6.0, 0.7, 0.3 };
+
+// The plan for decoding at scale sf: directly to the framebuffer if one
+// side matches the screen and the other fits, else resized to fit.
+static void plan_at_scale(struct resize_strategy* strat, tjscalingfactor sf,
     int src_w, int src_h, int dst_w, int dst_h)
 {
     strat->src_width = src_w;
@@ -119,8 +87,11 @@ static void make_resize_strategy(struct resize_strategy* strat,
     strat->dst_width = dst_w;
     strat->dst_height = dst_h;
 
-    strat->decode_width = src_w;
-    strat->decode_height = src_h;
+    int scale_w = TJSCALED(src_w, sf);
+    int scale_h = TJSCALED(src_h, sf);
+    strat->scale = sf;
+    strat->decode_width = scale_w;
+    strat->decode_height = scale_h;
 
     strat->resize_width = 0;
     strat->resize_height = 0;
@@ -130,51 +101,21 @@ static void make_resize_strategy(struct resize_strategy* strat,
     strat->border_left = 0;
     strat->border_right = 0;
 
-    if (src_w == dst_w && src_h == dst_h) {
-        // best case, jpeg matches screen exactly
-        return;
-    }
+    strat->view_width = dst_w;
+    strat->view_height = dst_h;
 
-    int scale_w;
-    int scale_h;
-
-    tjscalingfactor sf = { 1 };
-    for (sf.denom = 1; sf.denom <= 8; sf.denom <<= 1) {
-        // check if we can do a scaled decode directly to framebuffer
-        scale_w = TJSCALED(src_w, sf);
-        scale_h = TJSCALED(src_h, sf);
-        if (scale_w == dst_w && scale_h < dst_h) {
-            // direct decode to framebuffer, borders on top/bottom
-            strat->decode_width = scale_w;
-            strat->decode_height = scale_h;
-            split_border(dst_h - scale_h,
-                &strat->border_top, &strat->border_bottom);
-            return;
-        }
-        if (scale_w < dst_w && scale_h == dst_h) {
-            // direct decode to framebuffer, borders on left/right
-            strat->decode_width = scale_w;
-            strat->decode_height = scale_h;
-            split_border(dst_w - scale_w,
-                &strat->border_left, &strat->border_right);
-            return;
-        }
-    }
+    strat->cost = 0;
 
-    // no exact decode, pick smallest decode size that is larger than screen
-    for (sf.denom = 8; sf.denom >= 1; sf.denom >>= 1) {
-        scale_w = TJSCALED(src_w, sf);
-        scale_h = TJSCALED(src_h, sf);
-        if (scale_w > dst_w || scale_h > dst_h) {
-            // good intermediate size
-            break;
-        }
+    if ((scale_w == dst_w && scale_h <= dst_h) ||
+        (scale_w <= dst_w && scale_h == dst_h)) {
+        // direct decode to framebuffer
+        split_border(dst_w - scale_w,
+            &strat->border_left, &strat->border_right);
+        split_border(dst_h - scale_h,
+            &strat->border_top, &strat->border_bottom);
+        return;
     }
 
-    // temp image will be this size
-    strat->decode_width = scale_w;
-    strat->decode_height = scale_h;
-
     // set borders to preserve aspect ratio
     if (scale_w * dst_h > scale_h * dst_w) {
         // borders on top / bottom
@@ -192,54 +133,524 @@ static void make_resize_strategy(struct resize_strategy* strat,
     }
 }
 
-int read_jpeg(const char* filename, struct Frame_Buffer* fb)
+// libjpeg-turbo has SIMD IDCTs for 8x8, 4x4, 2x2 and 1x1 outputs per
+// block: scales 1, 1/2, 1/4, 1/8. The others are plain C.
+static bool fast_scale(tjscalingfactor sf)
 {
-    double t2, t1, t0 = time_f();
+    int n = 8 * sf.num / sf.denom;
+    return n == 8 || n == 4 || n == 2 || n == 1;
+}
+
+// Filter taps for stbir_resize() from decode size to resize size. The
+// default filters have 4 taps, and spread over more source pixels when
+// shrinking.
+static double resize_taps(const struct resize_strategy* strat)
+{
+    double in_w = strat->decode_width;
+    double in_h = strat->decode_height;
+    double out_w = strat->resize_width;
+    double out_h = strat->resize_height;
+    double taps_x = 4 * (in_w > out_w ? in_w / out_w : 1);
+    double taps_y = 4 * (in_h > out_h ? in_h / out_h : 1);
+    return out_w * in_h * taps_x + out_w * out_h * taps_y;
+}
+
+#define NUM_COSTS 5
+
+// What a plan does, in the units of Jpeg_Cost's fields, in order. bpp is
+// the temp image's bytes per pixel.
+static void cost_inputs(const struct resize_strategy* strat, int bpp,
+    double x[NUM_COSTS])
+{
+    double src_px = (double)strat->src_width * strat->src_height;
+    double dec_px = (double)strat->decode_width * strat->decode_height;
+    bool resize = strat->resize_width != 0;
+
+    x[0] = src_px;
+    x[1] = dec_px;
+    x[2] = fast_scale(strat->scale) ? 0 : dec_px;
+    x[3] = resize ? resize_taps(strat) : 0;
+    x[4] = resize ? dec_px * bpp : 0;
+}
+
+// Seconds, per Jpeg_Cost.
+static double plan_cost(const struct resize_strategy* strat, int bpp)
+{
+    double x[NUM_COSTS];
+    cost_inputs(strat, bpp, x);
+
+    double ns = Jpeg_Cost.base * x[0] + Jpeg_Cost.decode * x[1] +
+        Jpeg_Cost.odd * x[2] + Jpeg_Cost.tap * x[3] + Jpeg_Cost.byte * x[4];
+    return ns * 1e-9;
+}
+
+// libjpeg-turbo's scales, largest first. Just 1/1 if it won't say.
+static const tjscalingfactor* scaling_factors(int* num)
+{
+    static const tjscalingfactor one = { 1, 1 };
+    const tjscalingfactor* sfs = tjGetScalingFactors(num);
+    if (sfs == 0 || *num <= 0) {
+        *num = 1;
+        return &one;
+    }
+    return sfs;
+}
+
+// Try every decode scale, and keep the cheapest plan. Decoding smaller
+// than the output and resizing up loses detail, so that's only done when
+// no scale is big enough (small jpegs on a big screen).
+static void make_resize_strategy(struct resize_strategy* strat,
+    int src_w, int src_h, int dst_w, int dst_h, int bpp)
+{
+    int num_sf;
+    const tjscalingfactor* sfs = scaling_factors(&num_sf);
 
-    struct Mapped_Jpeg* jpeg = 0;
-    tjhandle inst = 0;
+    struct resize_strategy plan;
+    struct resize_strategy largest;
+    bool found = false;
 
-    int img_w;
-    int img_h;
+    int i;
+    for (i = 0; i < num_sf; i++) {
+        plan_at_scale(&plan, sfs[i], src_w, src_h, dst_w, dst_h);
+        plan.cost = plan_cost(&plan, bpp);
 
+        if (i == 0 || plan.decode_width > largest.decode_width) {
+            largest = plan;
+        }
+        if (plan.resize_width && (plan.decode_width < plan.resize_width ||
+                                  plan.decode_height < plan.resize_height)) {
+            continue;
+        }
+        if (!found || plan.cost < strat->cost) {
+            *strat = plan;
+            found = true;
+        }
+    }
+
+    if (!found) *strat = largest;
+}
+
+// --plane-scale: instead of decoding bigger than the screen and resizing,
+// decode at the largest scale that fits and let the display scale it up.
+// Leaves strat alone if the display can't.
+static void plane_scale_strategy(struct resize_strategy* strat,
+    struct Frame_Buffer* fb, int bpp)
+{
+    int num_sf;
+    const tjscalingfactor* sfs = scaling_factors(&num_sf);
+
+    int i;
+    for (i = 0; i < num_sf; i++) {
+        int scale_w = TJSCALED(strat->src_width, sfs[i]);
+        int scale_h = TJSCALED(strat->src_height, sfs[i]);
+        if (scale_w > strat->dst_width || scale_h > strat->dst_height) continue;
+
+        int left, right, top, bottom;
+        if (!display_plane_scale(fb, scale_w, scale_h,
+                &left, &right, &top, &bottom)) {
+            return;
+        }
+
+        strat->scale = sfs[i];
+        strat->decode_width = scale_w;
+        strat->decode_height = scale_h;
+        strat->resize_width = 0;
+        strat->resize_height = 0;
+        strat->border_left = left;
+        strat->border_right = right;
+        strat->border_top = top;
+        strat->border_bottom = bottom;
+        strat->view_width = fb->view_w;
+        strat->view_height = fb->view_h;
+        strat->cost = plan_cost(strat, bpp);
+        return;
+    }
+}
+
+// A resize kept from one image to the next: stbir's samplers (its filter
+// tables), or resize_fixed()'s taps, for one geometry and pixel layout.
+struct Resize_Samplers {
+    STBIR_RESIZE rsz;
+    bool built;
+    int in_w;
+    int in_h;
+    int out_w;
+    int out_h;
+    stbir_pixel_layout layout;
+
+    struct Resize_Cache* fixed;
+};
+
+// Decoder state kept from one jpeg to the next, for streams (mjpeg:).
+// Frames of a stream are all the same size, so the resize strategy and
+// temp buffer from the first frame fit the rest.
+struct Jpeg_Decoder {
+    tjhandle inst;
+
+    // reused while the source and frame buffer sizes stay the same
     struct resize_strategy strat;
+    bool have_strat;
+
+    // RGB, and --yuv luma and chroma
+    struct Resize_Samplers rgb_resize;
+    struct Resize_Samplers luma_resize;
+    struct Resize_Samplers chroma_resize;
+
+    uint8_t* temp_pixels;
+    size_t temp_size;
+
+    // 16 bpp frame buffers: the 24 bpp image before dither_565()
+    uint8_t* out_pixels;
+    size_t out_size;
+};
+
+struct Jpeg_Decoder* jpeg_decoder_create()
+{
+    struct Jpeg_Decoder* dec = calloc(1, sizeof(struct Jpeg_Decoder));
+    if (dec == 0) {
+        fprintf(File_Error, "Error: Out of memory at line %i.\n", __LINE__);
+        return 0;
+    }
+
+    dec->inst = tjInitDecompress();
+    if (dec->inst == 0) {
+        fprintf(File_Error, "Error: tjInitDecompress(): %s\n",
+                tjGetErrorStr2(0));
+        free(dec);
+        return 0;
+    }
+    return dec;
+}
+
+static void free_samplers(struct Resize_Samplers* rs)
+{
+    if (rs->built) stbir_free_samplers(&rs->rsz);
+    rs->built = false;
+    resize_cache_free(rs->fixed);
+    rs->fixed = 0;
+}
+
+void jpeg_decoder_destroy(struct Jpeg_Decoder* dec)
+{
+    free_samplers(&dec->rgb_resize);
+    free_samplers(&dec->luma_resize);
+    free_samplers(&dec->chroma_resize);
+    if (dec->temp_pixels) mem_free(dec->temp_pixels);
+    if (dec->out_pixels) mem_free(dec->out_pixels);
+    tjDestroy(dec->inst);
+    free(dec);
+}
+
+// Grow a temp buffer to at least need bytes.
+static int reserve_temp(uint8_t** pixels, size_t* size, size_t need)
+{
+    if (need <= *size) return 0;
+
+    mem_free(*pixels);
+    *size = 0;
+    *pixels = mem_malloc(need);
+    if (*pixels == 0) {
+        fprintf(File_Error, "Error: malloc(%i MB) failed.\n",
+                (int)(need >> 20));
+        return -1;
+    }
+    *size = need;
+    return 0;
+}
+
+// Resize src to dst, with rs built for these sizes and layout. The
+// samplers are built on first use and kept until the sizes change, so
+// a run of same size frames allocates nothing here. src_w x src_h is the
+// size as stored, before turning it to orientation, which only
+// resize_fixed() can do.
+static int cached_resize(struct Resize_Samplers* rs, const uint8_t* src,
+    int src_w, int src_h, int src_stride, int orientation, uint8_t* dst,
+    int dst_w, int dst_h, int dst_stride, stbir_pixel_layout layout,
+    int channels)
+{
+    bool turned = orientation >= 5;
+    if (orientation != 1 || resize_use_fixed(turned ? src_h : src_w,
+            turned ? src_w : src_h, dst_w, dst_h)) {
+        return resize_fixed_cached(&rs->fixed, src, src_w, src_h,
+            src_stride, orientation, dst, dst_w, dst_h, dst_stride, channels,
+            false);
+    }
+
+    if (rs->built && rs->in_w == src_w && rs->in_h == src_h &&
+        rs->out_w == dst_w && rs->out_h == dst_h && rs->layout == layout) {
+        stbir_set_buffer_ptrs(&rs->rsz, src, src_stride, dst, dst_stride);
+    }
+    else {
+        if (rs->built) stbir_free_samplers(&rs->rsz);
+        rs->built = false;
+
+        stbir_resize_init(&rs->rsz, src, src_w, src_h, src_stride,
+            dst, dst_w, dst_h, dst_stride, layout, STBIR_TYPE_UINT8);
+        if (stbir_build_samplers(&rs->rsz) == 0) {
+            fprintf(File_Error, "Error: stbir_build_samplers() failed.\n");
+            return -1;
+        }
+        rs->built = true;
+        rs->in_w = src_w;
+        rs->in_h = src_h;
+        rs->out_w = dst_w;
+        rs->out_h = dst_h;
+        rs->layout = layout;
+    }
+
+    if (stbir_resize_extended(&rs->rsz) == 0) {
+        fprintf(File_Error, "Error: stbir_resize_extended() failed.\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Copy or resize one plane of 1 or 2 channel samples, turning it to
+// orientation.
+static int resize_plane(struct Resize_Samplers* rs, uint8_t* src,
+    int src_w, int src_h, int src_stride, int orientation, uint8_t* dst,
+    int dst_w, int dst_h, int dst_stride, int channels)
+{
+    if (src_w == dst_w && src_h == dst_h && orientation == 1) {
+        swizzle_copy(false, channels, src, src_w, src_h, src_stride,
+            dst, dst_stride);
+        return 0;
+    }
+    return cached_resize(rs, src, src_w, src_h, src_stride, orientation,
+        dst, dst_w, dst_h, dst_stride,
+        channels == 1 ? STBIR_1CHANNEL : STBIR_2CHANNEL, channels);
+}
+
+// Mirror and/or flip w x h pixels where they are, for orientations 2 to 4,
+// so a jpeg that needs no resize still decodes straight into place.
+static void flip_in_place(uint8_t* pixels, int w, int h, int stride,
+    int bpp, int orientation)
+{
+    bool mirror = orientation == 2 || orientation == 3;
+    bool flip = orientation == 3 || orientation == 4;
+
+    int x, y;
+    for (y = 0; y < (flip ? (h + 1) / 2 : h); y++) {
+        uint8_t* a = pixels + (size_t)y * stride;
+        uint8_t* b = pixels + (size_t)(flip ? h - 1 - y : y) * stride;
+        int n = w;
+        if (a == b) {
+            if (!mirror) continue;
+            n = w / 2;
+        }
+        for (x = 0; x < n; x++) {
+            uint8_t* pa = a + x * bpp;
+            uint8_t* pb = b + (mirror ? w - 1 - x : x) * bpp;
+            uint8_t t[4];
+            memcpy(t, pa, bpp);
+            memcpy(pa, pb, bpp);
+            memcpy(pb, t, bpp);
+        }
+    }
+}
+
+// --yuv: decode to Y, Cb and Cr planes, skipping the conversion to RGB.
+// A 4:2:0 jpeg that needs no resize goes straight into a YUV420 buffer.
+// Otherwise the planes are decoded into temp at their own sizes (chroma
+// may be 4:4:4, 4:2:2...), and luma and chroma are each resized to the
+// buffer's 4:2:0, and turned to the EXIF orientation. The image goes at
+// left, top, which must be even.
+static int decode_yuv(struct Jpeg_Decoder* dec, const unsigned char* data,
+    size_t length, int subsamp, const struct resize_strategy* strat,
+    int left, int top, struct Frame_Buffer* fb)
+{
+    double t2, t1, t0 = time_f();
+
+    tjhandle inst = dec->inst;
+    int orientation = strat->orientation;
+    bool turned = orientation >= 5;
+    int dec_w = turned ? strat->decode_height : strat->decode_width;
+    int dec_h = turned ? strat->decode_width : strat->decode_height;
+    bool resize = strat->resize_width != 0 || orientation != 1;
+    int out_w = strat->resize_width ? strat->resize_width : strat->decode_width;
+    int out_h = strat->resize_width ? strat->resize_height : strat->decode_height;
+    bool gray = subsamp == TJSAMP_GRAY;
+    bool nv12 = fb->pixel_format == DRM_FORMAT_NV12;
+
+    // libjpeg-turbo writes whole chroma samples: the luma plane is padded
+    // to even sizes for 4:2:0, with an extra column or row at odd sizes.
+    int pw = tjPlaneWidth(0, dec_w, subsamp);
+    int ph = tjPlaneHeight(0, dec_h, subsamp);
+
+    uint8_t* y_dst = get_pixels(fb, left, top);
+
+    // The padding lands in the borders, drawn afterwards, as long as it
+    // stays in the buffer.
+    if (!resize && subsamp == TJSAMP_420 && !nv12 &&
+        left + pw <= fb->width && top + ph <= fb->height) {
+        // best case, the jpeg's own planes
+        unsigned char* planes[3] = {
+            y_dst, get_chroma(fb, 0, left, top), get_chroma(fb, 1, left, top)
+        };
+        int strides[3] = { fb->stride, fb->chroma_stride, fb->chroma_stride };
+        perf_stage_begin(PERF_DECODE);
+        if (tjDecompressToYUVPlanes(inst, data, length, planes,
+                dec_w, strides, dec_h, 0) < 0) {
+            fprintf(File_Error, "Error: tjDecompressToYUVPlanes(): %s\n",
+                    tjGetErrorStr2(inst));
+            return -1;
+        }
+        perf_stage_end(PERF_DECODE);
+
+        mem_stats_sample();
+
+        if (Verbose) fprintf(File_Info, "  jpeg    %5.3f sec (yuv)\n", time_f() - t0);
+        return 0;
+    }
+
+    // temp: Y if resizing (padded), each chroma plane, and UV pairs for
+    // NV12. Y goes straight into the buffer only if its padding fits.
+    if (left + pw > fb->width || top + ph > fb->height) resize = true;
+    int cw = gray ? 0 : tjPlaneWidth(1, dec_w, subsamp);
+    int ch = gray ? 0 : tjPlaneHeight(1, dec_h, subsamp);
+    size_t y_size = resize ? (size_t)pw * ph : 0;
+    size_t c_size = (size_t)cw * ch;
+    if (reserve_temp(&dec->temp_pixels, &dec->temp_size,
+            y_size + (nv12 ? 4 : 2) * c_size)) {
+        return -1;
+    }
+
+    uint8_t* temp_y = dec->temp_pixels;
+    uint8_t* temp_u = temp_y + y_size;
+    uint8_t* temp_v = temp_u + c_size;
+    uint8_t* temp_uv = temp_v + c_size;
+
+    unsigned char* planes[3] = { resize ? temp_y : y_dst, temp_u, temp_v };
+    int strides[3] = { resize ? pw : fb->stride, cw, cw };
+    perf_stage_begin(PERF_DECODE);
+    if (tjDecompressToYUVPlanes(inst, data, length, planes,
+            dec_w, strides, dec_h, 0) < 0) {
+        fprintf(File_Error, "Error: tjDecompressToYUVPlanes(): %s\n",
+                tjGetErrorStr2(inst));
+        return -1;
+    }
+    perf_stage_end(PERF_DECODE);
+
+    t1 = time_f();
+
+    mem_stats_sample();
+
+    // chroma is half size, rounded up
+    int out_cw = (out_w + 1) / 2;
+    int out_ch = (out_h + 1) / 2;
+
+    PROBE_RESIZE_START(dec_w, dec_h, out_w, out_h);
+    perf_stage_begin(PERF_RESIZE);
+    if (resize && resize_plane(&dec->luma_resize, temp_y, dec_w, dec_h, pw,
+            orientation, y_dst, out_w, out_h, fb->stride, 1)) {
+        return -1;
+    }
+    if (gray) {
+        // no color
+        int y;
+        for (y = 0; y < out_h; y += 2) {
+            if (nv12) {
+                memset(get_chroma(fb, 0, left, top + y), 128, 2 * out_cw);
+            }
+            else {
+                memset(get_chroma(fb, 0, left, top + y), 128, out_cw);
+                memset(get_chroma(fb, 1, left, top + y), 128, out_cw);
+            }
+        }
+    }
+    else if (nv12) {
+        size_t i;
+        for (i = 0; i < c_size; i++) {
+            temp_uv[2 * i] = temp_u[i];
+            temp_uv[2 * i + 1] = temp_v[i];
+        }
+        if (resize_plane(&dec->chroma_resize, temp_uv, cw, ch, 2 * cw,
+                orientation, get_chroma(fb, 0, left, top), out_cw, out_ch,
+                fb->chroma_stride, 2)) {
+            return -1;
+        }
+    }
+    else {
+        if (resize_plane(&dec->chroma_resize, temp_u, cw, ch, cw,
+                orientation, get_chroma(fb, 0, left, top), out_cw, out_ch,
+                fb->chroma_stride, 1) ||
+            resize_plane(&dec->chroma_resize, temp_v, cw, ch, cw,
+                orientation, get_chroma(fb, 1, left, top), out_cw, out_ch,
+                fb->chroma_stride, 1)) {
+            return -1;
+        }
+    }
+    perf_stage_end(PERF_RESIZE);
+    PROBE_RESIZE_END(dec_w, dec_h, out_w, out_h);
+
+    t2 = time_f();
+
+    if (Verbose) {
+        fprintf(File_Info, "  jpeg    %5.3f sec (yuv)\n", t1 - t0);
+        fprintf(File_Info, "  resize  %5.3f sec\n", t2 - t1);
+    }
+    return 0;
+}
+
+int jpeg_decoder_decode(struct Jpeg_Decoder* dec, const char* name,
+    const unsigned char* data, size_t length, struct Frame_Buffer* fb)
+{
+    double t2, t1, t0 = time_f();
+
+    tjhandle inst = dec->inst;
 
-    uint8_t* temp_pixels = 0;
+    int img_w = 0;
+    int img_h = 0;
+
+    struct resize_strategy* strat = &dec->strat;
 
     int err = 0;
     int ret = -1;
 
-    if (Verbose) fprintf(File_Info, "\nJPEG %s\n", filename);
+    if (Verbose) fprintf(File_Info, "\nJPEG %s\n", name);
+
+    PROBE_DECODE_START("jpeg", name);
+
+    mem_stats_begin();
 
     enum TJPF dec_fmt;
-    stbir_pixel_layout rsz_fmt_in;
-    stbir_pixel_layout rsz_fmt_out;
+    stbir_pixel_layout rsz_layout;
 
     switch (fb->pixel_format) {
         case DRM_FORMAT_BGR888:
                 dec_fmt = TJPF_RGB;
-                rsz_fmt_in = STBIR_RGB;
-                rsz_fmt_out = STBIR_RGB;
+                rsz_layout = STBIR_RGB;
                 break;
 
         case DRM_FORMAT_RGB888:
                 dec_fmt = TJPF_BGR;
-                rsz_fmt_in = STBIR_BGR;
-                rsz_fmt_out = STBIR_BGR;
+                rsz_layout = STBIR_BGR;
                 break;
 
         case DRM_FORMAT_XBGR8888:
         case DRM_FORMAT_ABGR8888:
                 dec_fmt = TJPF_RGBX;
-                rsz_fmt_in = STBIR_4CHANNEL;
-                rsz_fmt_out = STBIR_4CHANNEL;
+                rsz_layout = STBIR_4CHANNEL;
                 break;
 
         case DRM_FORMAT_XRGB8888:
         case DRM_FORMAT_ARGB8888:
                 dec_fmt = TJPF_BGRX;
-                rsz_fmt_in = STBIR_4CHANNEL;
-                rsz_fmt_out = STBIR_4CHANNEL;
+                rsz_layout = STBIR_4CHANNEL;
+                break;
+
+        case DRM_FORMAT_RGB565:
+        case DRM_FORMAT_BGR565:
+                // decoded as RGB, then dither_565()
+                dec_fmt = TJPF_RGB;
+                rsz_layout = STBIR_RGB;
+                break;
+
+        case DRM_FORMAT_YUV420:
+        case DRM_FORMAT_NV12:
+                // planes, see decode_yuv()
+                dec_fmt = TJPF_GRAY;
+                rsz_layout = STBIR_1CHANNEL;
                 break;
 
         default:
@@ -248,93 +659,161 @@ int read_jpeg(const char* filename, struct Frame_Buffer* fb)
                 goto Cleanup;
     }
 
-    jpeg = jpeg_create(filename);
-    if (jpeg == 0) goto Cleanup;
-
-    inst = tjInitDecompress();
-    if (inst == 0) {
-        fprintf(File_Error, "Error: tjInitDecompress(): %s\n",
-                tjGetErrorStr2(0));
+    // Read jpeg header
+    int subsamp, color;
+    err = tjDecompressHeader3(inst, data, length,
+        &img_w, &img_h, &subsamp, &color);
+    if (err < 0) {
+        fprintf(File_Error, "Error: tjDecompressHeader3(): %s\n",
+                tjGetErrorStr2(inst));
         goto Cleanup;
     }
 
-    {
-        // Read jpeg header
-        int subsamp, color;
-        err = tjDecompressHeader3(inst, jpeg->data, jpeg->length,
-            &img_w, &img_h, &subsamp, &color);
-        if (err < 0) {
-            fprintf(File_Error, "Error: tjDecompressHeader3(): %s\n",
-                    tjGetErrorStr2(inst));
-            goto Cleanup;
+    // 16 bpp frame buffers are decoded and resized as 24 bpp
+    bool dither = fb->bytes_per_pixel == 2;
+    int bpp = dither ? 3 : fb->bytes_per_pixel;
+
+    // Phone photos are often stored sideways. Everything is planned for
+    // the image as shown.
+    int orientation = exif_orientation(data, length);
+    bool turned = orientation >= 5;
+    int show_w = turned ? img_h : img_w;
+    int show_h = turned ? img_w : img_h;
+
+    if (!dec->have_strat ||
+        strat->src_width != show_w || strat->src_height != show_h ||
+        strat->orientation != orientation ||
+        strat->dst_width != fb->width || strat->dst_height != fb->height ||
+        strat->dst_format != fb->pixel_format) {
+        make_resize_strategy(strat, show_w, show_h, fb->width, fb->height, bpp);
+        strat->orientation = orientation;
+        strat->dst_format = fb->pixel_format;
+        if (Plane_Scale && strat->resize_width) {
+            plane_scale_strategy(strat, fb, bpp);
+        }
+        dec->have_strat = true;
+
+        if (Verbose) {
+            fprintf(File_Info, "  source %5i x %5i\n", strat->src_width,    strat->src_height);
+            if (orientation != 1) {
+                fprintf(File_Info, "  orientation %i\n", orientation);
+            }
+            fprintf(File_Info, "  decode %5i x %5i  scale %i/%i\n", strat->decode_width,
+                strat->decode_height, strat->scale.num, strat->scale.denom);
+            fprintf(File_Info, "  resize %5i x %5i\n", strat->resize_width, strat->resize_height);
+            fprintf(File_Info, "  dest   %5i x %5i\n", strat->dst_width,    strat->dst_height);
+            if (strat->view_width != strat->dst_width ||
+                strat->view_height != strat->dst_height) {
+                fprintf(File_Info, "  view   %5i x %5i\n", strat->view_width, strat->view_height);
+            }
+            fprintf(File_Info, "  border  %i %i %i %i\n", strat->border_left, strat->border_right,
+                 strat->border_top, strat->border_bottom);
         }
     }
 
-    make_resize_strategy(&strat, img_w, img_h, fb->width, fb->height);
+    fb->view_w = strat->view_width;
+    fb->view_h = strat->view_height;
 
-    if (Verbose) {
-        fprintf(File_Info, "  source %5i x %5i\n", strat.src_width,    strat.src_height);
-        fprintf(File_Info, "  decode %5i x %5i\n", strat.decode_width, strat.decode_height);
-        fprintf(File_Info, "  resize %5i x %5i\n", strat.resize_width, strat.resize_height);
-        fprintf(File_Info, "  dest   %5i x %5i\n", strat.dst_width,    strat.dst_height);
-        fprintf(File_Info, "  border  %i %i %i %i\n", strat.border_left, strat.border_right,
-             strat.border_top, strat.border_bottom);
-    }
-
-    if (strat.resize_width == 0) {
-        // resize not required
-        uint8_t* pixels = get_pixels(fb, strat.border_left, strat.border_top);
-        err = tjDecompress2(inst, jpeg->data, jpeg->length,
-            pixels, strat.decode_width, fb->stride, strat.decode_height,
+    int border_left = strat->border_left;
+    int border_right = strat->border_right;
+    int border_top = strat->border_top;
+    int border_bottom = strat->border_bottom;
+
+    int out_w = strat->resize_width ? strat->resize_width : strat->decode_width;
+    int out_h = strat->resize_width ? strat->resize_height : strat->decode_height;
+
+    // the decode, as stored
+    int dec_w = turned ? strat->decode_height : strat->decode_width;
+    int dec_h = turned ? strat->decode_width : strat->decode_height;
+
+    // Where the image goes: into the frame buffer, or for 16 bpp into a
+    // 24 bpp temp that's dithered down afterwards.
+    uint8_t* out_pixels = get_pixels(fb, border_left, border_top);
+    int out_stride = fb->stride;
+    if (dither) {
+        out_stride = out_w * 3;
+        if (reserve_temp(&dec->out_pixels, &dec->out_size,
+                (size_t)out_stride * out_h)) {
+            goto Cleanup;
+        }
+        out_pixels = dec->out_pixels;
+    }
+
+    if (fb->num_planes > 1) {
+        // start on a whole 2x2 chroma sample
+        if (border_left & 1) {
+            border_left--;
+            border_right++;
+        }
+        if (border_top & 1) {
+            border_top--;
+            border_bottom++;
+        }
+        if (decode_yuv(dec, data, length, subsamp, strat,
+                border_left, border_top, fb)) {
+            goto Cleanup;
+        }
+    }
+    else if (strat->resize_width == 0 && !turned) {
+        // resize not required, and any mirror or flip is done in place
+        perf_stage_begin(PERF_DECODE);
+        err = tjDecompress2(inst, data, length,
+            out_pixels, strat->decode_width, out_stride, strat->decode_height,
             dec_fmt, 0);
         if (err < 0) {
             fprintf(File_Error, "Error: tjDecompress2(): %s\n",
                     tjGetErrorStr2(inst));
             goto Cleanup;
         }
+        perf_stage_end(PERF_DECODE);
+
+        if (orientation != 1) {
+            perf_stage_begin(PERF_RESIZE);
+            flip_in_place(out_pixels, out_w, out_h, out_stride, bpp,
+                orientation);
+            perf_stage_end(PERF_RESIZE);
+        }
 
         t1 = time_f();
 
+        mem_stats_sample();
+
         if (Verbose) fprintf(File_Info, "  jpeg    %5.3f sec\n", t1 - t0);
     }
     else {
-        // resize and temp buffer required
-        size_t temp_size = strat.decode_width * strat.decode_height * fb->bytes_per_pixel;
-        temp_pixels = malloc(temp_size);
-        if (temp_pixels == 0) {
-            fprintf(File_Error, "Error: malloc(%i MB) failed.\n",
-                    (int)(temp_size >> 20));
+        // resize (or just turn 90 degrees) and temp buffer required
+        size_t temp_size = (size_t)dec_w * dec_h * bpp;
+        if (reserve_temp(&dec->temp_pixels, &dec->temp_size, temp_size)) {
             err = -1;
             goto Cleanup;
         }
+        uint8_t* temp_pixels = dec->temp_pixels;
 
-        int decode_stride = strat.decode_width * fb->bytes_per_pixel;
-        err = tjDecompress2(inst, jpeg->data, jpeg->length,
-                temp_pixels, strat.decode_width, decode_stride, strat.decode_height,
-                dec_fmt, 0);
+        int decode_stride = dec_w * bpp;
+        perf_stage_begin(PERF_DECODE);
+        err = tjDecompress2(inst, data, length,
+                temp_pixels, dec_w, decode_stride, dec_h, dec_fmt, 0);
         if (err < 0) {
             fprintf(File_Error, "Error: tjDecompress2(): %s\n",
                     tjGetErrorStr2(inst));
             goto Cleanup;
         }
+        perf_stage_end(PERF_DECODE);
 
         t1 = time_f();
 
-        uint8_t* pixels = get_pixels(fb, strat.border_left, strat.border_top);
-        STBIR_RESIZE rsz;
-        stbir_resize_init(&rsz, temp_pixels, strat.decode_width, strat.decode_height,
-            decode_stride, pixels, strat.resize_width, strat.resize_height,
-            fb->stride, rsz_fmt_in, STBIR_TYPE_UINT8);
+        mem_stats_sample();
 
-        stbir_set_pixel_layouts(&rsz, rsz_fmt_in, rsz_fmt_out);
-
-        int ok = stbir_resize_extended(&rsz);
-        if (ok == 0) {
-            fprintf(File_Error, "Error: stbir_resize_extended() failed.\n");
-            goto Cleanup;
-        }
+        PROBE_RESIZE_START(dec_w, dec_h, out_w, out_h);
+        perf_stage_begin(PERF_RESIZE);
+        err = cached_resize(&dec->rgb_resize, temp_pixels, dec_w, dec_h,
+            decode_stride, orientation, out_pixels, out_w, out_h, out_stride,
+            rsz_layout, bpp);
+        if (err) goto Cleanup;
+        perf_stage_end(PERF_RESIZE);
+        PROBE_RESIZE_END(dec_w, dec_h, out_w, out_h);
 
-        get_pixels(fb, strat.border_left, strat.border_top)[0] = 255;
+        out_pixels[0] = 255;
 
         t2 = time_f();
 
@@ -344,17 +823,438 @@ int read_jpeg(const char* filename, struct Frame_Buffer* fb)
         }
     }
 
-    draw_borders(fb, BG_Color, strat.border_left, strat.border_right,
-        strat.border_top, strat.border_bottom);
+    if (dither) {
+        t1 = time_f();
+        perf_stage_begin(PERF_COPY);
+        dither_565(fb, out_pixels, 3, out_w, out_h, out_stride,
+            border_left, border_top);
+        perf_stage_end(PERF_COPY);
+        if (Verbose) fprintf(File_Info, "  dither  %5.3f sec\n", time_f() - t1);
+    }
+
+    perf_stage_begin(PERF_BORDER);
+    draw_borders(fb, BG_Color, border_left, border_right,
+        border_top, border_bottom);
+    perf_stage_end(PERF_BORDER);
 
     ret = 0;
 
 Cleanup:
-    if (temp_pixels) free(temp_pixels);
-    if (inst) tjDestroy(inst);
-    if (jpeg) jpeg_destroy(jpeg);
+    perf_counters_report(File_Info);
+
+    PROBE_DECODE_END("jpeg", name, img_w, img_h, ret);
+
+    if (Verbose) {
+        mem_stats_report(File_Info);
+        fprintf(File_Info, "  total   %5.3f sec, %5.3f predicted\n",
+                time_f() - t0, strat->cost);
+    }
+
+    return ret;
+}
+
+int read_jpeg(const char* filename, struct Frame_Buffer* fb)
+{
+    struct Mapped_File mf;
+    if (mapped_file_open(&mf, filename)) return -1;
+
+    int ret = read_jpeg_mem(filename, mf.data, mf.length, fb);
+
+    mapped_file_close(&mf);
+    return ret;
+}
+
+// read_jpeg() and read_jpeg_mem() keep a decoder per thread, so a run of
+// same size images (a camera snapshot loop, say) keeps its plan, samplers
+// and temp buffers. Per thread, not shared, because its buffers are
+// counted by mem_stats.c on the thread that grows and frees them: the
+// main thread and preload's worker each have their own.
+static __thread struct Jpeg_Decoder* Thread_Decoder;
+
+int read_jpeg_mem(const char* name, const void* data, size_t length,
+    struct Frame_Buffer* fb)
+{
+    if (Thread_Decoder == 0) Thread_Decoder = jpeg_decoder_create();
+    if (Thread_Decoder == 0) return -1;
+    return jpeg_decoder_decode(Thread_Decoder, name, data, length, fb);
+}
+
+// libjpeg errors jump back to read_jpeg_region() instead of exit().
+struct Jpeg_Error {
+    struct jpeg_error_mgr mgr;
+    jmp_buf jump;
+};
+
+static void jpeg_error_exit(j_common_ptr cinfo)
+{
+    struct Jpeg_Error* jerr = (struct Jpeg_Error*)cinfo->err;
+    char msg[JMSG_LENGTH_MAX];
+    cinfo->err->format_message(cinfo, msg);
+    fprintf(File_Error, "Error: libjpeg: %s\n", msg);
+    longjmp(jerr->jump, 1);
+}
+
+// The part of read_jpeg_region() that libjpeg may jump out of. Temp
+// memory comes from libjpeg's pool, freed by jpeg_destroy_decompress().
+static int decode_region(struct jpeg_decompress_struct* cinfo,
+    const char* filename, const struct Image_Rect* rect,
+    struct Frame_Buffer* fb)
+{
+    double t1, t0 = time_f();
+
+    J_COLOR_SPACE color;
+    int channels;
+    switch (fb->pixel_format) {
+        case DRM_FORMAT_BGR888:
+                color = JCS_EXT_RGB;
+                channels = 3;
+                break;
+
+        case DRM_FORMAT_RGB888:
+                color = JCS_EXT_BGR;
+                channels = 3;
+                break;
+
+        case DRM_FORMAT_XBGR8888:
+        case DRM_FORMAT_ABGR8888:
+                color = JCS_EXT_RGBX;
+                channels = 4;
+                break;
+
+        case DRM_FORMAT_XRGB8888:
+        case DRM_FORMAT_ARGB8888:
+                color = JCS_EXT_BGRX;
+                channels = 4;
+                break;
+
+        case DRM_FORMAT_RGB565:
+        case DRM_FORMAT_BGR565:
+                // decoded as RGB, then dither_565()
+                color = JCS_EXT_RGB;
+                channels = 3;
+                break;
+
+        default:
+                fprintf(File_Error, "Error: Unknown pixel format '%s'\n",
+                    four_cc_to_str(fb->pixel_format));
+                return -1;
+    }
+
+    jpeg_read_header(cinfo, TRUE);
+
+    int img_w = cinfo->image_width;
+    int img_h = cinfo->image_height;
+    struct Image_Rect r = *rect;
+    if (clip_rect(&r, img_w, img_h, filename)) return -1;
+
+    // the scale that suits the part of rect in the image, at the size
+    // draw_region() will show it
+    double k = fmin((double)fb->width / rect->w, (double)fb->height / rect->h);
+    int show_w = ceil(r.w * k);
+    int show_h = ceil(r.h * k);
+    if (show_w < 1) show_w = 1;
+    if (show_h < 1) show_h = 1;
+    struct resize_strategy strat;
+    make_resize_strategy(&strat, r.w, r.h, show_w, show_h, channels);
+
+    cinfo->scale_num = strat.scale.num;
+    cinfo->scale_denom = strat.scale.denom;
+    cinfo->out_color_space = color;
+    jpeg_start_decompress(cinfo);
+
+    // the region at that scale, rounded out to whole pixels
+    int out_w = cinfo->output_width;
+    int out_h = cinfo->output_height;
+    int x0 = (int64_t)r.x * out_w / img_w;
+    int y0 = (int64_t)r.y * out_h / img_h;
+    int x1 = ((int64_t)(r.x + r.w) * out_w + img_w - 1) / img_w;
+    int y1 = ((int64_t)(r.y + r.h) * out_h + img_h - 1) / img_h;
+    if (x1 <= x0) x1 = x0 + 1;
+    if (y1 <= y0) y1 = y0 + 1;
+
+    // libjpeg widens the crop to whole iMCUs
+    JDIMENSION crop_x = x0;
+    JDIMENSION crop_w = x1 - x0;
+    jpeg_crop_scanline(cinfo, &crop_x, &crop_w);
+
+    if (Verbose) {
+        fprintf(File_Info, "  source %5i x %5i\n", img_w, img_h);
+        fprintf(File_Info, "  region %5i x %5i  at %i,%i\n", r.w, r.h, r.x, r.y);
+        fprintf(File_Info, "  decode %5i x %5i  scale %i/%i\n", x1 - x0,
+            y1 - y0, strat.scale.num, strat.scale.denom);
+    }
+
+    size_t stride = (size_t)crop_w * channels;
+    uint8_t* temp = (*cinfo->mem->alloc_large)((j_common_ptr)cinfo,
+        JPOOL_IMAGE, stride * (y1 - y0));
+
+    perf_stage_begin(PERF_DECODE);
+    jpeg_skip_scanlines(cinfo, y0);
+    while (cinfo->output_scanline < y1) {
+        JSAMPROW row = temp + (cinfo->output_scanline - y0) * stride;
+        jpeg_read_scanlines(cinfo, &row, 1);
+    }
+    perf_stage_end(PERF_DECODE);
+
+    // the rows below are never read, jpeg_destroy_decompress() ends it
+
+    mem_stats_sample();
+
+    t1 = time_f();
+
+    if (draw_region(fb, rect, &r, temp + (x0 - crop_x) * channels, x1 - x0,
+            y1 - y0, stride, channels, false)) {
+        return -1;
+    }
+
+    if (Verbose) {
+        fprintf(File_Info, "  jpeg    %5.3f sec\n", t1 - t0);
+        fprintf(File_Info, "  resize  %5.3f sec\n", time_f() - t1);
+    }
+    return 0;
+}
+
+// zoom: uses libjpeg itself, since the TurboJPEG 2 API can't crop or skip
+// rows.
+int read_jpeg_region(const char* filename, const struct Image_Rect* rect,
+    struct Frame_Buffer* fb)
+{
+    double t0 = time_f();
+
+    if (Verbose) fprintf(File_Info, "\nJPEG %s\n", filename);
+
+    struct Mapped_File mf;
+    if (mapped_file_open(&mf, filename)) return -1;
+
+    PROBE_DECODE_START("jpeg", filename);
+
+    mem_stats_begin();
+
+    struct jpeg_decompress_struct cinfo;
+    struct Jpeg_Error jerr;
+    cinfo.err = jpeg_std_error(&jerr.mgr);
+    jerr.mgr.error_exit = jpeg_error_exit;
+
+    int ret = -1;
+    if (setjmp(jerr.jump) == 0) {
+        jpeg_create_decompress(&cinfo);
+        jpeg_mem_src(&cinfo, mf.data, mf.length);
+        ret = decode_region(&cinfo, filename, rect, fb);
+    }
+    jpeg_destroy_decompress(&cinfo);
+
+    mapped_file_close(&mf);
+
+    perf_counters_report(File_Info);
+
+    PROBE_DECODE_END("jpeg", filename, rect->w, rect->h, ret);
+
+    if (Verbose) {
+        mem_stats_report(File_Info);
+        fprintf(File_Info, "  total   %5.3f sec\n", time_f() - t0);
+    }
+    return ret;
+}
+
+// A timed plan for --calibrate.
+struct Cost_Sample {
+    struct resize_strategy plan;
+    double x[NUM_COSTS];
+    double secs;
+};
+
+#define MAX_COST_SAMPLES 64
 
-    if (Verbose) fprintf(File_Info, "  total   %5.3f sec\n", time_f() - t0);
+// Least squares fit of c (nanoseconds) to the samples, by the normal
+// equations. Columns are scaled to 1 first so pixel counts and tap counts
+// don't swamp each other, and a tiny ridge keeps a column that never
+// varies (no odd scales, say) at 0.
+static void fit_costs(const struct Cost_Sample* samples, int n,
+    double c[NUM_COSTS])
+{
+    double scale[NUM_COSTS];
+    double a[NUM_COSTS][NUM_COSTS + 1] = { { 0 } };
+    int i, j, k;
+
+    for (j = 0; j < NUM_COSTS; j++) {
+        scale[j] = 0;
+        for (k = 0; k < n; k++) {
+            if (samples[k].x[j] > scale[j]) scale[j] = samples[k].x[j];
+        }
+        if (scale[j] == 0) scale[j] = 1;
+    }
+
+    for (k = 0; k < n; k++) {
+        double x[NUM_COSTS];
+        for (j = 0; j < NUM_COSTS; j++) x[j] = samples[k].x[j] / scale[j];
+        for (i = 0; i < NUM_COSTS; i++) {
+            for (j = 0; j < NUM_COSTS; j++) a[i][j] += x[i] * x[j];
+            a[i][NUM_COSTS] += x[i] * samples[k].secs * 1e9;
+        }
+    }
+    for (i = 0; i < NUM_COSTS; i++) a[i][i] += 1e-9 * n;
+
+    // Gaussian elimination, partial pivoting
+    for (i = 0; i < NUM_COSTS; i++) {
+        int pivot = i;
+        for (k = i + 1; k < NUM_COSTS; k++) {
+            if (fabs(a[k][i]) > fabs(a[pivot][i])) pivot = k;
+        }
+        for (j = 0; j <= NUM_COSTS; j++) {
+            double t = a[i][j];
+            a[i][j] = a[pivot][j];
+            a[pivot][j] = t;
+        }
+        for (k = 0; k < NUM_COSTS; k++) {
+            if (k == i) continue;
+            double f = a[k][i] / a[i][i];
+            for (j = i; j <= NUM_COSTS; j++) a[k][j] -= f * a[i][j];
+        }
+    }
+
+    for (i = 0; i < NUM_COSTS; i++) {
+        c[i] = a[i][NUM_COSTS] / a[i][i] / scale[i];
+        // noise, e.g. from a board that's busy with something else
+        if (c[i] < 0) c[i] = 0;
+    }
+}
+
+int jpeg_calibrate(const char* filename, struct Frame_Buffer* fb)
+{
+    struct Mapped_File mf;
+    if (mapped_file_open(&mf, filename)) return -1;
+
+    struct Jpeg_Decoder* dec = jpeg_decoder_create();
+    if (dec == 0) {
+        mapped_file_close(&mf);
+        return -1;
+    }
+
+    int ret = -1;
+    int src_w, src_h, subsamp, color;
+    if (tjDecompressHeader3(dec->inst, mf.data, mf.length,
+            &src_w, &src_h, &subsamp, &color) < 0) {
+        fprintf(File_Error, "Error: tjDecompressHeader3(): %s\n",
+                tjGetErrorStr2(dec->inst));
+        jpeg_decoder_destroy(dec);
+        mapped_file_close(&mf);
+        return -1;
+    }
+
+    // planned for the image as shown, like jpeg_decoder_decode()
+    int orientation = exif_orientation(mf.data, mf.length);
+    if (orientation >= 5) {
+        int t = src_w;
+        src_w = src_h;
+        src_h = t;
+    }
+
+    int bpp = fb->bytes_per_pixel == 2 ? 3 : fb->bytes_per_pixel;
+    uint32_t fb_w = fb->width;
+    uint32_t fb_h = fb->height;
+
+    static struct Cost_Sample samples[MAX_COST_SAMPLES];
+    int n = 0;
+
+    int num_sf;
+    const tjscalingfactor* sfs = scaling_factors(&num_sf);
+
+    bool verbose = Verbose;
+    Verbose = false;
+
+    // Every scale, resized to fit the whole screen, to fit half of it, and
+    // decoded at its own size without a resize, so the decode, resize,
+    // and temp costs can be told apart. The smaller ones go in the corner
+    // of fb.
+    int pass, i, k;
+    for (pass = 0; pass < 3 && n >= 0; pass++) {
+        for (i = 0; i < num_sf && n >= 0 && n < MAX_COST_SAMPLES; i++) {
+            uint32_t w = fb_w >> (pass == 1);
+            uint32_t h = fb_h >> (pass == 1);
+            if (pass == 2) {
+                w = TJSCALED(src_w, sfs[i]);
+                h = TJSCALED(src_h, sfs[i]);
+                if (w > fb_w || h > fb_h) continue;
+            }
+            fb->width = w;
+            fb->height = h;
+
+            struct Cost_Sample* sample = &samples[n];
+            plan_at_scale(&sample->plan, sfs[i], src_w, src_h, w, h);
+
+            // way bigger than the screen would never be picked, and 2x of
+            // a big photo may not fit in memory
+            if ((double)sample->plan.decode_width * sample->plan.decode_height >
+                4.0 * fb_w * fb_h) {
+                continue;
+            }
+
+            // the decoder keeps a plan that matches the sizes
+            dec->strat = sample->plan;
+            dec->strat.orientation = orientation;
+            dec->strat.dst_format = fb->pixel_format;
+            dec->have_strat = true;
+
+            // best of 3
+            for (k = 0; k < 3; k++) {
+                double t0 = time_f();
+                if (jpeg_decoder_decode(dec, filename, mf.data, mf.length, fb)) {
+                    n = -1;
+                    break;
+                }
+                double t = time_f() - t0;
+                if (k == 0 || t < sample->secs) sample->secs = t;
+            }
+            if (n < 0) break;
+
+            // a plan made afresh would time some other scale
+            if (dec->strat.scale.num != sfs[i].num ||
+                dec->strat.scale.denom != sfs[i].denom) {
+                fprintf(File_Error, "Error: %s: Calibration plan for scale "
+                    "%i/%i not used.\n", filename, sfs[i].num, sfs[i].denom);
+                n = -1;
+                break;
+            }
+
+            cost_inputs(&sample->plan, bpp, sample->x);
+            n++;
+        }
+    }
+
+    Verbose = verbose;
+    fb->width = fb_w;
+    fb->height = fb_h;
+    frame_buffer_view_all(fb);
+
+    if (n > 0) {
+        double c[NUM_COSTS];
+        fit_costs(samples, n, c);
+        Jpeg_Cost.base = c[0];
+        Jpeg_Cost.decode = c[1];
+        Jpeg_Cost.odd = c[2];
+        Jpeg_Cost.tap = c[3];
+        Jpeg_Cost.byte = c[4];
+
+        fprintf(File_Info, "Calibrate %s, %i x %i, %u x %u '%s'\n", filename,
+            src_w, src_h, fb_w, fb_h, four_cc_to_str(fb->pixel_format));
+        fprintf(File_Info, "  scale  decode         resize         measured  predicted\n");
+        for (i = 0; i < n; i++) {
+            const struct resize_strategy* p = &samples[i].plan;
+            fprintf(File_Info, "  %2i/%-2i  %5i x %-5i  %5i x %-5i  %6.3f    %6.3f\n",
+                p->scale.num, p->scale.denom, p->decode_width, p->decode_height,
+                p->resize_width, p->resize_height,
+                samples[i].secs, plan_cost(p, bpp));
+        }
+        fprintf(File_Info, "--jpeg-cost=%.2f,%.2f,%.2f,%.3f,%.3f\n",
+            Jpeg_Cost.base, Jpeg_Cost.decode, Jpeg_Cost.odd,
+            Jpeg_Cost.tap, Jpeg_Cost.byte);
+        ret = 0;
+    }
+    else if (n == 0) {
+        fprintf(File_Error, "Error: %s: No scale to time.\n", filename);
+    }
 
+    jpeg_decoder_destroy(dec);
+    mapped_file_close(&mf);
     return ret;
 }
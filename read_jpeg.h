@@ -1,6 +1,49 @@
 #ifndef READ_JPEG_H
 #define READ_JPEG_H
 
+#include <stddef.h>
+
 int read_jpeg(const char* filename, struct Frame_Buffer* fb);
 
+// The cost model for planning a decode, in nanoseconds:
+//   base    per source pixel, for the entropy decode done at any scale
+//   decode  per decoded pixel
+//   odd     extra per decoded pixel at scales without a SIMD IDCT
+//           (anything but 1, 1/2, 1/4, 1/8)
+//   tap     per stbir_resize() filter tap
+//   byte    per byte of the temp image a resize reads
+// Set with --jpeg-cost, measured with --calibrate.
+struct Jpeg_Cost {
+    double base;
+    double decode;
+    double odd;
+    double tap;
+    double byte;
+};
+extern struct Jpeg_Cost Jpeg_Cost;
+
+// --calibrate: time decodes of filename into fb at every scale, fit
+// Jpeg_Cost to them, and print the --jpeg-cost option to use.
+int jpeg_calibrate(const char* filename, struct Frame_Buffer* fb);
+
+// A jpeg file that's already in memory. name is for messages.
+int read_jpeg_mem(const char* name, const void* data, size_t length,
+    struct Frame_Buffer* fb);
+
+// zoom: decode just rect of the jpeg into fb, scaled to fit.
+struct Image_Rect;
+int read_jpeg_region(const char* filename, const struct Image_Rect* rect,
+    struct Frame_Buffer* fb);
+
+// For decoding a stream of jpegs (mjpeg:). Keeps the turbojpeg handle,
+// resize strategy, and temp buffer from one frame to the next.
+struct Jpeg_Decoder;
+
+struct Jpeg_Decoder* jpeg_decoder_create();
+void jpeg_decoder_destroy(struct Jpeg_Decoder* dec);
+
+// Decode a jpeg in memory into fb. name is for messages.
+int jpeg_decoder_decode(struct Jpeg_Decoder* dec, const char* name,
+    const unsigned char* data, size_t length, struct Frame_Buffer* fb);
+
 #endif
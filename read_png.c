@@ -9,12 +9,28 @@
 
 #include "stb_image_resize2.h"
 
+#include "display.h"
 #include "drm_search.h"
 #include "frame_buffer.h"
+#include "mapped_file.h"
+#include "mem_stats.h"
+#include "perf_counters.h"
+#include "probes.h"
+#include "region.h"
+#include "resize.h"
 #include "util.h"
 #include "read_png.h"
 
-int read_png(const char* filename, struct Frame_Buffer* fb)
+// Route libspng's allocations through the tracked heap.
+static struct spng_alloc Png_Alloc = {
+    .malloc_fn = mem_malloc,
+    .realloc_fn = mem_realloc,
+    .calloc_fn = mem_calloc,
+    .free_fn = mem_free
+};
+
+int read_png_mem(const char* filename, const void* data, size_t length,
+    struct Frame_Buffer* fb)
 {
     double t0 = 0;
     double t1 = 0;
@@ -25,13 +41,20 @@ int read_png(const char* filename, struct Frame_Buffer* fb)
         fprintf(File_Info, "\nPNG %s\n", filename);
     }
 
-    FILE* png_file = 0;
+    mem_stats_begin();
+
+    PROBE_DECODE_START("png", filename);
+
     spng_ctx* ctx = 0;
     uint8_t* temp_pixels = 0;
+    uint8_t* out_pixels = 0;
     size_t temp_size;
     int ret = 0;
     int err = 0;
 
+    // 16 bpp frame buffers get RGB, dithered down
+    bool dither = fb->bytes_per_pixel == 2;
+
     int img_w = 0;
     int img_h = 0;
 
@@ -76,29 +99,30 @@ int read_png(const char* filename, struct Frame_Buffer* fb)
                 rsz_fmt_out = STBIR_BGRA_PM;
                 break;
 
+        case DRM_FORMAT_RGB565:
+        case DRM_FORMAT_BGR565:
+                // decoded as RGB, then dither_565()
+                dec_fmt = SPNG_FMT_RGB8;
+                rsz_fmt_in = STBIR_RGB;
+                rsz_fmt_out = STBIR_RGB;
+                break;
+
         default:
                 fprintf(File_Error, "Error: Unknown pixel format '%s'\n",
                     four_cc_to_str(fb->pixel_format));
                 goto Cleanup;
     }
 
-    png_file = fopen(filename, "rb");
-    if (png_file == 0) {
-        fprintf(File_Error, "Error: Can't open png file %s\n", filename);
-        ret = -1;
-        goto Cleanup;
-    }
-
-    ctx = spng_ctx_new(0);
+    ctx = spng_ctx_new2(&Png_Alloc, 0);
     if (ctx == 0) {
-        fprintf(File_Error, "Error: spng_ctx_new(0) failed.\n");
+        fprintf(File_Error, "Error: spng_ctx_new2(0) failed.\n");
         ret = -1;
         goto Cleanup;
     }
 
-    err = spng_set_png_file(ctx, png_file);
+    err = spng_set_png_buffer(ctx, data, length);
     if (err) {
-        fprintf(File_Error, "Error: spng_set_png_file() %s\n",
+        fprintf(File_Error, "Error: spng_set_png_buffer() %s\n",
                 spng_strerror(err));
         ret = -1;
         goto Cleanup;
@@ -127,12 +151,22 @@ int read_png(const char* filename, struct Frame_Buffer* fb)
         fprintf(File_Info, "  source %5i x %5i\n", img_w, img_h);
     }
 
-    if (img_w == dst_w && img_h <= dst_h && rsz_fmt_in == rsz_fmt_out) {
+    frame_buffer_view_all(fb);
+
+    // --plane-scale: smaller images go on the screen as they are, and the
+    // display scales them up
+    bool plane = img_w < dst_w && img_h < dst_h &&
+        display_plane_scale(fb, img_w, img_h,
+            &border_left, &border_right, &border_top, &border_bottom);
+
+    if (img_w == dst_w && img_h <= dst_h && rsz_fmt_in == rsz_fmt_out &&
+        !dither) {
         // direct decode to framebuffer
         // widths must match since libspng doesn't do stride
         split_border(dst_h - img_h, &border_top, &border_bottom);
 
         uint8_t* pixels = get_pixels(fb, 0, border_top);
+        perf_stage_begin(PERF_DECODE);
         err = spng_decode_image(ctx, pixels, temp_size, dec_fmt, 0);
         if (err) {
             fprintf(File_Error, "Error: spng_decoded_image_size() %s\n",
@@ -140,6 +174,7 @@ int read_png(const char* filename, struct Frame_Buffer* fb)
             ret = -1;
             goto Cleanup;
         }
+        perf_stage_end(PERF_DECODE);
 
         if (Verbose) {
             t1 = time_f();
@@ -150,19 +185,22 @@ int read_png(const char* filename, struct Frame_Buffer* fb)
         }
     }
     else if ((img_w <  dst_w && img_h == dst_h) ||
-             (img_w == dst_w && img_h <= dst_h))
+             (img_w == dst_w && img_h <= dst_h) || plane)
     {
         // need a temp buffer because different row sizes or format
         // but do not need to resample
-        split_border(dst_w - img_w, &border_left, &border_right);
-        split_border(dst_h - img_h, &border_top, &border_bottom);
+        if (!plane) {
+            split_border(dst_w - img_w, &border_left, &border_right);
+            split_border(dst_h - img_h, &border_top, &border_bottom);
+        }
 
-        temp_pixels = malloc(temp_size);
+        temp_pixels = mem_malloc(temp_size);
         if (temp_pixels == 0) {
             fprintf(File_Error, "Error: malloc(%i MB) failed.\n",
                     (int)(temp_size >> 20));
         }
 
+        perf_stage_begin(PERF_DECODE);
         err = spng_decode_image(ctx, temp_pixels, temp_size, dec_fmt, 0);
         if (err) {
             fprintf(File_Error, "Error: spng_decoded_image_size() %s\n",
@@ -170,16 +208,28 @@ int read_png(const char* filename, struct Frame_Buffer* fb)
             ret = -1;
             goto Cleanup;
         }
+        perf_stage_end(PERF_DECODE);
 
         if (Verbose) t1 = time_f();
 
-        swizzle_copy(rsz_fmt_in != rsz_fmt_out, fb->bytes_per_pixel,
-            temp_pixels, img_w, img_h, img_w * fb->bytes_per_pixel,
-            get_pixels(fb, border_left, border_top), fb->stride);
+        perf_stage_begin(PERF_COPY);
+        if (dither) {
+            dither_565(fb, temp_pixels, 3, img_w, img_h, img_w * 3,
+                border_left, border_top);
+        }
+        else {
+            swizzle_copy(rsz_fmt_in != rsz_fmt_out, fb->bytes_per_pixel,
+                temp_pixels, img_w, img_h, img_w * fb->bytes_per_pixel,
+                get_pixels(fb, border_left, border_top), fb->stride);
+        }
+        perf_stage_end(PERF_COPY);
 
         if (Verbose) {
             t2 = time_f();
             fprintf(File_Info, "  dest   %5i x %5i\n", fb->width, fb->height);
+            if (plane) {
+                fprintf(File_Info, "  view   %5i x %5i\n", fb->view_w, fb->view_h);
+            }
             fprintf(File_Info, "  border  %i %i %i %i\n",
                     border_left, border_right, border_top, border_bottom);
             fprintf(File_Info, "  png    %6.3f sec\n", t1 - t0);
@@ -207,7 +257,8 @@ int read_png(const char* filename, struct Frame_Buffer* fb)
                 &border_left, &border_right);
         }
 
-        temp_pixels = malloc(temp_size);
+        temp_pixels = mem_malloc(temp_size);
+        perf_stage_begin(PERF_DECODE);
         err = spng_decode_image(ctx, temp_pixels, temp_size, dec_fmt, 0);
         if (err) {
             fprintf(File_Error, "Error: spng_decoded_image_size() %s\n",
@@ -215,23 +266,59 @@ int read_png(const char* filename, struct Frame_Buffer* fb)
             ret = -1;
             goto Cleanup;
         }
+        perf_stage_end(PERF_DECODE);
 
         if (Verbose) t1 = time_f();
 
         uint8_t* pixels = get_pixels(fb, border_left, border_top);
-        STBIR_RESIZE rsz;
-        stbir_resize_init(&rsz, temp_pixels, img_w, img_h, 0,
-            pixels, resize_width, resize_height, fb->stride,
-            rsz_fmt_in, STBIR_TYPE_UINT8);
-
-        // swap channels
-        stbir_set_pixel_layouts(&rsz, rsz_fmt_in, rsz_fmt_out);
+        int stride = fb->stride;
+        if (dither) {
+            stride = resize_width * 3;
+            out_pixels = mem_malloc((size_t)stride * resize_height);
+            if (out_pixels == 0) {
+                fprintf(File_Error, "Error: malloc(%i MB) failed.\n",
+                        (int)(((size_t)stride * resize_height) >> 20));
+                ret = -1;
+                goto Cleanup;
+            }
+            pixels = out_pixels;
+        }
 
-        int ok = stbir_resize_extended(&rsz);
-        if (ok == 0) {
-            fprintf(File_Error, "Error: stbir_resize_extended() failed.\n");
-            ret = -1;
-            goto Cleanup;
+        PROBE_RESIZE_START(img_w, img_h, resize_width, resize_height);
+        perf_stage_begin(PERF_RESIZE);
+        if (resize_use_fixed(img_w, img_h, resize_width, resize_height)) {
+            int channels = (dec_fmt == SPNG_FMT_RGBA8 ? 4 : 3);
+            if (resize_fixed(temp_pixels, img_w, img_h, img_w * channels,
+                    pixels, resize_width, resize_height, stride, channels,
+                    rsz_fmt_in != rsz_fmt_out)) {
+                ret = -1;
+                goto Cleanup;
+            }
+        }
+        else {
+            STBIR_RESIZE rsz;
+            stbir_resize_init(&rsz, temp_pixels, img_w, img_h, 0,
+                pixels, resize_width, resize_height, stride,
+                rsz_fmt_in, STBIR_TYPE_UINT8);
+
+            // swap channels
+            stbir_set_pixel_layouts(&rsz, rsz_fmt_in, rsz_fmt_out);
+
+            int ok = stbir_resize_extended(&rsz);
+            if (ok == 0) {
+                fprintf(File_Error, "Error: stbir_resize_extended() failed.\n");
+                ret = -1;
+                goto Cleanup;
+            }
+        }
+        perf_stage_end(PERF_RESIZE);
+        PROBE_RESIZE_END(img_w, img_h, resize_width, resize_height);
+
+        if (dither) {
+            perf_stage_begin(PERF_COPY);
+            dither_565(fb, out_pixels, 3, resize_width, resize_height, stride,
+                border_left, border_top);
+            perf_stage_end(PERF_COPY);
         }
 
         if (Verbose) {
@@ -245,16 +332,192 @@ int read_png(const char* filename, struct Frame_Buffer* fb)
         }
     }
 
+    perf_stage_begin(PERF_BORDER);
     draw_borders(fb, BG_Color, border_left, border_right, border_top, border_bottom);
+    perf_stage_end(PERF_BORDER);
 
     ret = 0;
 
 Cleanup:
-    if (temp_pixels) free(temp_pixels);
+    if (temp_pixels) mem_free(temp_pixels);
+    if (out_pixels) mem_free(out_pixels);
     if (ctx) spng_ctx_free(ctx);
-    if (png_file) fclose(png_file);
 
-    if (Verbose) fprintf(File_Info, "  total  %6.3f sec\n", time_f() - t0);
+    perf_counters_report(File_Info);
+
+    PROBE_DECODE_END("png", filename, img_w, img_h, ret);
+
+    if (Verbose) {
+        mem_stats_report(File_Info);
+        fprintf(File_Info, "  total  %6.3f sec\n", time_f() - t0);
+    }
+
+    return ret;
+}
+
+int read_png(const char* filename, struct Frame_Buffer* fb)
+{
+    struct Mapped_File mf;
+    if (mapped_file_open(&mf, filename)) return -1;
+
+    int ret = read_png_mem(filename, mf.data, mf.length, fb);
+
+    mapped_file_close(&mf);
+    return ret;
+}
+
+// zoom: rows are inflated one at a time, and only those in rect are kept.
+// Decoding stops after the last of them, unless the png is interlaced.
+int read_png_region(const char* filename, const struct Image_Rect* rect,
+    struct Frame_Buffer* fb)
+{
+    double t0 = 0;
+    double t1 = 0;
+
+    if (Verbose) {
+        t0 = time_f();
+        fprintf(File_Info, "\nPNG %s\n", filename);
+    }
+
+    struct Mapped_File mf;
+    if (mapped_file_open(&mf, filename)) return -1;
+
+    mem_stats_begin();
+
+    PROBE_DECODE_START("png", filename);
+
+    spng_ctx* ctx = 0;
+    uint8_t* rows = 0;
+    uint8_t* skip_row = 0;
+    int ret = -1;
+    int err = 0;
+
+    struct Image_Rect r = *rect;
+
+    enum spng_format dec_fmt;
+    int channels;
+    bool swizzle;
+    switch (fb->pixel_format) {
+        case DRM_FORMAT_BGR888:
+        case DRM_FORMAT_RGB565:
+        case DRM_FORMAT_BGR565:
+                dec_fmt = SPNG_FMT_RGB8;
+                channels = 3;
+                swizzle = false;
+                break;
+
+        case DRM_FORMAT_RGB888:
+                dec_fmt = SPNG_FMT_RGB8;
+                channels = 3;
+                swizzle = true;
+                break;
+
+        case DRM_FORMAT_XBGR8888:
+        case DRM_FORMAT_ABGR8888:
+                dec_fmt = SPNG_FMT_RGBA8;
+                channels = 4;
+                swizzle = false;
+                break;
+
+        case DRM_FORMAT_XRGB8888:
+        case DRM_FORMAT_ARGB8888:
+                dec_fmt = SPNG_FMT_RGBA8;
+                channels = 4;
+                swizzle = true;
+                break;
+
+        default:
+                fprintf(File_Error, "Error: Unknown pixel format '%s'\n",
+                    four_cc_to_str(fb->pixel_format));
+                goto Cleanup;
+    }
+
+    ctx = spng_ctx_new2(&Png_Alloc, 0);
+    if (ctx == 0) {
+        fprintf(File_Error, "Error: spng_ctx_new2(0) failed.\n");
+        goto Cleanup;
+    }
+
+    struct spng_ihdr ihdr;
+    err = spng_set_png_buffer(ctx, mf.data, mf.length);
+    if (err == 0) err = spng_get_ihdr(ctx, &ihdr);
+    if (err) {
+        fprintf(File_Error, "Error: spng_get_ihdr() %s\n",
+                spng_strerror(err));
+        goto Cleanup;
+    }
+    if (clip_rect(&r, ihdr.width, ihdr.height, filename)) goto Cleanup;
+
+    if (Verbose) {
+        fprintf(File_Info, "  source %5i x %5i\n", ihdr.width, ihdr.height);
+        fprintf(File_Info, "  region %5i x %5i  at %i,%i\n", r.w, r.h, r.x, r.y);
+    }
+
+    // Whole rows, since an interlaced png fills in each row over several
+    // passes.
+    size_t row_len = (size_t)ihdr.width * channels;
+    rows = mem_malloc(row_len * r.h);
+    skip_row = mem_malloc(row_len);
+    if (rows == 0 || skip_row == 0) {
+        fprintf(File_Error, "Error: malloc(%i MB) failed.\n",
+                (int)((row_len * r.h) >> 20));
+        goto Cleanup;
+    }
+
+    perf_stage_begin(PERF_DECODE);
+    err = spng_decode_image(ctx, 0, 0, dec_fmt, SPNG_DECODE_PROGRESSIVE);
+    while (err == 0) {
+        struct spng_row_info info;
+        err = spng_get_row_info(ctx, &info);
+        if (err) break;
+
+        int y = info.row_num;
+        bool keep = y >= r.y && y < r.y + r.h;
+        err = spng_decode_row(ctx,
+            keep ? rows + (y - r.y) * row_len : skip_row, row_len);
+
+        if (err == 0 && ihdr.interlace_method == 0 && y >= r.y + r.h - 1) {
+            // that was the last row needed
+            break;
+        }
+    }
+    if (err && err != SPNG_EOI) {
+        fprintf(File_Error, "Error: spng_decode_row() %s\n",
+                spng_strerror(err));
+        goto Cleanup;
+    }
+    perf_stage_end(PERF_DECODE);
+
+    mem_stats_sample();
+
+    if (Verbose) t1 = time_f();
+
+    if (draw_region(fb, rect, &r, rows + r.x * channels, r.w, r.h, row_len,
+            channels, swizzle)) {
+        goto Cleanup;
+    }
+
+    if (Verbose) {
+        fprintf(File_Info, "  decode %6.3f sec\n", t1 - t0);
+        fprintf(File_Info, "  resize %6.3f sec\n", time_f() - t1);
+    }
+
+    ret = 0;
+
+Cleanup:
+    if (rows) mem_free(rows);
+    if (skip_row) mem_free(skip_row);
+    if (ctx) spng_ctx_free(ctx);
+    mapped_file_close(&mf);
+
+    perf_counters_report(File_Info);
+
+    PROBE_DECODE_END("png", filename, r.w, r.h, ret);
+
+    if (Verbose) {
+        mem_stats_report(File_Info);
+        fprintf(File_Info, "  total  %6.3f sec\n", time_f() - t0);
+    }
 
     return ret;
 }
@@ -280,8 +543,14 @@ int write_png(const char* filename, struct Frame_Buffer* fb)
     const uint8_t* pixel_src;
     uint8_t* pixel_dst;
 
-    int img_w = fb->width;
-    int img_h = fb->height;
+    if (fb->num_planes > 1) {
+        fprintf(File_Error, "Error: Can't save a YUV frame buffer (--yuv).\n");
+        return -1;
+    }
+
+    // just what's on the screen
+    int img_w = fb->view_w;
+    int img_h = fb->view_h;
 
     struct spng_ihdr ihdr = { 0 };
     ihdr.width = img_w;
@@ -375,6 +644,27 @@ int write_png(const char* filename, struct Frame_Buffer* fb)
             pixel_src += fb->stride - 4 * img_w;
         }
     }
+    else if (fb->pixel_format == DRM_FORMAT_RGB565 ||
+             fb->pixel_format == DRM_FORMAT_BGR565)
+    {
+        // widen with the top bits repeated, so white stays 255
+        int r_shift = fb->red_first ? 0 : 11;
+        int b_shift = 11 - r_shift;
+        int x, y;
+        for (y = 0; y < img_h; y++) {
+            const uint16_t* p = (const uint16_t*)pixel_src;
+            for (x = 0; x < img_w; x++) {
+                uint8_t r = 31 & (p[x] >> r_shift);
+                uint8_t g = 63 & (p[x] >> 5);
+                uint8_t b = 31 & (p[x] >> b_shift);
+                pixel_dst[0] = r << 3 | r >> 2;
+                pixel_dst[1] = g << 2 | g >> 4;
+                pixel_dst[2] = b << 3 | b >> 2;
+                pixel_dst += 3;
+            }
+            pixel_src += fb->stride;
+        }
+    }
     else {
         fprintf(File_Error, "Error: Unknown pixel format '%s'\n",
             four_cc_to_str(fb->pixel_format));
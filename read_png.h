@@ -1,8 +1,19 @@
 #ifndef READ_PNG_H
 #define READ_PNG_H
 
+#include <stddef.h>
+
 int read_png(const char* filename, struct Frame_Buffer* fb);
 
+// A png file that's already in memory. name is for messages.
+int read_png_mem(const char* name, const void* data, size_t length,
+    struct Frame_Buffer* fb);
+
+// zoom: decode just rect of the png into fb, scaled to fit.
+struct Image_Rect;
+int read_png_region(const char* filename, const struct Image_Rect* rect,
+    struct Frame_Buffer* fb);
+
 int write_png(const char* filename, struct Frame_Buffer* fb);
 
 #endif
@@ -0,0 +1,166 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "stb_image_resize2.h"
+
+#include "frame_buffer.h"
+#include "mem_stats.h"
+#include "perf_counters.h"
+#include "resize.h"
+#include "util.h"
+#include "region.h"
+
+int parse_rect(const char* s, struct Image_Rect* rect)
+{
+    int n = 0;
+    if (sscanf(s, "%i,%i,%i,%i%n", &rect->x, &rect->y, &rect->w, &rect->h,
+            &n) != 4 || s[n] != 0 || rect->w <= 0 || rect->h <= 0) {
+        return -1;
+    }
+    return 0;
+}
+
+int clip_rect(struct Image_Rect* rect, int img_w, int img_h,
+    const char* filename)
+{
+    int x0 = rect->x < 0 ? 0 : rect->x;
+    int y0 = rect->y < 0 ? 0 : rect->y;
+    int x1 = rect->x + rect->w > img_w ? img_w : rect->x + rect->w;
+    int y1 = rect->y + rect->h > img_h ? img_h : rect->y + rect->h;
+    if (x1 <= x0 || y1 <= y0) {
+        fprintf(File_Error, "Error: %i,%i,%i,%i is outside %s (%i x %i)\n",
+                rect->x, rect->y, rect->w, rect->h, filename, img_w, img_h);
+        return -1;
+    }
+
+    rect->x = x0;
+    rect->y = y0;
+    rect->w = x1 - x0;
+    rect->h = y1 - y0;
+    return 0;
+}
+
+int draw_region(struct Frame_Buffer* fb, const struct Image_Rect* rect,
+    const struct Image_Rect* part, const uint8_t* pixels, int w, int h,
+    int stride, int channels, bool swizzle)
+{
+    int dst_w = fb->width;
+    int dst_h = fb->height;
+
+    // fit rect to fb, preserving aspect ratio
+    int fit_w;
+    int fit_h;
+    int fit_x = 0;
+    int fit_y = 0;
+    if ((int64_t)rect->w * dst_h > (int64_t)rect->h * dst_w) {
+        fit_w = dst_w;
+        fit_h = (int64_t)rect->h * dst_w / rect->w;
+        if (fit_h < 1) fit_h = 1;
+        fit_y = (dst_h - fit_h) / 2;
+    }
+    else {
+        fit_w = (int64_t)rect->w * dst_h / rect->h;
+        if (fit_w < 1) fit_w = 1;
+        fit_h = dst_h;
+        fit_x = (dst_w - fit_w) / 2;
+    }
+
+    // part goes where it is in rect, and the rest is border
+    int x0 = fit_x + (int64_t)(part->x - rect->x) * fit_w / rect->w;
+    int y0 = fit_y + (int64_t)(part->y - rect->y) * fit_h / rect->h;
+    int x1 = fit_x + (int64_t)(part->x + part->w - rect->x) * fit_w / rect->w;
+    int y1 = fit_y + (int64_t)(part->y + part->h - rect->y) * fit_h / rect->h;
+    if (x1 <= x0) x1 = x0 + 1;
+    if (y1 <= y0) y1 = y0 + 1;
+
+    int resize_width = x1 - x0;
+    int resize_height = y1 - y0;
+    int border_left = x0;
+    int border_right = dst_w - x1;
+    int border_top = y0;
+    int border_bottom = dst_h - y1;
+
+    if (Verbose) {
+        fprintf(File_Info, "  resize %5i x %5i\n", resize_width, resize_height);
+        fprintf(File_Info, "  dest   %5i x %5i\n", fb->width, fb->height);
+        fprintf(File_Info, "  border  %i %i %i %i\n", border_left, border_right,
+                                                  border_top, border_bottom);
+    }
+
+    frame_buffer_view_all(fb);
+
+    // 16 bpp frame buffers get RGB, dithered down
+    bool dither = fb->bytes_per_pixel == 2;
+    uint8_t* out_pixels = 0;
+    uint8_t* dst = get_pixels(fb, border_left, border_top);
+    int dst_stride = fb->stride;
+    if (dither) {
+        dst_stride = resize_width * 3;
+        out_pixels = mem_malloc((size_t)dst_stride * resize_height);
+        if (out_pixels == 0) {
+            fprintf(File_Error, "Error: malloc(%i MB) failed.\n",
+                    (int)(((size_t)dst_stride * resize_height) >> 20));
+            return -1;
+        }
+        dst = out_pixels;
+    }
+
+    int ret = -1;
+
+    if (resize_width == w && resize_height == h) {
+        perf_stage_begin(PERF_COPY);
+        swizzle_copy(swizzle, channels, (uint8_t*)pixels, w, h, stride,
+            dst, dst_stride);
+        perf_stage_end(PERF_COPY);
+    }
+    else {
+        perf_stage_begin(PERF_RESIZE);
+        if (resize_use_fixed(w, h, resize_width, resize_height)) {
+            if (resize_fixed(pixels, w, h, stride, dst, resize_width,
+                    resize_height, dst_stride, channels, swizzle)) {
+                goto Cleanup;
+            }
+        }
+        else {
+            stbir_pixel_layout fmt_in = STBIR_RGB;
+            stbir_pixel_layout fmt_out = swizzle ? STBIR_BGR : STBIR_RGB;
+            if (channels == 4) {
+                fmt_in = swizzle ? STBIR_RGBA_PM : STBIR_4CHANNEL;
+                fmt_out = swizzle ? STBIR_BGRA_PM : STBIR_4CHANNEL;
+            }
+
+            STBIR_RESIZE rsz;
+            stbir_resize_init(&rsz, pixels, w, h, stride,
+                dst, resize_width, resize_height, dst_stride,
+                fmt_in, STBIR_TYPE_UINT8);
+
+            // swap channels
+            stbir_set_pixel_layouts(&rsz, fmt_in, fmt_out);
+
+            if (stbir_resize_extended(&rsz) == 0) {
+                fprintf(File_Error, "Error: stbir_resize_extended() failed.\n");
+                goto Cleanup;
+            }
+        }
+        perf_stage_end(PERF_RESIZE);
+    }
+
+    if (dither) {
+        perf_stage_begin(PERF_COPY);
+        dither_565(fb, out_pixels, 3, resize_width, resize_height, dst_stride,
+            border_left, border_top);
+        perf_stage_end(PERF_COPY);
+    }
+
+    perf_stage_begin(PERF_BORDER);
+    draw_borders(fb, BG_Color, border_left, border_right, border_top,
+        border_bottom);
+    perf_stage_end(PERF_BORDER);
+
+    ret = 0;
+
+Cleanup:
+    if (out_pixels) mem_free(out_pixels);
+    return ret;
+}
@@ -0,0 +1,45 @@
+#ifndef REGION_H
+#define REGION_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// zoom:file:x,y,w,h shows part of an image, scaled to fit the screen.
+//
+// The readers decode as little of the file as they can. libjpeg-turbo
+// picks a scale for the region the way read_jpeg() does for a whole
+// image, crops the columns to the iMCUs under it, and skips the rows
+// above it without running the IDCT. pngs stop inflating after its last
+// row. Tiled heifs (iPhone photos are grids of 512x512) decode only the
+// tiles under it, with libheif 1.19 or later.
+
+// A rectangle of image pixels.
+struct Image_Rect {
+    int x;
+    int y;
+    int w;
+    int h;
+};
+
+// read_jpeg_region(), read_png_region(), read_heif_region()
+typedef int Region_Reader(const char* filename, const struct Image_Rect* rect,
+    struct Frame_Buffer* fb);
+
+// Parse "x,y,w,h". Returns -1 if it isn't one.
+int parse_rect(const char* s, struct Image_Rect* rect);
+
+// Clip rect to an img_w x img_h image, leaving the part of it inside.
+// Returns -1, with a message, if none of it is in the image.
+int clip_rect(struct Image_Rect* rect, int img_w, int img_h,
+    const char* filename);
+
+// Draw rect of an image, scaled to fit fb with bgcolor borders. part is
+// the piece of rect inside the image, decoded as w x h pixels of 3 or 4
+// channels; it goes where it is in rect, and the rest of rect is bgcolor.
+// swizzle swaps channels 0 and 2. 16 bpp frame buffers take 3 channel RGB,
+// dithered down.
+int draw_region(struct Frame_Buffer* fb, const struct Image_Rect* rect,
+    const struct Image_Rect* part, const uint8_t* pixels, int w, int h,
+    int stride, int channels, bool swizzle);
+
+#endif
@@ -0,0 +1,467 @@
+#include <math.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "mem_stats.h"
+#include "util.h"
+#include "resize.h"
+
+enum Resizer_Choice Resizer = RESIZER_AUTO;
+
+// ARMv6 and older 32 bit arm without NEON: stbir's float code is scalar.
+#if defined(__arm__) && !defined(__ARM_NEON) && !defined(__ARM_NEON__)
+#define SLOW_FLOAT 1
+#else
+#define SLOW_FLOAT 0
+#endif
+
+bool resize_use_fixed(int src_w, int src_h, int dst_w, int dst_h)
+{
+    if (Resizer == RESIZER_FIXED) return true;
+    if (Resizer == RESIZER_STBIR) return false;
+    if (SLOW_FLOAT) return true;
+    return dst_w > 0 && dst_h > 0 &&
+        src_w % dst_w == 0 && src_h % dst_h == 0;
+}
+
+// Weights are Q14, summing to exactly 1 << 14.
+#define WEIGHT_BITS 14
+#define WEIGHT_ONE (1 << WEIGHT_BITS)
+#define WEIGHT_HALF (1 << (WEIGHT_BITS - 1))
+
+// Filter taps for one dimension: output pixel i takes count[i] source
+// pixels from start[i], with weights[i * max ...].
+struct Taps {
+    int max;
+    int* start;
+    int* count;
+    int16_t* weights;
+};
+
+static void free_taps(struct Taps* t)
+{
+    mem_free(t->start);
+    mem_free(t->count);
+    mem_free(t->weights);
+    memset(t, 0, sizeof(*t));
+}
+
+struct Resize_Cache {
+    int src_w;
+    int src_h;
+    int dst_w;
+    int dst_h;
+    int channels;
+
+    // general ratios
+    struct Taps h;
+    struct Taps v;
+    uint8_t* ring;
+    int* ring_row;
+
+    // sums for one output row
+    int32_t* acc;
+};
+
+static void clear_cache(struct Resize_Cache* c)
+{
+    free_taps(&c->h);
+    free_taps(&c->v);
+    mem_free(c->ring);
+    mem_free(c->ring_row);
+    mem_free(c->acc);
+    memset(c, 0, sizeof(*c));
+}
+
+void resize_cache_free(struct Resize_Cache* cache)
+{
+    if (cache == 0) return;
+    clear_cache(cache);
+    mem_free(cache);
+}
+
+// Tent filter, one source pixel wide when enlarging, as wide as the ratio
+// when shrinking. Taps off the edge are dropped and the rest renormalized.
+static int build_taps(struct Taps* t, int n_src, int n_dst)
+{
+    double scale = (double)n_src / n_dst;
+    double support = scale > 1 ? scale : 1;
+
+    t->max = (int)ceil(2 * support) + 1;
+    t->start = mem_malloc(n_dst * sizeof(int));
+    t->count = mem_malloc(n_dst * sizeof(int));
+    t->weights = mem_malloc((size_t)n_dst * t->max * sizeof(int16_t));
+    if (t->start == 0 || t->count == 0 || t->weights == 0) {
+        fprintf(File_Error, "Error: Out of memory at line %i.\n", __LINE__);
+        free_taps(t);
+        return -1;
+    }
+
+    int i, j;
+    for (i = 0; i < n_dst; i++) {
+        double center = (i + 0.5) * scale - 0.5;
+        int lo = (int)floor(center - support) + 1;
+        int hi = (int)floor(center + support);
+        if (lo < 0) lo = 0;
+        if (hi > n_src - 1) hi = n_src - 1;
+        if (hi < lo) hi = lo;
+        if (hi - lo + 1 > t->max) hi = lo + t->max - 1;
+
+        double w[hi - lo + 1];
+        double sum = 0;
+        for (j = lo; j <= hi; j++) {
+            w[j - lo] = 1 - fabs(j - center) / support;
+            if (w[j - lo] < 0) w[j - lo] = 0;
+            sum += w[j - lo];
+        }
+
+        int16_t* q = t->weights + (size_t)i * t->max;
+        int total = 0;
+        int biggest = 0;
+        for (j = 0; j <= hi - lo; j++) {
+            q[j] = sum > 0 ? (int)(w[j] / sum * WEIGHT_ONE + 0.5) : 0;
+            total += q[j];
+            if (q[j] > q[biggest]) biggest = j;
+        }
+        // rounding leftovers go to the center tap
+        q[biggest] += WEIGHT_ONE - total;
+
+        t->start[i] = lo;
+        t->count[i] = hi - lo + 1;
+    }
+    return 0;
+}
+
+// The source as shown: pixel (x, y) is at base + x * step_x + y * step_y.
+// EXIF orientations just change the steps, so a rotated image is read in
+// rotated order and the output is still written a row at a time.
+struct Src_View {
+    const uint8_t* base;
+    ptrdiff_t step_x;
+    ptrdiff_t step_y;
+};
+
+static struct Src_View orient_src(const uint8_t* src, int src_w, int src_h,
+    int src_stride, int channels, int orientation)
+{
+    ptrdiff_t c = channels;
+    ptrdiff_t s = src_stride;
+    ptrdiff_t right = (ptrdiff_t)(src_w - 1) * c;
+    ptrdiff_t bottom = (ptrdiff_t)(src_h - 1) * s;
+    struct Src_View v;
+    switch (orientation) {
+        case 2:  v.base = src + right;          v.step_x = -c; v.step_y = s;  break;
+        case 3:  v.base = src + right + bottom; v.step_x = -c; v.step_y = -s; break;
+        case 4:  v.base = src + bottom;         v.step_x = c;  v.step_y = -s; break;
+        case 5:  v.base = src;                  v.step_x = s;  v.step_y = c;  break;
+        case 6:  v.base = src + bottom;         v.step_x = -s; v.step_y = c;  break;
+        case 7:  v.base = src + right + bottom; v.step_x = -s; v.step_y = -c; break;
+        case 8:  v.base = src + right;          v.step_x = s;  v.step_y = -c; break;
+        default: v.base = src;                  v.step_x = c;  v.step_y = s;  break;
+    }
+    return v;
+}
+
+// Output columns done at a time. Turned 90 degrees (orientations 5 to 8),
+// each output row reads down source columns, a cache line per pixel. A
+// band of output columns touches few enough source lines (about 64) that
+// they're still in L1 for the next output row, which reads the pixels
+// beside them. Otherwise the band is the whole row.
+static int band_width(const struct Src_View* src, int channels, int dst_w,
+    int src_per_dst)
+{
+    if (src->step_x == channels || src->step_x == -channels) return dst_w;
+    int band = 64 / src_per_dst;
+    if (band < 8) band = 8;
+    return band < dst_w ? band : dst_w;
+}
+
+static void store_pixels(uint8_t* dst, const int32_t* acc, int n,
+    int channels, bool swizzle)
+{
+    int i;
+    for (i = 0; i < n * channels; i++) {
+        int v = (acc[i] + WEIGHT_HALF) >> WEIGHT_BITS;
+        dst[i] = v < 0 ? 0 : v > 255 ? 255 : v;
+    }
+    if (swizzle) {
+        for (i = 0; i < n; i++, dst += channels) {
+            uint8_t t = dst[0];
+            dst[0] = dst[2];
+            dst[2] = t;
+        }
+    }
+}
+
+// Output pixels x0 to x1 of one source row, pixels step_x apart, filtered
+// horizontally into dst.
+static void resize_row(const uint8_t* src, ptrdiff_t step_x, uint8_t* dst,
+    int x0, int x1, int channels, const struct Taps* h)
+{
+    int x, k, c;
+    for (x = x0; x < x1; x++) {
+        const uint8_t* s = src + h->start[x] * step_x;
+        const int16_t* w = h->weights + (size_t)x * h->max;
+        int32_t acc[4] = { WEIGHT_HALF, WEIGHT_HALF, WEIGHT_HALF, WEIGHT_HALF };
+        for (k = 0; k < h->count[x]; k++) {
+            for (c = 0; c < channels; c++) acc[c] += w[k] * s[c];
+            s += step_x;
+        }
+        for (c = 0; c < channels; c++) *dst++ = acc[c] >> WEIGHT_BITS;
+    }
+}
+
+// General ratios. Source rows are filtered horizontally once each, into
+// a ring big enough for one output row's vertical taps.
+static void resize_filter(struct Resize_Cache* c, const struct Src_View* src,
+    uint8_t* dst, int dst_stride, bool swizzle)
+{
+    const struct Taps* v = &c->v;
+    int channels = c->channels;
+    size_t row_bytes = (size_t)c->dst_w * channels;
+    int band = band_width(src, channels, c->dst_w,
+        (c->src_w + c->dst_w - 1) / c->dst_w);
+
+    int i, k, x0, y;
+    for (x0 = 0; x0 < c->dst_w; x0 += band) {
+        int x1 = x0 + band < c->dst_w ? x0 + band : c->dst_w;
+        size_t off = (size_t)x0 * channels;
+        size_t end = (size_t)x1 * channels;
+
+        for (i = 0; i < v->max; i++) c->ring_row[i] = -1;
+
+        for (y = 0; y < c->dst_h; y++) {
+            memset(c->acc + off, 0, (end - off) * sizeof(int32_t));
+
+            const int16_t* w = v->weights + (size_t)y * v->max;
+            for (k = 0; k < v->count[y]; k++) {
+                // rows come in order, so a ring of v->max never collides
+                int sy = v->start[y] + k;
+                int slot = sy % v->max;
+                uint8_t* row = c->ring + slot * row_bytes;
+                if (c->ring_row[slot] != sy) {
+                    resize_row(src->base + sy * src->step_y, src->step_x,
+                        row + off, x0, x1, channels, &c->h);
+                    c->ring_row[slot] = sy;
+                }
+
+                int32_t wk = w[k];
+                size_t n;
+                for (n = off; n < end; n++) c->acc[n] += wk * row[n];
+            }
+
+            store_pixels(dst + (size_t)y * dst_stride + off, c->acc + off,
+                x1 - x0, channels, swizzle);
+        }
+    }
+}
+
+// Four 8 bit channels in the 16 bit lanes of a 64 bit int, so sums of up
+// to 256 pixels add all four at once. No NEON needed.
+static inline uint64_t spread_4x8(uint32_t p)
+{
+    uint64_t x = p;
+    x = (x | x << 16) & 0x0000ffff0000ffffull;
+    x = (x | x << 8) & 0x00ff00ff00ff00ffull;
+    return x;
+}
+
+static inline uint32_t pack_4x8(uint64_t x)
+{
+    x &= 0x00ff00ff00ff00ffull;
+    x = (x | x >> 8) & 0x0000ffff0000ffffull;
+    x = (x | x >> 16) & 0x00000000ffffffffull;
+    return x;
+}
+
+// 4 channels, kx * ky a power of two up to 256: sum and shift in lanes.
+static void box_4x8(const struct Src_View* src, uint8_t* dst, int dst_w,
+    int dst_h, int dst_stride, int kx, int ky, bool swizzle)
+{
+    int shift = 0;
+    while ((1 << shift) < kx * ky) shift++;
+    uint64_t round = (uint64_t)((1 << shift) >> 1) * 0x0001000100010001ull;
+
+    int band = band_width(src, 4, dst_w, kx);
+
+    int x, x0, y, i, j;
+    for (x0 = 0; x0 < dst_w; x0 += band) {
+        int x1 = x0 + band < dst_w ? x0 + band : dst_w;
+        for (y = 0; y < dst_h; y++) {
+            const uint8_t* s = src->base + (ptrdiff_t)y * ky * src->step_y;
+            uint8_t* d = dst + (size_t)y * dst_stride;
+            for (x = x0; x < x1; x++) {
+                uint64_t sum = round;
+                for (j = 0; j < ky; j++) {
+                    const uint8_t* p = s + j * src->step_y +
+                        (ptrdiff_t)x * kx * src->step_x;
+                    for (i = 0; i < kx; i++) {
+                        uint32_t px;
+                        memcpy(&px, p + i * src->step_x, 4);
+                        sum += spread_4x8(px);
+                    }
+                }
+                uint32_t out = pack_4x8(sum >> shift);
+                if (swizzle) {
+                    out = (out & 0xff00ff00) | (out & 0xff) << 16 |
+                          (out >> 16 & 0xff);
+                }
+                memcpy(d + x * 4, &out, 4);
+            }
+        }
+    }
+}
+
+// 4 channels, and a power of two pixels in each box up to 256.
+static bool box_4x8_ok(const struct Resize_Cache* c)
+{
+    int n = (c->src_w / c->dst_w) * (c->src_h / c->dst_h);
+    return c->channels == 4 && n <= 256 && (n & (n - 1)) == 0;
+}
+
+// Exact integer ratios: each output pixel is the average of a kx by ky
+// box of source pixels.
+static void resize_box(struct Resize_Cache* c, const struct Src_View* src,
+    uint8_t* dst, int dst_stride, bool swizzle)
+{
+    int dst_w = c->dst_w;
+    int channels = c->channels;
+    int kx = c->src_w / dst_w;
+    int ky = c->src_h / c->dst_h;
+    int n = kx * ky;
+
+    if (box_4x8_ok(c)) {
+        box_4x8(src, dst, dst_w, c->dst_h, dst_stride, kx, ky, swizzle);
+        return;
+    }
+
+    uint32_t* acc = (uint32_t*)c->acc;
+    int band = band_width(src, channels, dst_w, kx);
+
+    int x, x0, y, i, j, ch;
+    for (x0 = 0; x0 < dst_w; x0 += band) {
+        int x1 = x0 + band < dst_w ? x0 + band : dst_w;
+        size_t band_bytes = (size_t)(x1 - x0) * channels;
+
+        for (y = 0; y < c->dst_h; y++) {
+            memset(acc, 0, band_bytes * sizeof(uint32_t));
+            for (j = 0; j < ky; j++) {
+                const uint8_t* s = src->base +
+                    ((ptrdiff_t)y * ky + j) * src->step_y +
+                    (ptrdiff_t)x0 * kx * src->step_x;
+                uint32_t* a = acc;
+                for (x = x0; x < x1; x++) {
+                    for (i = 0; i < kx; i++) {
+                        for (ch = 0; ch < channels; ch++) a[ch] += s[ch];
+                        s += src->step_x;
+                    }
+                    a += channels;
+                }
+            }
+
+            uint8_t* d = dst + (size_t)y * dst_stride + (size_t)x0 * channels;
+            for (i = 0; i < band_bytes; i++) d[i] = (acc[i] + n / 2) / n;
+            if (swizzle) {
+                for (x = x0; x < x1; x++, d += channels) {
+                    uint8_t t = d[0];
+                    d[0] = d[2];
+                    d[2] = t;
+                }
+            }
+        }
+    }
+}
+
+// Set up c for a resize of this size, unless it already is.
+static int prepare_cache(struct Resize_Cache* c, int src_w, int src_h,
+    int dst_w, int dst_h, int channels)
+{
+    if (c->src_w == src_w && c->src_h == src_h && c->dst_w == dst_w &&
+        c->dst_h == dst_h && c->channels == channels) {
+        return 0;
+    }
+
+    clear_cache(c);
+
+    c->src_w = src_w;
+    c->src_h = src_h;
+    c->dst_w = dst_w;
+    c->dst_h = dst_h;
+    c->channels = channels;
+
+    size_t row_bytes = (size_t)dst_w * channels;
+    if (src_w % dst_w == 0 && src_h % dst_h == 0) {
+        if (box_4x8_ok(c)) return 0;
+        c->acc = mem_malloc(row_bytes * sizeof(uint32_t));
+    }
+    else {
+        if (build_taps(&c->h, src_w, dst_w) ||
+            build_taps(&c->v, src_h, dst_h)) {
+            c->src_w = 0;
+            return -1;
+        }
+        c->ring = mem_malloc(c->v.max * row_bytes);
+        c->ring_row = mem_malloc(c->v.max * sizeof(int));
+        c->acc = mem_malloc(row_bytes * sizeof(int32_t));
+        if (c->ring == 0 || c->ring_row == 0) {
+            mem_free(c->acc);
+            c->acc = 0;
+        }
+    }
+    if (c->acc == 0) {
+        fprintf(File_Error, "Error: Out of memory at line %i.\n", __LINE__);
+        c->src_w = 0;
+        return -1;
+    }
+    return 0;
+}
+
+int resize_fixed_cached(struct Resize_Cache** cache, const uint8_t* src,
+    int src_w, int src_h, int src_stride, int orientation, uint8_t* dst,
+    int dst_w, int dst_h, int dst_stride, int channels, bool swizzle)
+{
+    if (*cache == 0) {
+        *cache = mem_malloc(sizeof(struct Resize_Cache));
+        if (*cache == 0) {
+            fprintf(File_Error, "Error: Out of memory at line %i.\n", __LINE__);
+            return -1;
+        }
+        memset(*cache, 0, sizeof(struct Resize_Cache));
+    }
+
+    struct Src_View view = orient_src(src, src_w, src_h, src_stride, channels,
+        orientation);
+    if (orientation >= 5) {
+        // transposed
+        int t = src_w;
+        src_w = src_h;
+        src_h = t;
+    }
+
+    struct Resize_Cache* c = *cache;
+    if (prepare_cache(c, src_w, src_h, dst_w, dst_h, channels)) return -1;
+
+    if (channels < 3) swizzle = false;
+
+    if (src_w % dst_w == 0 && src_h % dst_h == 0) {
+        resize_box(c, &view, dst, dst_stride, swizzle);
+    }
+    else {
+        resize_filter(c, &view, dst, dst_stride, swizzle);
+    }
+    return 0;
+}
+
+int resize_fixed(const uint8_t* src, int src_w, int src_h, int src_stride,
+    uint8_t* dst, int dst_w, int dst_h, int dst_stride, int channels,
+    bool swizzle)
+{
+    struct Resize_Cache* cache = 0;
+    int ret = resize_fixed_cached(&cache, src, src_w, src_h, src_stride, 1,
+        dst, dst_w, dst_h, dst_stride, channels, swizzle);
+    resize_cache_free(cache);
+    return ret;
+}
@@ -0,0 +1,49 @@
+#ifndef RESIZE_H
+#define RESIZE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// An 8 bit fixed point image resizer, for when stb_image_resize2's float
+// pipeline is more than the job needs.
+//
+// Exact integer ratios (2:1, 3:1, 4:2...) average boxes of pixels, which
+// is also what a good filter comes to at those ratios. Anything else uses
+// a separable tent filter, as wide as the ratio when shrinking, with Q14
+// weights and integer math only. The Pi Zero and Pi 1 (ARMv6) have no
+// NEON, and stbir is slow there; this isn't.
+
+// --resizer=
+enum Resizer_Choice {
+    RESIZER_AUTO,  // fixed for integer ratios, or if the CPU has no SIMD
+    RESIZER_STBIR, // always stb_image_resize2
+    RESIZER_FIXED  // always resize_fixed()
+};
+extern enum Resizer_Choice Resizer;
+
+// Whether the readers should use resize_fixed() for this resize.
+bool resize_use_fixed(int src_w, int src_h, int dst_w, int dst_h);
+
+// Resize 1 to 4 channel 8 bit pixels. Alpha is filtered like the others.
+// swizzle swaps channels 0 and 2, for RGB to BGR. Returns -1 if out of
+// memory.
+int resize_fixed(const uint8_t* src, int src_w, int src_h, int src_stride,
+    uint8_t* dst, int dst_w, int dst_h, int dst_stride, int channels,
+    bool swizzle);
+
+// Taps and work buffers kept from one resize_fixed_cached() to the next,
+// so a stream of same size images sets up once. Starts as 0.
+struct Resize_Cache;
+
+// resize_fixed(), reusing *cache if it was set up for the same sizes and
+// channels, and (re)building it otherwise. src is turned to its EXIF
+// orientation (1 to 8, 1 is as stored) as it is read, with no separate
+// rotation pass or buffer: src_w x src_h is its size as stored, dst_w x
+// dst_h as shown.
+int resize_fixed_cached(struct Resize_Cache** cache, const uint8_t* src,
+    int src_w, int src_h, int src_stride, int orientation, uint8_t* dst,
+    int dst_w, int dst_h, int dst_stride, int channels, bool swizzle);
+
+void resize_cache_free(struct Resize_Cache* cache);
+
+#endif
@@ -1,3 +1,6 @@
 #include <stdio.h>
+#include "mem_stats.h"
+#define STBIR_MALLOC(size,user_data) ((void)(user_data), mem_malloc(size))
+#define STBIR_FREE(ptr,user_data)    ((void)(user_data), mem_free(ptr))
 #define STB_IMAGE_RESIZE_IMPLEMENTATION
 #include "stb_image_resize2.h"
@@ -9,7 +9,7 @@ volatile bool Quit = false;
 
 bool Verbose = false;
 
-uint32_t BG_Color = 0;
+__thread uint32_t BG_Color = 0;
 
 FILE* File_Info;
 FILE* File_Error;
@@ -46,6 +46,25 @@ void sleep_f(double secs)
     }
 }
 
+double monotonic_f()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+void sleep_until_f(double t)
+{
+    struct timespec ts;
+    ts.tv_sec = t;
+    ts.tv_nsec = (t - ts.tv_sec) * 1e9;
+    while (!Quit) {
+        int err = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, 0);
+        if (err != EINTR) break;
+        // else interrupted, but the deadline is the same
+    }
+}
+
 static void ctrl_c_handler(int signum)
 {
     Quit = true;
@@ -12,15 +12,26 @@ extern volatile bool Quit;
 extern bool Verbose;
 
 // Background color for border around images.
-extern uint32_t BG_Color;
+// Per thread, so a preload keeps the color it was queued with.
+extern __thread uint32_t BG_Color;
 
 // stdout and stderr
 extern FILE* File_Info;
 extern FILE* File_Error;
 
+// Seconds since the first call, which main() makes before any thread
+// starts.
 double time_f();
 void sleep_f(double secs);
 
+// CLOCK_MONOTONIC in seconds, the same clock as the kernel's page flip
+// timestamps. For absolute deadlines.
+double monotonic_f();
+
+// Sleep until monotonic_f() reaches t. Doesn't drift, no matter how late
+// the caller was in getting here. Returns early on ctrl-c.
+void sleep_until_f(double t);
+
 // Sets Quit = true on ctrl-c.
 void install_ctrl_c_handler();
 
@@ -0,0 +1,104 @@
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include "mapped_file.h"
+#include "util.h"
+#include "watch.h"
+
+static int Inotify_Fd = -1;
+static char* Watch_Command = 0;
+static char* Watch_Name = 0; // file name within the watched directory
+
+int watch_start(const char* command, const char* filename)
+{
+    watch_stop();
+
+    // Watch the directory. A watch on the file itself would follow the
+    // old inode away when a new file is renamed over it.
+    char dir[PATH_MAX];
+    const char* name = strrchr(filename, '/');
+    if (name) {
+        size_t n = name - filename;
+        if (n == 0) n = 1; // "/file"
+        if (n >= sizeof(dir)) {
+            fprintf(File_Error, "Error: Path too long: %s\n", filename);
+            return -1;
+        }
+        memcpy(dir, filename, n);
+        dir[n] = 0;
+        name++;
+    }
+    else {
+        strcpy(dir, ".");
+        name = filename;
+    }
+
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0) {
+        fprintf(File_Error, "Error: inotify_init1(): %s\n", strerror(errno));
+        return -1;
+    }
+
+    if (inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        fprintf(File_Error, "Error: inotify_add_watch(%s): %s\n", dir,
+                strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    Inotify_Fd = fd;
+    Watch_Command = strdup(command);
+    Watch_Name = strdup(name);
+
+    // it can change under a mapping
+    mapped_file_read_instead(filename);
+    return 0;
+}
+
+void watch_stop()
+{
+    if (Inotify_Fd < 0) return;
+
+    close(Inotify_Fd);
+    mapped_file_read_instead(0);
+    free(Watch_Command);
+    free(Watch_Name);
+    Inotify_Fd = -1;
+    Watch_Command = 0;
+    Watch_Name = 0;
+}
+
+int watch_fd()
+{
+    return Inotify_Fd;
+}
+
+const char* watch_check()
+{
+    if (Inotify_Fd < 0) return 0;
+
+    // Drain everything, so a burst of rewrites decodes only the last one.
+    bool changed = false;
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (1) {
+        ssize_t len = read(Inotify_Fd, buf, sizeof(buf));
+        if (len < 0 && errno == EINTR) continue;
+        if (len <= 0) break;
+
+        char* p = buf;
+        while (p < buf + len) {
+            struct inotify_event* ev = (struct inotify_event*)p;
+            if (ev->len > 0 && !strcmp(ev->name, Watch_Name)) {
+                changed = true;
+            }
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+    }
+    return changed ? Watch_Command : 0;
+}
@@ -0,0 +1,29 @@
+#ifndef WATCH_H
+#define WATCH_H
+
+// watch:path
+//
+// Show an image again every time its file has been completely rewritten,
+// e.g. a camera snapshot. Uses inotify on the file's directory, so it
+// sees both writers that rewrite the file in place (IN_CLOSE_WRITE) and
+// writers that rename() a finished temp file over it (IN_MOVED_TO).
+// Half-written files are never shown, and an unchanged file is never
+// decoded again.
+//
+// One file is watched at a time.
+
+// Start watching filename. command is what to run when it changes,
+// e.g. "jpeg:/tmp/snap.jpg". Replaces any previous watch.
+int watch_start(const char* command, const char* filename);
+
+// Stop watching.
+void watch_stop();
+
+// The inotify file descriptor to poll, or -1 when not watching.
+int watch_fd();
+
+// Read all pending events. If the file was rewritten (once or many times),
+// returns the command to run, otherwise 0.
+const char* watch_check();
+
+#endif